@@ -0,0 +1,27 @@
+epicsEnvSet("PREFIX",    "QE1:")
+epicsEnvSet("RECORD",    "Soft:")
+epicsEnvSet("PORT",      "Soft")
+epicsEnvSet("TEMPLATE",  "SoftQuadEM")
+epicsEnvSet("QSIZE",     "20")
+epicsEnvSet("RING_SIZE", "10000")
+epicsEnvSet("TSPOINTS",  "2048")
+
+drvSoftQuadEMConfigure("$(PORT)", $(RING_SIZE))
+dbLoadRecords("$(QUADEM)/db/$(TEMPLATE).template", "P=$(PREFIX), R=$(RECORD), PORT=$(PORT), ADDR=0, TIMEOUT=1")
+iocshLoad("$(QUADEM)/iocsh/quadEMLatency.iocsh", "PREFIX=$(PREFIX), INSTANCE=$(PORT)")
+
+< $(QUADEM)/iocBoot/quadEM_Plugins.cmd
+
+asynSetTraceIOMask("$(PORT)",0,2)
+# Enable ASYN_TRACE_ERROR and ASYN_TRACE_WARNING
+#asynSetTraceMask("$(PORT)",  0, 0x21)
+
+< $(QUADEM)/iocBoot/saveRestore.cmd
+
+iocInit()
+
+# save settings every thirty seconds
+create_monitor_set("auto_settings.req",30,"P=$(PREFIX), R=$(RECORD)")
+
+# Uncomment this line to run the benchmark when the IOC starts. See benchmark.cmd.
+#< benchmark.cmd
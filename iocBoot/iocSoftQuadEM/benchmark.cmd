@@ -0,0 +1,13 @@
+# Benchmark of the quadEM base class and the IOC host with the synthetic data generator in drvSoftQuadEM.
+# drvSoftQuadEMBenchmark(portName, sample rate, seconds per test, "NumAverage list")
+# prints samples/s, CPU time per sample, ring buffer overflows, samples the generator missed,
+# NDArray callbacks per second and the callback latency for each NumAverage.
+# The plugins that are enabled are included in the test, so run it again after enabling or disabling plugins
+# to measure different plugin chains.  ValuesPerRead is the number of samples per call to computePositionsBlock().
+
+dbpf("$(PREFIX)$(RECORD)ValuesPerRead", "10")
+drvSoftQuadEMBenchmark("$(PORT)", 10000, 5, "1 10 100 1000")
+drvSoftQuadEMBenchmark("$(PORT)", 100000, 5, "10 100 1000 10000")
+
+dbpf("$(PREFIX)$(RECORD)ValuesPerRead", "100")
+drvSoftQuadEMBenchmark("$(PORT)", 500000, 5, "100 1000 10000")
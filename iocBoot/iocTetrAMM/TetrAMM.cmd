@@ -23,6 +23,8 @@ asynSetTraceIOTruncateSize("IP_$(PORT)", 0, 4000)
 dbLoadRecords("$(ASYN)/db/asynRecord.db", "P=$(PREFIX), R=asyn1,PORT=IP_$(PORT),ADDR=0,OMAX=256,IMAX=256")
 
 drvTetrAMMConfigure("$(PORT)", "IP_$(PORT)", $(RING_SIZE))
+# On Linux the binary data can be received with the driver's own socket rather than the asyn IP port
+#drvTetrAMMConfigure("$(PORT)", "IP_$(PORT)", $(RING_SIZE), "$(IP)")
 dbLoadRecords("$(QUADEM)/db/$(TEMPLATE).template", "P=$(PREFIX), R=$(RECORD), PORT=$(PORT), ADDR=0, TIMEOUT=1")
 
 < $(QUADEM)/iocBoot/quadEM_Plugins.cmd
@@ -149,6 +149,7 @@ void drvFX4::onMessageEvent(const std::string& event, const json& data) {
     std::multiset<sortedListElement> eventList;
     double values[4]={0}, times[4];
     size_t minSize, maxSize;
+    std::vector<double> block;
 
 
     if (!data.empty()) {
@@ -159,6 +160,9 @@ void drvFX4::onMessageEvent(const std::string& event, const json& data) {
     if (!acquiring_) return;
 
     if (event != "update") goto done;
+    lock();
+    readComplete();
+    unlock();
     for (auto& [path, vals] : data.items()) {
         int chan=0;
         bool isGate = (path == GATE_PATH);
@@ -230,8 +234,17 @@ void drvFX4::onMessageEvent(const std::string& event, const json& data) {
     }
 
     // We now have a time-sorted list of ADC values and gate events
+    // Each sample in the block is the 4 ADC values followed by the device time, which is used for the sample timestamps
+    // ADC values are accumulated into a block which is processed before each gate event and at the end
+    block.reserve(eventList.size() * FX4_BLOCK_STRIDE);
     for (const sortedListElement& element: eventList) {
         if (element.eventType == gateEvent) {
+            if (!block.empty()) {
+                lock();
+                computePositionsBlock(block.data(), block.size()/FX4_BLOCK_STRIDE, FX4_BLOCK_STRIDE, 4);
+                unlock();
+                block.clear();
+            }
             gateLevel_ = (gateLevel_t)element.values[0];
             if (triggerMode_ == QETriggerModeExtTrigger) {
                 if (((triggerPolarity_ == QETriggerPolarityPositive) && (gateLevel_ == gateLevelHigh)) ||
@@ -269,8 +282,12 @@ void drvFX4::onMessageEvent(const std::string& event, const json& data) {
             if ((triggerPolarity_ == QETriggerPolarityNegative) && (gateLevel_ == gateLevelHigh)) continue;
         }
 
+        block.insert(block.end(), element.values, element.values+4);
+        block.push_back(element.timeStamp);
+    }
+    if (!block.empty()) {
         lock();
-        computePositions((double*)element.values);
+        computePositionsBlock(block.data(), block.size()/FX4_BLOCK_STRIDE, FX4_BLOCK_STRIDE, 4);
         unlock();
     }
     done:
@@ -14,6 +14,7 @@
 #include <websocketpp/client.hpp>
 #include <json.hpp>
 #include <list>
+#include <vector>
 
 using json = nlohmann::json;
 using websocketpp::connection_hdl;
@@ -40,6 +41,9 @@ typedef struct {
     double time;
 } ADCSample;
 
+// Number of values per sample in the blocks passed to computePositionsBlock, the 4 ADC values and the time
+#define FX4_BLOCK_STRIDE 5
+
 class sortedListElement {
     public:
         sortedListElement(eventType_t et, double vals[4], double ts)
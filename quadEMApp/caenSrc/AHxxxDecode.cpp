@@ -0,0 +1,476 @@
+/*
+ * AHxxxDecode.cpp
+ *
+ * Decoders for the binary data stream from the AH401 and AH501 series.
+ * See AHxxxDecode.h for a description.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include <epicsTypes.h>
+#include <epicsThread.h>
+#include <epicsTime.h>
+#include <iocsh.h>
+
+#include <epicsExport.h>
+#include "AHxxxDecode.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+  #define AHXXX_DECODE_X86
+  #include <immintrin.h>
+#endif
+
+int AHxxxDecodeBytes(int format)
+{
+    return (format == AHxxxFormat501_16) ? 2 : 3;
+}
+
+/** Returns the value at p.  The sign of the AH501 values is inverted by sign extending and negating them,
+  * which gives the same result as -value for positive values and 2^N - value for negative values. */
+static inline epicsInt32 decodeValue(const unsigned char *p, int format)
+{
+    switch (format) {
+        case AHxxxFormat401:
+            return (p[2]<<16) | (p[1]<<8) | p[0];
+        case AHxxxFormat501_16:
+            return -(epicsInt32)(epicsInt16)((p[0]<<8) | p[1]);
+        default:
+            return -((epicsInt32)(((epicsUInt32)p[0]<<24) | (p[1]<<16) | (p[2]<<8)) >> 8);
+    }
+}
+
+static inline void decodeScalarFormat(const unsigned char *in, size_t numSamples, int numChannels,
+                                      double *samples, int format)
+{
+    int numBytes = AHxxxDecodeBytes(format);
+    double *pOut;
+    size_t i;
+    int j;
+
+    for (i=0; i<numSamples; i++) {
+        pOut = samples + i*AHXXX_MAX_CHANNELS;
+        for (j=0; j<numChannels; j++) {
+            pOut[j] = decodeValue(in, format);
+            in += numBytes;
+        }
+        for (; j<AHXXX_MAX_CHANNELS; j++) pOut[j] = 0.;
+    }
+}
+
+static void decodeScalar401(const unsigned char *in, size_t numSamples, int numChannels, double *samples)
+{
+    decodeScalarFormat(in, numSamples, numChannels, samples, AHxxxFormat401);
+}
+
+static void decodeScalar501_16(const unsigned char *in, size_t numSamples, int numChannels, double *samples)
+{
+    decodeScalarFormat(in, numSamples, numChannels, samples, AHxxxFormat501_16);
+}
+
+static void decodeScalar501_24(const unsigned char *in, size_t numSamples, int numChannels, double *samples)
+{
+    decodeScalarFormat(in, numSamples, numChannels, samples, AHxxxFormat501_24);
+}
+
+#ifdef AHXXX_DECODE_X86
+
+/** Returns the shuffle that moves the bytes of 4 values into 32-bit lanes, and the shift and sign mask that
+  * sign extend and negate them.  The AH401 values are zero extended, the AH501 values are put in the top of
+  * each lane so the arithmetic shift sign extends them. */
+__attribute__((target("ssse3")))
+static inline void decodeConstants(int format, __m128i *mask, __m128i *shift, __m128i *sign)
+{
+    switch (format) {
+        case AHxxxFormat401:
+            *mask = _mm_setr_epi8(0, 1, 2, -1,  3, 4, 5, -1,  6, 7, 8, -1,  9, 10, 11, -1);
+            *shift = _mm_cvtsi32_si128(0);
+            *sign = _mm_setzero_si128();
+            break;
+        case AHxxxFormat501_16:
+            *mask = _mm_setr_epi8(-1, -1, 1, 0,  -1, -1, 3, 2,  -1, -1, 5, 4,  -1, -1, 7, 6);
+            *shift = _mm_cvtsi32_si128(16);
+            *sign = _mm_set1_epi32(-1);
+            break;
+        default:
+            *mask = _mm_setr_epi8(-1, 2, 1, 0,  -1, 5, 4, 3,  -1, 8, 7, 6,  -1, 11, 10, 9);
+            *shift = _mm_cvtsi32_si128(8);
+            *sign = _mm_set1_epi32(-1);
+            break;
+    }
+}
+
+// Each loop converts 4 values, which is 1, 2 or 4 complete samples.  Other numbers of channels use the scalar code.
+__attribute__((target("ssse3")))
+static inline void decodeSSSE3Format(const unsigned char *in, size_t numSamples, int numChannels,
+                                     double *samples, int format)
+{
+    int numBytes = AHxxxDecodeBytes(format);
+    const unsigned char *end = in + numSamples*numChannels*numBytes;
+    size_t groupSamples, nOut=0;
+    double *pOut = samples;
+    const __m128d zero = _mm_setzero_pd();
+    __m128i mask, shift, sign, v;
+    __m128d lo, hi;
+
+    decodeConstants(format, &mask, &shift, &sign);
+    if ((AHXXX_MAX_CHANNELS % numChannels) == 0) {
+        groupSamples = AHXXX_MAX_CHANNELS / numChannels;
+        // Each load reads 16 bytes, which can be more than the 4 values
+        while (in + 16 <= end) {
+            v = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)in), mask);
+            v = _mm_sra_epi32(v, shift);
+            v = _mm_sub_epi32(_mm_xor_si128(v, sign), sign);
+            lo = _mm_cvtepi32_pd(v);
+            hi = _mm_cvtepi32_pd(_mm_shuffle_epi32(v, _MM_SHUFFLE(3, 2, 3, 2)));
+            switch (numChannels) {
+                case 4:
+                    _mm_storeu_pd(pOut,     lo);
+                    _mm_storeu_pd(pOut + 2, hi);
+                    break;
+                case 2:
+                    _mm_storeu_pd(pOut,     lo);
+                    _mm_storeu_pd(pOut + 2, zero);
+                    _mm_storeu_pd(pOut + 4, hi);
+                    _mm_storeu_pd(pOut + 6, zero);
+                    break;
+                default:
+                    _mm_storeu_pd(pOut,      _mm_unpacklo_pd(lo, zero));
+                    _mm_storeu_pd(pOut + 2,  zero);
+                    _mm_storeu_pd(pOut + 4,  _mm_unpackhi_pd(lo, zero));
+                    _mm_storeu_pd(pOut + 6,  zero);
+                    _mm_storeu_pd(pOut + 8,  _mm_unpacklo_pd(hi, zero));
+                    _mm_storeu_pd(pOut + 10, zero);
+                    _mm_storeu_pd(pOut + 12, _mm_unpackhi_pd(hi, zero));
+                    _mm_storeu_pd(pOut + 14, zero);
+                    break;
+            }
+            in += AHXXX_MAX_CHANNELS*numBytes;
+            pOut += groupSamples*AHXXX_MAX_CHANNELS;
+            nOut += groupSamples;
+        }
+    }
+    decodeScalarFormat(in, numSamples - nOut, numChannels, pOut, format);
+}
+
+__attribute__((target("ssse3")))
+static void decodeSSSE3_401(const unsigned char *in, size_t numSamples, int numChannels, double *samples)
+{
+    decodeSSSE3Format(in, numSamples, numChannels, samples, AHxxxFormat401);
+}
+
+__attribute__((target("ssse3")))
+static void decodeSSSE3_501_16(const unsigned char *in, size_t numSamples, int numChannels, double *samples)
+{
+    decodeSSSE3Format(in, numSamples, numChannels, samples, AHxxxFormat501_16);
+}
+
+__attribute__((target("ssse3")))
+static void decodeSSSE3_501_24(const unsigned char *in, size_t numSamples, int numChannels, double *samples)
+{
+    decodeSSSE3Format(in, numSamples, numChannels, samples, AHxxxFormat501_24);
+}
+
+// Each loop converts 8 values, which is 2 samples.  The 2 samples are loaded into the 2 128-bit lanes,
+// because the shuffle is done within each lane.  With 1 or 2 channels most of the output is zeros, and the
+// SSSE3 code is faster because it converts and stores only the values.
+__attribute__((target("avx2")))
+static inline void decodeAVX2Format(const unsigned char *in, size_t numSamples, int numChannels,
+                                    double *samples, int format)
+{
+    int numBytes = AHxxxDecodeBytes(format);
+    const unsigned char *end = in + numSamples*numChannels*numBytes;
+    size_t nOut=0;
+    double *pOut = samples;
+    __m128i mask128, shift, sign128;
+    __m256i mask, sign, v;
+
+    if (numChannels != AHXXX_MAX_CHANNELS) {
+        decodeSSSE3Format(in, numSamples, numChannels, samples, format);
+        return;
+    }
+    decodeConstants(format, &mask128, &shift, &sign128);
+    mask = _mm256_broadcastsi128_si256(mask128);
+    sign = _mm256_broadcastsi128_si256(sign128);
+    while (in + AHXXX_MAX_CHANNELS*numBytes + 16 <= end) {
+        v = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)in)),
+                                    _mm_loadu_si128((const __m128i *)(in + AHXXX_MAX_CHANNELS*numBytes)), 1);
+        v = _mm256_shuffle_epi8(v, mask);
+        v = _mm256_sra_epi32(v, shift);
+        v = _mm256_sub_epi32(_mm256_xor_si256(v, sign), sign);
+        _mm256_storeu_pd(pOut,                      _mm256_cvtepi32_pd(_mm256_castsi256_si128(v)));
+        _mm256_storeu_pd(pOut + AHXXX_MAX_CHANNELS, _mm256_cvtepi32_pd(_mm256_extracti128_si256(v, 1)));
+        in += 2*AHXXX_MAX_CHANNELS*numBytes;
+        pOut += 2*AHXXX_MAX_CHANNELS;
+        nOut += 2;
+    }
+    decodeScalarFormat(in, numSamples - nOut, numChannels, pOut, format);
+}
+
+__attribute__((target("avx2")))
+static void decodeAVX2_401(const unsigned char *in, size_t numSamples, int numChannels, double *samples)
+{
+    decodeAVX2Format(in, numSamples, numChannels, samples, AHxxxFormat401);
+}
+
+__attribute__((target("avx2")))
+static void decodeAVX2_501_16(const unsigned char *in, size_t numSamples, int numChannels, double *samples)
+{
+    decodeAVX2Format(in, numSamples, numChannels, samples, AHxxxFormat501_16);
+}
+
+__attribute__((target("avx2")))
+static void decodeAVX2_501_24(const unsigned char *in, size_t numSamples, int numChannels, double *samples)
+{
+    decodeAVX2Format(in, numSamples, numChannels, samples, AHxxxFormat501_24);
+}
+
+#endif /* AHXXX_DECODE_X86 */
+
+// Supported decoders, slowest first
+static AHxxxDecoder_t decoders[3];
+static int numDecoders;
+static epicsThreadOnceId decoderOnceId = EPICS_THREAD_ONCE_INIT;
+
+static void decoderInit(void *)
+{
+    AHxxxDecoder_t *pDecoder;
+
+    pDecoder = &decoders[numDecoders++];
+    pDecoder->name = "scalar";
+    pDecoder->func[AHxxxFormat401]    = decodeScalar401;
+    pDecoder->func[AHxxxFormat501_16] = decodeScalar501_16;
+    pDecoder->func[AHxxxFormat501_24] = decodeScalar501_24;
+#ifdef AHXXX_DECODE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("ssse3")) {
+        pDecoder = &decoders[numDecoders++];
+        pDecoder->name = "SSSE3";
+        pDecoder->func[AHxxxFormat401]    = decodeSSSE3_401;
+        pDecoder->func[AHxxxFormat501_16] = decodeSSSE3_501_16;
+        pDecoder->func[AHxxxFormat501_24] = decodeSSSE3_501_24;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        pDecoder = &decoders[numDecoders++];
+        pDecoder->name = "AVX2";
+        pDecoder->func[AHxxxFormat401]    = decodeAVX2_401;
+        pDecoder->func[AHxxxFormat501_16] = decodeAVX2_501_16;
+        pDecoder->func[AHxxxFormat501_24] = decodeAVX2_501_24;
+    }
+#endif
+}
+
+const AHxxxDecoder_t *AHxxxDecoderGet(void)
+{
+    epicsThreadOnce(&decoderOnceId, decoderInit, NULL);
+    return &decoders[numDecoders-1];
+}
+
+int AHxxxDecoderList(const AHxxxDecoder_t **pDecoders)
+{
+    epicsThreadOnce(&decoderOnceId, decoderInit, NULL);
+    *pDecoders = decoders;
+    return numDecoders;
+}
+
+AHxxxFramer::AHxxxFramer(size_t bufferSize)
+  : bufferSize_(bufferSize)
+{
+    buffer_ = (unsigned char *)malloc(bufferSize_);
+    reset(AHxxxFormat501_24, AHXXX_MAX_CHANNELS, false);
+}
+
+AHxxxFramer::~AHxxxFramer()
+{
+    free(buffer_);
+}
+
+/** Discards the data in the buffer and starts framing a new stream.
+  * \param[in] format The AHxxxFormat_t of the values.
+  * \param[in] numChannels The number of channels in each sample.
+  * \param[in] gateMarkers True if the stream contains AHXXX_GATE_MARKER at the end of each gate.
+  */
+void AHxxxFramer::reset(int format, int numChannels, bool gateMarkers)
+{
+    decodeFunc_ = AHxxxDecoderGet()->func[format];
+    numChannels_ = numChannels;
+    sampleSize_ = numChannels_ * AHxxxDecodeBytes(format);
+    gateMarkers_ = gateMarkers;
+    numBytes_ = 0;
+    position_ = 0;
+    gateSamples_ = 0;
+    lastGateSamples_ = 0;
+    numGates_ = 0;
+}
+
+/** Moves the bytes that have not been decoded to the start of the buffer */
+void AHxxxFramer::compact()
+{
+    numBytes_ -= position_;
+    if (numBytes_ > 0) memmove(buffer_, buffer_ + position_, numBytes_);
+    position_ = 0;
+}
+
+/** Decodes the next complete samples in the buffer, up to maxSamples or the next gate marker.
+  * Returns true if any samples were decoded or a gate marker was found, in which case the caller should process
+  * the samples, end the gate if gateEnd is true, and call decode() again.  Returns false when more data must be read.
+  */
+bool AHxxxFramer::decode(double *samples, size_t maxSamples, size_t *numSamples, bool *gateEnd)
+{
+    const unsigned char *start = buffer_ + position_;
+    const unsigned char *end = buffer_ + numBytes_;
+    const unsigned char *p = start;
+    size_t remaining, n=0;
+
+    *gateEnd = false;
+    while (n < maxSamples) {
+        remaining = end - p;
+        // Only the first byte is compared for most samples
+        if (gateMarkers_ && (remaining > 0) && (*p == AHXXX_GATE_MARKER[0])) {
+            if (remaining >= AHXXX_GATE_MARKER_LEN) {
+                if (memcmp(p, AHXXX_GATE_MARKER, AHXXX_GATE_MARKER_LEN) == 0) {
+                    *gateEnd = true;
+                    break;
+                }
+            }
+            else if (memcmp(p, AHXXX_GATE_MARKER, remaining) == 0) {
+                // This could be the start of a marker, wait for the rest of it
+                break;
+            }
+        }
+        if (remaining < sampleSize_) break;
+        p += sampleSize_;
+        n++;
+    }
+    if (n > 0) decodeFunc_(start, n, numChannels_, samples);
+    position_ += n * sampleSize_;
+    gateSamples_ += n;
+    if (*gateEnd) {
+        position_ += AHXXX_GATE_MARKER_LEN;
+        lastGateSamples_ = gateSamples_;
+        gateSamples_ = 0;
+        numGates_++;
+    }
+    *numSamples = n;
+    if ((n > 0) || *gateEnd) return true;
+    // There is no complete sample left
+    compact();
+    return false;
+}
+
+/** Reference for the benchmark: the way the driver decoded each value before the decoders were added,
+  * with shifts and a comparison to invert the sign of each AH501 value. */
+static void decodeBranch(const unsigned char *in, size_t numSamples, int numChannels, int format, double *samples)
+{
+    int numBytes = AHxxxDecodeBytes(format);
+    int offset=0;
+    int value;
+    size_t i;
+    int j;
+
+    for (i=0; i<numSamples; i++) {
+        for (j=0; j<numChannels; j++) {
+            if (format == AHxxxFormat401) {
+                value = (in[offset+2]<<16) + (in[offset+1]<<8) + in[offset];
+            }
+            else if (format == AHxxxFormat501_16) {
+                value = (in[offset]<<8) + in[offset+1];
+                if (value <= 32767) {
+                    value = -value;
+                } else {
+                    value = 65536 - value;
+                }
+            }
+            else {
+                value = (in[offset]<<16) + (in[offset+1]<<8) + in[offset+2];
+                if (value <= 8388607) {
+                    value = -value;
+                } else {
+                    value = 16777216 - value;
+                }
+            }
+            samples[i*AHXXX_MAX_CHANNELS + j] = value;
+            offset += numBytes;
+        }
+        for (; j<AHXXX_MAX_CHANNELS; j++) samples[i*AHXXX_MAX_CHANNELS + j] = 0.;
+    }
+}
+
+/** iocsh command to measure the speed of each decoder for each format with 1, 2 and 4 channels.
+  * \param[in] numSamples Number of samples in the buffer.
+  * \param[in] numLoops Number of times to decode the buffer.
+  */
+static void AHxxxDecodeBenchmark(int numSamples, int numLoops)
+{
+    static const char *formatNames[AHXXX_NUM_FORMATS] = {"AH401", "AH501-16", "AH501-24"};
+    static const int channels[] = {1, 2, 4};
+    const AHxxxDecoder_t *pDecoders;
+    unsigned char *inBuff;
+    double *outBuff, *refBuff;
+    size_t nBytes, outBytes;
+    epicsTimeStamp start, end;
+    double elapsed;
+    int nDecoders;
+    int format, numChannels;
+    int i, j, loop;
+    bool same;
+
+    if (numSamples <= 0) numSamples = 10000;
+    if (numLoops <= 0) numLoops = 1000;
+    nBytes = numSamples * AHXXX_MAX_CHANNELS * 3;
+    outBytes = numSamples * AHXXX_MAX_CHANNELS * sizeof(double);
+    inBuff  = (unsigned char *)malloc(nBytes);
+    outBuff = (double *)malloc(outBytes);
+    refBuff = (double *)malloc(outBytes);
+    // Every byte pattern is a valid value, so random bytes test both signs
+    for (i=0; i<(int)nBytes; i++) inBuff[i] = (unsigned char)(rand() & 0xff);
+
+    nDecoders = AHxxxDecoderList(&pDecoders);
+    printf("Decoding %d samples %d times, best decoder=%s\n", numSamples, numLoops, AHxxxDecoderGet()->name);
+    printf("Format    Channels Decoder       Samples/s   Same as scalar\n");
+    for (format=0; format<AHXXX_NUM_FORMATS; format++) {
+        for (i=0; i<(int)(sizeof(channels)/sizeof(channels[0])); i++) {
+            numChannels = channels[i];
+            pDecoders[0].func[format](inBuff, numSamples, numChannels, refBuff);
+            // The first entry is the code the driver used before the decoders were added
+            for (j=-1; j<nDecoders; j++) {
+                memset(outBuff, 0, outBytes);
+                epicsTimeGetCurrent(&start);
+                for (loop=0; loop<numLoops; loop++) {
+                    if (j < 0) decodeBranch(inBuff, numSamples, numChannels, format, outBuff);
+                    else pDecoders[j].func[format](inBuff, numSamples, numChannels, outBuff);
+                }
+                epicsTimeGetCurrent(&end);
+                elapsed = epicsTimeDiffInSeconds(&end, &start);
+                same = (memcmp(outBuff, refBuff, outBytes) == 0);
+                printf("%-9s %8d %-10s %12.4g   %s\n", formatNames[format], numChannels,
+                       (j < 0) ? "branch" : pDecoders[j].name,
+                       (elapsed > 0.) ? (double)numSamples * numLoops / elapsed : 0., same ? "Yes" : "No");
+            }
+        }
+    }
+    free(inBuff);
+    free(outBuff);
+    free(refBuff);
+}
+
+extern "C" {
+
+static const iocshArg benchmarkArg0 = { "number of samples", iocshArgInt};
+static const iocshArg benchmarkArg1 = { "number of loops", iocshArgInt};
+static const iocshArg * const benchmarkArgs[] = {&benchmarkArg0, &benchmarkArg1};
+static const iocshFuncDef benchmarkFuncDef = {"AHxxxDecodeBenchmark", 2, benchmarkArgs};
+static void benchmarkCallFunc(const iocshArgBuf *args)
+{
+    AHxxxDecodeBenchmark(args[0].ival, args[1].ival);
+}
+
+void AHxxxDecodeRegister(void)
+{
+    iocshRegister(&benchmarkFuncDef, benchmarkCallFunc);
+}
+
+epicsExportRegistrar(AHxxxDecodeRegister);
+
+}
@@ -0,0 +1,95 @@
+/*
+ * AHxxxDecode.h
+ *
+ * Decoders for the binary data stream from the AH401 and AH501 series
+ *
+ * Each sample in the stream is numChannels unsigned integers with no markers between them.
+ * The AH401 series sends 24-bit little-endian values that are used as they are.
+ * The AH501 series sends 16-bit or 24-bit big-endian values in which the sign is inverted,
+ * i.e. the current is the negative of the two's complement value.
+ * The decoders convert the samples to doubles in a dense block of samples with QE_MAX_INPUTS values each,
+ * with the unused channels set to 0.
+ * There is a scalar implementation and SSSE3 and AVX2 implementations on x86 with gcc or clang, which gather the
+ * bytes of 4 or 8 values into 32-bit lanes with a shuffle and fix the sign with a shift and a negation, without
+ * tables or branches.  The fastest implementation supported by the CPU is selected at run time.
+ *
+ * The AHxxxFramer class frames the stream as it is read, and finds the markers that the AH501BE sends at the end
+ * of each gate in Ext. gate mode.
+ */
+
+#ifndef AHXXX_DECODE_H
+#define AHXXX_DECODE_H
+
+#include <stddef.h>
+#include <epicsTypes.h>
+#include <shareLib.h>
+
+#define AHXXX_MAX_CHANNELS 4
+
+/* The marker that the AH501BE sends at the end of each gate in Ext. gate mode */
+#define AHXXX_GATE_MARKER "ACK\r\n"
+#define AHXXX_GATE_MARKER_LEN 5
+
+typedef enum {
+    AHxxxFormat401,     /* AH401 series, 24-bit little-endian */
+    AHxxxFormat501_16,  /* AH501 series, 16-bit big-endian */
+    AHxxxFormat501_24   /* AH501 series, 24-bit big-endian */
+} AHxxxFormat_t;
+
+#define AHXXX_NUM_FORMATS (AHxxxFormat501_24+1)
+
+/** Decodes numSamples samples of numChannels values in the format from in into samples.
+  * Reads exactly numSamples*numChannels values, so the input buffer need not be larger than the data.
+  */
+typedef void (*AHxxxDecodeFunc_t)(const unsigned char *in, size_t numSamples, int numChannels,
+                                  double *samples);
+
+typedef struct {
+    const char *name;
+    AHxxxDecodeFunc_t func[AHXXX_NUM_FORMATS];
+} AHxxxDecoder_t;
+
+/** Returns the number of bytes in each value of the format */
+epicsShareFunc int AHxxxDecodeBytes(int format);
+/** Returns the fastest decoder supported by this CPU */
+epicsShareFunc const AHxxxDecoder_t *AHxxxDecoderGet(void);
+/** Returns the number of decoders supported by this CPU, and a pointer to the array of them */
+epicsShareFunc int AHxxxDecoderList(const AHxxxDecoder_t **decoders);
+
+/** Incremental framing of the binary stream.
+  * The data are read directly into the buffer at writePointer() and added with commit(), so each read can return
+  * all of the data that are available.  Each call to decode() decodes the next complete samples with the fastest
+  * decoder.  A partial sample at the end of the buffer is kept for the next read.
+  * When gate markers are enabled the stream is checked for AHXXX_GATE_MARKER at the start of each sample, so a marker
+  * is found wherever it is in a read, and the samples are split at it.  decode() then returns the samples of the gate
+  * with gateEnd true, so the caller can process them before ending the gate.  If the bytes at the end of the buffer
+  * could be the start of a marker they are kept until more data is read.
+  */
+class epicsShareClass AHxxxFramer {
+public:
+    AHxxxFramer(size_t bufferSize);
+    ~AHxxxFramer();
+    void reset(int format, int numChannels, bool gateMarkers);
+    unsigned char *writePointer() { return buffer_ + numBytes_; }
+    size_t writeSpace() const { return bufferSize_ - numBytes_; }
+    void commit(size_t nRead) { numBytes_ += nRead; }
+    bool decode(double *samples, size_t maxSamples, size_t *numSamples, bool *gateEnd);
+    epicsUInt64 numGates() const { return numGates_; }
+    size_t lastGateSamples() const { return lastGateSamples_; }
+
+private:
+    void compact();
+    AHxxxDecodeFunc_t decodeFunc_;
+    unsigned char *buffer_;
+    size_t bufferSize_;
+    size_t numBytes_;         /* Number of bytes in the buffer */
+    size_t position_;         /* Position of the next byte to decode */
+    size_t sampleSize_;
+    int numChannels_;
+    bool gateMarkers_;
+    size_t gateSamples_;      /* Samples since the end of the last gate */
+    size_t lastGateSamples_;  /* Samples in the last complete gate */
+    epicsUInt64 numGates_;
+};
+
+#endif
@@ -27,14 +27,25 @@
 
 #include <epicsExport.h>
 #include "drvAHxxx.h"
+#include "quadEMAscii.h"
+#include "AHxxxDecode.h"
 
 #define AHxxx_TIMEOUT 0.05
 #define MIN_INTEGRATION_TIME 0.001
 #define MAX_INTEGRATION_TIME 1.0
+// Size of read buffer for ASCII data in units of char.  Each read returns many lines.
+#define ASCII_BUFFER_SIZE 65536
+// Size of read buffer for binary data.  Each read returns many samples.
+#define BINARY_BUFFER_SIZE 65536
+// Maximum number of samples passed to computePositionsBlock() at once
+#define MAX_BLOCK_SAMPLES 4096
 
 static const char *driverName="drvAHxxx";
 static void readThread(void *drvPvt);
 
+// The line in the ASCII data stream when the requested number of trigger samples has been received
+static const char *ASCIIKeywords[] = {"ACK"};
+
 
 /** Constructor for the drvAHxxx class.
   * Calls the constructor for the drvQuadEM base class.
@@ -58,7 +69,11 @@ drvAHxxx::drvAHxxx(const char *portName, const char *QEPortName, int ringBufferS
     
     QEPortName_ = epicsStrDup(QEPortName);
     
+    createParam(P_FullRateString, asynParamInt32, &P_FullRate);
+    setIntegerParam(P_FullRate, 0);
+
     acquireStartEvent_ = epicsEventCreate(epicsEventEmpty);
+    readingActiveEvent_ = epicsEventCreate(epicsEventEmpty);
 
     // Connect to the server
     status = pasynOctetSyncIO->connect(QEPortName, 0, &pasynUserMeter_, NULL);
@@ -110,6 +125,31 @@ static void readThread(void *drvPvt)
     pPvt->readThread();
 }
 
+/** Called when asyn clients call pasynInt32->write().
+  * Handles the AHxxx specific parameters and calls the base class for all others.
+  * \param[in] pasynUser pasynUser structure that encodes the reason and address.
+  * \param[in] value Value to write. */
+asynStatus drvAHxxx::writeInt32(asynUser *pasynUser, epicsInt32 value)
+{
+    int function = pasynUser->reason;
+    int prevAcquiring;
+    asynStatus status;
+
+    if (function == P_FullRate) {
+        setIntegerParam(P_FullRate, value);
+        // The mode changes SampleTime and NumAverage, so acquisition is stopped while readStatus() updates them
+        // and the ring buffer is flushed, and then restarted so the read thread uses the new mode
+        prevAcquiring = acquiring_;
+        if (prevAcquiring) setAcquire(0);
+        status = readStatus();
+        resetAcquisition();
+        if (prevAcquiring) setAcquire(1);
+        callParamCallbacks();
+        return status;
+    }
+    return drvQuadEM::writeInt32(pasynUser, value);
+}
+
 /** Sends a command to the AHxxx and reads the response.
   * If meter is acquiring turns it off and waits for it to stop sending data 
   * \param[in] expectACK True if the meter should respond with ACK to this command 
@@ -154,30 +194,45 @@ asynStatus drvAHxxx::writeReadMeter()
 
 /** Read thread to read the data from the electrometer when it is in continuous acquire mode.
   * Reads the data, computes the sums and positions, and does callbacks.
+  * Each read returns all of the data available.  In binary mode it is split into samples with an AHxxxFramer,
+  * and in ASCII mode into lines with a quadEMLineSplitter.
+  * The averages of each valuesPerRead_ samples are passed to computePositionsBlock() as blocks.
+  * In full rate mode (P_FullRate) the samples are not averaged, and every sample is passed to computePositionsBlock().
+  * On the AH501BE in Ext. gate mode the samples of each gate are processed before the callbacks are triggered.
   */
 void drvAHxxx::readThread(void)
 {
     asynStatus status;
     int i, j;
-    int offset;
     int value;
+    int decodeFormat;
     size_t nRead;
-    int numBytes;
     int eomReason;
     int readFormat;
+    int fullRate;
+    int samplesPerValue;
     int model;
     int triggerMode;
     asynUser *pasynUser;
     asynInterface *pasynInterface;
     asynOctet *pasynOctet;
     void *octetPvt;
-    epicsFloat64 raw[QE_MAX_INPUTS];
-    unsigned char *input=NULL;
-    size_t inputSize=0;
-    char ASCIIData[150];
-    char *inPtr;
+    AHxxxFramer framer(BINARY_BUFFER_SIZE);
+    quadEMLineSplitter lineSplitter(ASCII_BUFFER_SIZE);
+    const char *line;
+    size_t lineLength;
+    long values[QE_MAX_INPUTS];
+    epicsFloat64 sum[QE_MAX_INPUTS];
+    int numSummed=0;
+    bool endAverage;
+    epicsFloat64 *blockData;
+    epicsFloat64 *pData;
+    size_t numBlock;
+    size_t numAveraged;
+    size_t k;
+    bool gateEnd;
     size_t nRequested;
-    size_t nExpected;
+    size_t nExpected=0;
     static const char *functionName = "readThread";
 
     /* Create an asynUser */
@@ -197,6 +252,9 @@ void drvAHxxx::readThread(void)
     }
     pasynOctet = (asynOctet *)pasynInterface->pinterface;
     octetPvt = pasynInterface->drvPvt;
+
+    // The buffer is too large for the stack of the thread
+    blockData = (epicsFloat64 *)malloc(MAX_BLOCK_SAMPLES * QE_MAX_INPUTS * sizeof(epicsFloat64));
     
     getIntegerParam(P_Model, &model);
     
@@ -205,41 +263,38 @@ void drvAHxxx::readThread(void)
     while (1) {
         if (acquiring_ == 0) {
             readingActive_ = 0;
+            epicsEventSignal(readingActiveEvent_);
             unlock();
             (void)epicsEventWait(acquireStartEvent_);
             lock();
             readingActive_ = 1;
+            epicsEventSignal(readingActiveEvent_);
             getIntegerParam(P_ReadFormat, &readFormat);
             getIntegerParam(P_TriggerMode, &triggerMode);
+            getIntegerParam(P_FullRate, &fullRate);
+            // The decoder for the binary data format of this model and resolution is chosen once for each acquisition.
+            // Only the AH501BE sends markers in the binary data at the end of each gate.
+            if (AH401Series_) numChannels_ = 4;
+            decodeFormat = AH401Series_ ? AHxxxFormat401 : ((resolution_ == 16) ? AHxxxFormat501_16 : AHxxxFormat501_24);
+            framer.reset(decodeFormat, numChannels_,
+                         (model == QE_ModelAH501BE) && (triggerMode == QETriggerModeExtGate));
+            // Discard any partial line or sample and average from the previous acquisition
+            lineSplitter.reset();
+            for (i=0; i<QE_MAX_INPUTS; i++) sum[i] = 0;
+            numSummed = 0;
         }
         if (valuesPerRead_ < 1) valuesPerRead_ = 1;
-        for (i=0; i<QE_MAX_INPUTS; i++) {
-            raw[i] = 0;
-        }
 
         if (readFormat == QEReadFormatBinary) {
-            numBytes = 3;
-            if (AH401Series_) {
-                numChannels_ = 4;
-            } 
-            else {
-                if (resolution_ == 16) numBytes = 2;
-            }
-            nRequested = numBytes * numChannels_ * valuesPerRead_;
-            if (nRequested > inputSize) {
-                if (input) free(input);
-                input = (unsigned char *)malloc(nRequested);
-                inputSize = nRequested;
-            }
+            // Read all of the data that is available after the partial sample from the previous read
+            nRequested = framer.writeSpace();
             unlock();
             pasynManager->lockPort(pasynUser);
-            status = pasynOctet->read(octetPvt, pasynUser, (char *)input, nRequested, 
+            status = pasynOctet->read(octetPvt, pasynUser, (char *)framer.writePointer(), nRequested, 
                                       &nRead, &eomReason);
             pasynManager->unlockPort(pasynUser);
             lock();
-            if ((status != asynSuccess) || 
-                (nRead  != nRequested)  || 
-                (eomReason != ASYN_EOM_CNT)) {
+            if (nRead == 0) {
                 if (status != asynTimeout) {
                     asynPrint(pasynUserSelf, ASYN_TRACE_ERROR, 
                         "%s:%s: unexpected error reading meter status=%d, nRead=%lu, eomReason=%d\n", 
@@ -249,153 +304,132 @@ void drvAHxxx::readThread(void)
                     unlock();
                     epicsThreadSleep(1.0);
                     lock();
-                } else if ((model == QE_ModelAH501BE) &&
-                           (triggerMode == QETriggerModeExtGate) &&
-                           (nRead == 5) &&
-                           (strncmp((const char *)input, "ACK\r\n", 5) == 0)) {
-                    asynPrint(pasynUserSelf, ASYN_TRACEIO_DRIVER,
-                        "%s::%s timeout with nRead=5, triggering callbacks\n", driverName, functionName);
-                    triggerCallbacks();
                 }
                 continue;
             }
-            // We successfully read the requested number of bytes
-            // However, on the AH501BE in Ext. Gate mode the first 5 bytes could be ACK\r\n.
-            // If so we need to trigger callbacks and read 5 more bytes
-            if ((model == QE_ModelAH501BE) &&
-                (triggerMode == QETriggerModeExtGate) &&
-                (strncmp((const char *)input, "ACK\r\n", 5) == 0)) {
-                asynPrint(pasynUserSelf, ASYN_TRACEIO_DRIVER,
-                    "%s::%s found ACK\\r\\n at start of data, triggering callbacks\n", driverName, functionName);
-                triggerCallbacks();
-                memcpy(input, input+5, nRead-5);
-                pasynManager->lockPort(pasynUser);
-                status = pasynOctet->read(octetPvt, pasynUser, (char *)input+nRead-5, 5, 
-                                          &nRead, &eomReason);
-                pasynManager->unlockPort(pasynUser);
-                if ((status != asynSuccess) || 
-                    (nRead  != 5)  || 
-                    (eomReason != ASYN_EOM_CNT)) {
-                    asynPrint(pasynUserSelf, ASYN_TRACE_ERROR, 
-                        "%s:%s: unexpected error reading additional 5 bytes from meter status=%d, nRead=%lu, eomReason=%d\n", 
-                        driverName, functionName, status, (unsigned long)nRead, eomReason);
-                }
-            }
-            asynPrintIO(pasynUserSelf, ASYN_TRACEIO_DRIVER, (const char*)input, nRequested,
+            asynPrintIO(pasynUserSelf, ASYN_TRACEIO_DRIVER, (const char*)framer.writePointer(), nRead,
                     "%s::%s buffer read\n", driverName, functionName);
-            offset = 0;
-            if (AH401Series_) {
-                // These models are little-endian byte order
-                for (i=0; i<valuesPerRead_; i++) {
-                    for (j=0; j<numChannels_; j++) {
-                        raw[j] += (input[offset+2]<<16) + (input[offset+1]<<8) + input[offset];
-                        offset += numBytes;
-                    }
-                }
-            }
-            else {
-                // These models are big-endian byte order
-                if (resolution_ == 16) {
-                    for (i=0; i<valuesPerRead_; i++) {
-                        for (j=0; j<numChannels_; j++) {
-                            value = (input[offset]<<8) + input[offset+1];
-                            if (value <= 32767) {
-                                value = -value;
-                            } else {
-                                value = 65536 - value;
+            framer.commit(nRead);
+            readComplete();
+            // The framer splits the samples at the end of each gate, so each gate is processed before its callbacks
+            while (framer.decode(blockData, MAX_BLOCK_SAMPLES, &numBlock, &gateEnd)) {
+                if (!fullRate) {
+                    // The averages of each valuesPerRead_ samples are written over the start of blockData.
+                    // At the end of a gate the partial average is also complete.
+                    numAveraged = 0;
+                    for (k=0; k<=numBlock; k++) {
+                        if (k < numBlock) {
+                            pData = blockData + k*QE_MAX_INPUTS;
+                            for (j=0; j<QE_MAX_INPUTS; j++) {
+                                sum[j] += pData[j];
                             }
-                            raw[j] += value;
-                            offset += numBytes;
+                            if (++numSummed < valuesPerRead_) continue;
                         }
-                    }
-                }
-                else {
-                    for (i=0; i<valuesPerRead_; i++) {
-                        for (j=0; j<numChannels_; j++) {
-                            value = (input[offset]<<16) + (input[offset+1]<<8) + input[offset+2];
-                            if (value <= 8388607) {
-                                value = -value;
-                            } else {
-                                value = 16777216 - value;
-                            }
-                            raw[j] += value;
-                            offset += numBytes;
+                        else if (!gateEnd || (numSummed == 0)) break;
+                        pData = blockData + numAveraged*QE_MAX_INPUTS;
+                        for (j=0; j<QE_MAX_INPUTS; j++) {
+                            pData[j] = sum[j] / numSummed;
+                            sum[j] = 0;
                         }
+                        numSummed = 0;
+                        numAveraged++;
                     }
+                    numBlock = numAveraged;
+                }
+                computePositionsBlock(blockData, numBlock);
+                if (gateEnd) {
+                    asynPrint(pasynUserSelf, ASYN_TRACEIO_DRIVER,
+                        "%s::%s end of gate with %lu samples, triggering callbacks\n", 
+                        driverName, functionName, (unsigned long)framer.lastGateSamples());
+                    triggerCallbacks();
                 }
             }
         }
         else {  // ASCII mode
-            nRequested = sizeof(ASCIIData);
-            for (i=0; i<valuesPerRead_; i++) {
-                unlock();
-                pasynManager->lockPort(pasynUser);
-                status = pasynOctet->read(octetPvt, pasynUser, ASCIIData, nRequested, 
-                                          &nRead, &eomReason);
-                pasynManager->unlockPort(pasynUser);
-                lock();
-                if ((status != asynSuccess) || 
-                    (eomReason != ASYN_EOM_EOS)) {
-                    if (status != asynTimeout) {
-                        asynPrint(pasynUserSelf, ASYN_TRACE_ERROR, 
-                            "%s:%s: unexpected error reading meter status=%d, nRead=%lu, eomReason=%d\n", 
-                            driverName, functionName, status, (unsigned long)nRead, eomReason);
-                        // We got an error reading the meter, it is probably offline.  
-                        // Wait 1 second before trying again.
-                        unlock();
-                        epicsThreadSleep(1.0);
-                        lock();
-                    }
-                    continue;
+            // Read all of the data that is available after the partial line from the previous read
+            nRequested = lineSplitter.writeSpace();
+            unlock();
+            pasynManager->lockPort(pasynUser);
+            status = pasynOctet->read(octetPvt, pasynUser, lineSplitter.writePointer(), nRequested, 
+                                      &nRead, &eomReason);
+            pasynManager->unlockPort(pasynUser);
+            lock();
+            if (nRead == 0) {
+                if (status != asynTimeout) {
+                    asynPrint(pasynUserSelf, ASYN_TRACE_ERROR, 
+                        "%s:%s: unexpected error reading meter status=%d, nRead=%lu, eomReason=%d\n", 
+                        driverName, functionName, status, (unsigned long)nRead, eomReason);
+                    // We got an error reading the meter, it is probably offline.  
+                    // Wait 1 second before trying again.
+                    unlock();
+                    epicsThreadSleep(1.0);
+                    lock();
                 }
+                continue;
+            }
+            lineSplitter.commit(nRead);
+            readComplete();
+            if (AH501Series_) nExpected = (resolution_/4)*numChannels_ + (numChannels_-1);
+            numBlock = 0;
+            samplesPerValue = fullRate ? 1 : valuesPerRead_;
+            while (lineSplitter.nextLine(&line, &lineLength)) {
+                endAverage = false;
                 if (AH501Series_) {
-                    nExpected = (resolution_/4)*numChannels_ + (numChannels_-1);
-                    if (strstr(ASCIIData, "ACK") != 0) {
+                    if (quadEMFindKeyword(line, lineLength, ASCIIKeywords, 1) == 0) {
                         // The requested number of trigger samples has been received
-                        break;
-                    } 
-                    if (nRead != nExpected) {
+                        endAverage = true;
+                    }
+                    else if (lineLength != nExpected) {
                         asynPrint(pasynUserSelf, ASYN_TRACE_ERROR, 
                             "%s:%s: error reading meter nRead=%lu, expected %lu, input=%s\n", 
-                            driverName, functionName, (unsigned long)nRead, (unsigned long)nExpected, ASCIIData);
+                            driverName, functionName, (unsigned long)lineLength, (unsigned long)nExpected, line);
                         continue;
                     }
-                    inPtr = ASCIIData;
-                    for (j=0; j<numChannels_; j++) {
-                        value = strtol(inPtr, &inPtr, 16);
-                        if (resolution_ == 16) {
-                            if (value <= 32767) {
-                                value = -value;
-                            } else {
-                                value = 65536 - value;
+                    else if (quadEMParseLongs(line, lineLength, 16, values, numChannels_) == numChannels_) {
+                        for (j=0; j<numChannels_; j++) {
+                            value = values[j];
+                            if (resolution_ == 16) {
+                                if (value <= 32767) {
+                                    value = -value;
+                                } else {
+                                    value = 65536 - value;
+                                }
                             }
-                        }
-                        else {
-                           if (value <= 8388607) {
-                                value = -value;
-                            } else {
-                                value = 16777216 - value;
+                            else {
+                               if (value <= 8388607) {
+                                    value = -value;
+                                } else {
+                                    value = 16777216 - value;
+                                }
                             }
+                            sum[j] += value;
                         }
-                        raw[j] += value;
+                        numSummed++;
                     }
                 }
                 else if (AH401Series_) {
-                    inPtr = ASCIIData;
-                    for (j=0; j<numChannels_; j++) {
-                        value = strtol(inPtr, &inPtr, 10);
-                        raw[j] += value;
+                    if (quadEMParseLongs(line, lineLength, 10, values, numChannels_) == numChannels_) {
+                        for (j=0; j<numChannels_; j++) {
+                            sum[j] += values[j];
+                        }
+                        numSummed++;
                     }
                 }
-            }  // end for valuesPerRead
-        }  // end if ASCII mode
-
-        if (valuesPerRead_ > 1) {
-            for (i=0; i<numChannels_; i++) {
-                raw[i] = raw[i] / valuesPerRead_;
+                if ((numSummed == 0) || ((numSummed < samplesPerValue) && !endAverage)) continue;
+                // The average is complete
+                pData = blockData + numBlock*QE_MAX_INPUTS;
+                for (i=0; i<QE_MAX_INPUTS; i++) {
+                    pData[i] = sum[i] / numSummed;
+                    sum[i] = 0;
+                }
+                numSummed = 0;
+                if (++numBlock == MAX_BLOCK_SAMPLES) {
+                    computePositionsBlock(blockData, numBlock);
+                    numBlock = 0;
+                }
             }
-        }
-        computePositions(raw);
+            computePositionsBlock(blockData, numBlock);
+        }  // end if ASCII mode
     } //end while(1)
 }
 
@@ -482,7 +516,7 @@ asynStatus drvAHxxx::setAcquire(epicsInt32 value)
         // Wait for the read thread to stop
         while (readingActive_) {
             unlock();
-            epicsThreadSleep(0.01);
+            (void)epicsEventWaitWithTimeout(readingActiveEvent_, QE_READING_ACTIVE_WAIT);
             lock();
         }
         while (1) {
@@ -552,9 +586,8 @@ asynStatus drvAHxxx::setAcquire(epicsInt32 value)
             status = pasynOctetSyncIO->write(pasynUserMeter_, "ACQ ON", strlen("ACQ ON"), 
                         AHxxx_TIMEOUT, &nwrite);
         }
-        if (readFormat == QEReadFormatBinary) {
-            status = pasynOctetSyncIO->setInputEos(pasynUserMeter_, "", 0);
-        }
+        // The read thread splits the ASCII data into lines itself, so it can read many lines at once
+        status = pasynOctetSyncIO->setInputEos(pasynUserMeter_, "", 0);
         // Notify the read thread if acquisition status has started
         epicsEventSignal(acquireStartEvent_);
         acquiring_ = 1;
@@ -685,6 +718,7 @@ asynStatus drvAHxxx::readStatus()
     int range, resolution, pingPong, numChannels, biasState, numAverage;
     double integrationTime, biasVoltage;
     int readFormat;
+    int fullRate;
     int prevAcquiring;
     double sampleTime=0., averagingTime;
     static const char *functionName = "getStatus";
@@ -781,8 +815,9 @@ asynStatus drvAHxxx::readStatus()
         if (biasState) setDoubleParam(P_BiasVoltage, biasVoltage);
     }
     
-    // The sample times computed above don't include valuesPerRead
-    sampleTime = sampleTime * valuesPerRead_;
+    // The sample times computed above don't include valuesPerRead, which is only averaged if not in full rate mode
+    getIntegerParam(P_FullRate, &fullRate);
+    if (!fullRate) sampleTime = sampleTime * valuesPerRead_;
     setDoubleParam(P_SampleTime, sampleTime);
 
     // Compute the number of values that will be accumulated in the ring buffer before averaging
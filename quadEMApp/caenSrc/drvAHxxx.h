@@ -11,6 +11,7 @@
 #include "drvQuadEM.h"
 
 #define MAX_COMMAND_LEN 256
+#define P_FullRateString  "AH_FULL_RATE"   /* asynInt32,    r/w */
 
 /** Class to control the Elettra/CaenEls AHxxx 4-Channel Picoammeters */
 class drvAHxxx : public drvQuadEM {
@@ -19,6 +20,7 @@ public:
     
     /* These are the methods we implement from asynPortDriver */
     void report(FILE *fp, int details);
+    virtual asynStatus writeInt32(asynUser *pasynUser, epicsInt32 value);
                  
     /* These are the methods that are new to this class */
     void readThread(void);
@@ -37,11 +39,13 @@ protected:
     virtual asynStatus setReadFormat(epicsInt32 value);
     virtual asynStatus readStatus();
     virtual asynStatus reset();
+    int P_FullRate;
  
 private:
     /* Our data */
     asynUser *pasynUserMeter_;
     epicsEventId acquireStartEvent_;
+    epicsEventId readingActiveEvent_;  // Signalled by the read thread when readingActive_ changes
     int readingActive_;
     char *QEPortName_;
     bool AH501Series_;
@@ -26,22 +26,40 @@
 #include <epicsMath.h>
 #include <asynOctetSyncIO.h>
 #include <iocsh.h>
+#include <initHooks.h>
+#include <dbAccess.h>
+
+#include <vector>
 
 #include <epicsExport.h>
 #include "drvTetrAMM.h"
+#include "tetrAMMSocket.h"
+#include "quadEMAscii.h"
 
 #define TetrAMM_TIMEOUT 0.05
+// Maximum total time to wait for the ACK after ACQ:OFF on the data socket, while the data in flight are discarded
+#define TetrAMM_STOP_TIMEOUT 1.0
 #define MIN_VALUES_PER_READ_BINARY 5
 #define MIN_VALUES_PER_READ_ASCII 500
 #define MAX_VALUES_PER_READ 100000
-// Size of read buffer for binary data.  The max required for data is 40 bytes (4 doubles + NaN)
-// We make it twice this size for doing synchonization so it is guaranteed to contain intact NaN
-#define BINARY_BUFFER_SIZE 80
-// Size of read buffer for ASCII data in units of char
-#define ASCII_BUFFER_SIZE 150
+// Size of read buffer for binary data.  Each sample is up to 40 bytes (4 doubles + NaN)
+#define BINARY_BUFFER_SIZE 65536
+// Maximum number of samples in the buffer, which is when NumChannels=1 (1 double + NaN)
+#define BINARY_MAX_SAMPLES (BINARY_BUFFER_SIZE/16)
+// Maximum number of trigger and other markers returned by each call to the decoder
+#define BINARY_MAX_EVENTS 64
+// Size of read buffer for ASCII data in units of char.  Each read returns many lines.
+#define ASCII_BUFFER_SIZE 65536
 
 static const char *driverName="drvTetrAMM";
 static void readThread(void *drvPvt);
+static void initHook(initHookState state);
+
+// The drivers that are collecting the settings while the IOC is initialized
+static std::vector<drvTetrAMM *> initDrivers;
+
+// The lines in the ASCII data stream that mark the start and end of a trigger
+static const char *ASCIIKeywords[] = {"SEQNR", "EOTRG"};
 
 
 /** Constructor for the drvTetrAMM class.
@@ -53,9 +71,12 @@ static void readThread(void *drvPvt);
   *            This should be large enough to hold all the samples between reads of the
   *            device, e.g. 1 ms SampleTime and 1 second read rate = 1000 samples.
   *            If 0 then default of 2048 is used.
+  * \param[in] dataAddress Optional address of the meter for the binary data stream, "host:port" or "host:port UDP".
+  *            If this is specified then the driver receives the binary data on its own socket rather than with
+  *            the QEPortName asyn port.  This is only supported on Linux.
   */
-drvTetrAMM::drvTetrAMM(const char *portName, const char *QEPortName, int ringBufferSize) 
-   : drvQuadEM(portName, ringBufferSize)
+drvTetrAMM::drvTetrAMM(const char *portName, const char *QEPortName, int ringBufferSize, const char *dataAddress) 
+   : drvQuadEM(portName, ringBufferSize), dataSocket_(0), useDataSocket_(false)
   
 {
     asynStatus status;
@@ -63,10 +84,31 @@ drvTetrAMM::drvTetrAMM(const char *portName, const char *QEPortName, int ringBuf
     
     QEPortName_ = epicsStrDup(QEPortName);
     
+    // Settings written while the IOC is initialized, e.g. restored by autosave and processed by PINI records,
+    // are collected in a configuration transaction that is committed when the IOC is running.
+    // If the driver is created after iocInit the hook will not be called, so there is no initial transaction.
+    configDepth_ = interruptAccept ? 0 : 1;
+    configPending_ = false;
+    statusPending_ = false;
+    restartAcquire_ = false;
+    acquireParamsSent_ = false;
+    numQueued_ = 0;
+
     acquireStartEvent_ = epicsEventCreate(epicsEventEmpty);
-    numResync_ = 0;
+    readingActiveEvent_ = epicsEventCreate(epicsEventEmpty);
+    framer_ = new tetrAMMFramer(BINARY_BUFFER_SIZE);
+    if (dataAddress && (strlen(dataAddress) > 0)) {
+        dataSocket_ = new tetrAMMSocket(dataAddress, pasynUserSelf);
+    }
 
     createParam(P_InterlockStatusString, asynParamInt32,   &P_InterlockStatus);
+    createParam(P_NumResyncString,       asynParamInt32,   &P_NumResync);
+    createParam(P_DroppedBytesString,    asynParamInt32,   &P_DroppedBytes);
+    createParam(P_DroppedSamplesString,  asynParamInt32,   &P_DroppedSamples);
+    createParam(P_ResyncResetString,     asynParamInt32,   &P_ResyncReset);
+    setIntegerParam(P_NumResync, 0);
+    setIntegerParam(P_DroppedBytes, 0);
+    setIntegerParam(P_DroppedSamples, 0);
 
     // Connect to the server
     status = pasynOctetSyncIO->connect(QEPortName, 0, &pasynUserMeter_, NULL);
@@ -90,6 +132,11 @@ drvTetrAMM::drvTetrAMM(const char *portName, const char *QEPortName, int ringBuf
 //    drvQuadEM::reset();
     unlock();
 
+    if (configDepth_ > 0) {
+        if (initDrivers.empty()) initHookRegister(initHook);
+        initDrivers.push_back(this);
+    }
+
     /* Create the thread that reads the meter */
     status = (asynStatus)(epicsThreadCreate("drvTetrAMMTask",
                           epicsThreadPriorityMedium,
@@ -112,29 +159,35 @@ static void readThread(void *drvPvt)
     pPvt->readThread();
 }
 
-/** Sends a command to the TetrAMM and reads the response.
-  * If meter is acquiring turns it off and waits for it to stop sending data 
+static void initHook(initHookState state)
+{
+    if (state != initHookAfterIocRunning) return;
+    for (size_t i=0; i<initDrivers.size(); i++) {
+        initDrivers[i]->iocRunning();
+    }
+    initDrivers.clear();
+}
+
+/** Called when the IOC is running.  Commits the configuration transaction that collected the settings
+  * while the IOC was initialized, so they are sent to the meter with a single pipelined write.
+  */
+void drvTetrAMM::iocRunning()
+{
+    lock();
+    commitConfig();
+    callParamCallbacks();
+    unlock();
+}
+
+/** Sends a command to the TetrAMM.
+  * The command is queued in a configuration transaction, and the response is checked for ACK when it is committed.
+  * If meter is acquiring it is turned off before the command is sent and turned on again afterwards.
   */ 
 asynStatus drvTetrAMM::sendCommand()
 {
-  int prevAcquiring;
-  asynStatus status;
-  const char *functionName="sendCommand";
-  
-  prevAcquiring = acquiring_;
-  if (prevAcquiring) setAcquire(0);
-  status = writeReadMeter();
-  if (status) goto error;
-  if (strcmp(inString_, "ACK") != 0) {
-      asynPrint(pasynUserSelf, ASYN_TRACE_ERROR, 
-          "%s::%s: error, outString=%s expected ACK, received %s\n",
-          driverName, functionName, outString_, inString_);
-      status = asynError;
-      goto error;
-  }
-  if (prevAcquiring) setAcquire(1);
-  error:
-  return status;
+  beginConfig();
+  queueCommand(outString_);
+  return commitConfig();
 }
 
 
@@ -156,24 +209,180 @@ asynStatus drvTetrAMM::writeReadMeter()
   return status;
 }
 
-inline void swapDouble(char *in)
+/** Starts a configuration transaction.  Transactions can be nested, and only the outermost one is committed.
+  * While a transaction is open setAcquireParams() and readStatus() only note that they are needed,
+  * sendCommand() queues the command, and setAcquire(1) is deferred until the transaction is committed.
+  */
+void drvTetrAMM::beginConfig()
+{
+    configDepth_++;
+}
+
+/** Commits a configuration transaction.
+  * When the outermost transaction is committed, and there is anything to send, acquisition is stopped once.
+  * The queued commands, the acquisition settings and the status queries are then written to the meter
+  * back-to-back and the responses are matched with them, and acquisition is restarted once.
+  */
+asynStatus drvTetrAMM::commitConfig()
+{
+    asynStatus status=asynSuccess;
+    int firstStatus=0;
+    bool restart;
+    bool paramsSent=false;
+
+    if (--configDepth_ > 0) return asynSuccess;
+    restart = restartAcquire_;
+    restartAcquire_ = false;
+    if ((numQueued_ > 0) || configPending_ || statusPending_) {
+        if (acquiring_) {
+            setAcquire(0);
+            restart = true;
+        }
+        if (configPending_) {
+            queueAcquireParams();
+            paramsSent = true;
+        }
+        if (statusPending_) firstStatus = queueStatusCommands();
+        status = sendQueuedCommands();
+        if (statusPending_ && (status == asynSuccess)) status = parseStatus(firstStatus);
+        configPending_ = false;
+        statusPending_ = false;
+        numQueued_ = 0;
+    }
+    if (restart) {
+        // setAcquire(1) does not send the acquisition settings again if they were just sent
+        acquireParamsSent_ = paramsSent && (status == asynSuccess);
+        if (setAcquire(1) != asynSuccess) status = asynError;
+        acquireParamsSent_ = false;
+    }
+    return status;
+}
+
+/** Adds a command to the configuration transaction. */
+void drvTetrAMM::queueCommand(const char *command)
 {
-    char temp;
-    temp = in[0]; in[0] = in[7]; in[7] = temp;
-    temp = in[1]; in[1] = in[6]; in[6] = temp;
-    temp = in[2]; in[2] = in[5]; in[5] = temp;
-    temp = in[3]; in[3] = in[4]; in[4] = temp;
+    static const char *functionName="queueCommand";
+
+    if (numQueued_ == MAX_QUEUED_COMMANDS) {
+        asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
+            "%s::%s: error, too many commands in transaction, %s not sent\n",
+            driverName, functionName, command);
+        return;
+    }
+    epicsSnprintf(queuedCommands_[numQueued_], MAX_COMMAND_LEN, "%s", command);
+    queuedResponses_[numQueued_][0] = 0;
+    numQueued_++;
+}
+
+/** Writes all of the queued commands to the meter with a single write, and then reads the response to each of them.
+  * The responses are in the same order as the commands.  Commands that are not queries must return ACK.
+  */
+asynStatus drvTetrAMM::sendQueuedCommands()
+{
+    char *buffer;
+    size_t len=0;
+    size_t nwrite;
+    size_t nread;
+    int eomReason;
+    int i;
+    asynStatus status;
+    asynStatus result=asynSuccess;
+    static const char *functionName="sendQueuedCommands";
+
+    if (numQueued_ == 0) return asynSuccess;
+    // The commands are separated by the carriage return that terminates each command.
+    // The output EOS is added after the last one.
+    buffer = (char *)malloc(numQueued_ * MAX_COMMAND_LEN);
+    for (i=0; i<numQueued_; i++) {
+        if (i > 0) buffer[len++] = '\r';
+        strcpy(buffer + len, queuedCommands_[i]);
+        len += strlen(queuedCommands_[i]);
+    }
+    pasynOctetSyncIO->flush(pasynUserMeter_);
+    status = pasynOctetSyncIO->write(pasynUserMeter_, buffer, len, TetrAMM_TIMEOUT, &nwrite);
+    free(buffer);
+    if (status) {
+        asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
+            "%s::%s: error writing %d commands, status=%d\n",
+            driverName, functionName, numQueued_, status);
+        return status;
+    }
+    for (i=0; i<numQueued_; i++) {
+        status = pasynOctetSyncIO->read(pasynUserMeter_, queuedResponses_[i], MAX_COMMAND_LEN, 
+                                        TetrAMM_TIMEOUT, &nread, &eomReason);
+        asynPrint(pasynUserSelf, ASYN_TRACEIO_DRIVER, 
+            "%s::%s command=\"%s\", response=\"%s\", nread=%d, eomReason=%d, status=%d\n",
+            driverName, functionName, queuedCommands_[i], queuedResponses_[i], (int)nread, eomReason, status);
+        if (status) {
+            asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
+                "%s::%s: error reading response to %s, status=%d\n",
+                driverName, functionName, queuedCommands_[i], status);
+            return status;
+        }
+        if ((queuedCommands_[i][strlen(queuedCommands_[i])-1] != '?') && (strcmp(queuedResponses_[i], "ACK") != 0)) {
+            asynPrint(pasynUserSelf, ASYN_TRACE_ERROR, 
+                "%s::%s: error, outString=%s expected ACK, received %s\n",
+                driverName, functionName, queuedCommands_[i], queuedResponses_[i]);
+            result = asynError;
+        }
+    }
+    return result;
+}
+
+/** Called when asyn clients call pasynInt32->write().
+  * Handles the TetrAMM specific parameters and calls the base class for all others in a configuration transaction.
+  * \param[in] pasynUser pasynUser structure that encodes the reason and address.
+  * \param[in] value Value to write. */
+asynStatus drvTetrAMM::writeInt32(asynUser *pasynUser, epicsInt32 value)
+{
+    int function = pasynUser->reason;
+    asynStatus status;
+
+    if (function == P_ResyncReset) {
+        // The read thread only changes the statistics with the lock held, so they can be reset here
+        framer_->resetStatistics();
+        setIntegerParam(P_NumResync, 0);
+        setIntegerParam(P_DroppedBytes, 0);
+        setIntegerParam(P_DroppedSamples, 0);
+        callParamCallbacks();
+        return asynSuccess;
+    }
+    // All of the commands needed for this change are sent to the meter in a single transaction
+    beginConfig();
+    status = drvQuadEM::writeInt32(pasynUser, value);
+    if (commitConfig() != asynSuccess) status = asynError;
+    callParamCallbacks();
+    return status;
+}
+
+/** Called when asyn clients call pasynFloat64->write().
+  * Calls the base class in a configuration transaction.
+  * \param[in] pasynUser pasynUser structure that encodes the reason and address.
+  * \param[in] value Value to write. */
+asynStatus drvTetrAMM::writeFloat64(asynUser *pasynUser, epicsFloat64 value)
+{
+    asynStatus status;
+
+    beginConfig();
+    status = drvQuadEM::writeFloat64(pasynUser, value);
+    if (commitConfig() != asynSuccess) status = asynError;
+    callParamCallbacks();
+    return status;
 }
 
 /** Read thread to read the data from the electrometer when it is in continuous acquire mode.
   * Reads the data, computes the sums and positions, and does callbacks.
+  * In binary mode each read returns all of the data available, up to BINARY_BUFFER_SIZE bytes, into the buffer
+  * of the tetrAMMFramer.  The complete samples are decoded in place and passed to computePositionsBlock() as blocks.
+  * Any partial sample at the end of the buffer is kept for the next read.
+  * In ASCII mode each read also returns all of the data available, which is split into lines with a
+  * quadEMLineSplitter.  The samples are collected into blocks in the same way.
   */
 
 void drvTetrAMM::readThread(void)
 {
     asynStatus status;
     size_t nRead;
-    int bytesPerValue=8;
     int readFormat;
     int eomReason;
     int triggerMode;
@@ -185,13 +394,16 @@ void drvTetrAMM::readThread(void)
     asynInterface *pasynInterface;
     asynOctet *pasynOctet;
     void *octetPvt;
-    char charData[BINARY_BUFFER_SIZE];
-    epicsFloat64 *f64Data = (epicsFloat64 *)charData;
-    unsigned long long *i64Data = (unsigned long long *)charData;
-    unsigned char *pc;
-    unsigned long long lastValue;
-    char ASCIIData[ASCII_BUFFER_SIZE];
-    char *inPtr;
+    epicsFloat64 *blockData;
+    size_t numBlock=0;
+    size_t firstSample;
+    TetrAMMEvent_t events[BINARY_MAX_EVENTS];
+    size_t numEvents;
+    bool useDataSocket=false;
+    epicsFloat64 *pData;
+    quadEMLineSplitter lineSplitter(ASCII_BUFFER_SIZE);
+    const char *line;
+    size_t lineLength;
     size_t nRequested;
     static const char *functionName = "readThread";
 
@@ -212,12 +424,16 @@ void drvTetrAMM::readThread(void)
     }
     pasynOctet = (asynOctet *)pasynInterface->pinterface;
     octetPvt = pasynInterface->drvPvt;
+
+    // The buffer is too large for the stack of the thread
+    blockData = (epicsFloat64 *)malloc(BINARY_MAX_SAMPLES * QE_MAX_INPUTS * sizeof(epicsFloat64));
     
     /* Loop forever */
     lock();
     while (1) {
         if (acquiring_ == 0) {
             readingActive_ = 0;
+            epicsEventSignal(readingActiveEvent_);
             unlock();
             (void)epicsEventWait(acquireStartEvent_);
             lock();
@@ -225,22 +441,32 @@ void drvTetrAMM::readThread(void)
             numTrigEnds = 0;
             numTrigStarts = 0;
             nextExpectedEdge = 0;
+            // Discard any partial sample from the previous acquisition
+            framer_->reset(numChannels_);
+            lineSplitter.reset();
             getIntegerParam(P_TriggerMode, &triggerMode);
             getIntegerParam(P_ReadFormat, &readFormat);
+            useDataSocket = useDataSocket_;
             readingActive_ = 1;
+            epicsEventSignal(readingActiveEvent_);
         }
         if (readFormat == QEReadFormatBinary) {
-            nRequested = (numChannels_ + 1) * bytesPerValue;
+            // Read all of the data that is available after the partial sample from the previous read.
+            // The read returns as soon as any data is available, so this does not add latency.
+            nRequested = framer_->writeSpace();
             unlock();
-            pasynManager->lockPort(pasynUser);
-            status = pasynOctet->read(octetPvt, pasynUser, charData, nRequested, 
-                                      &nRead, &eomReason);
-            pasynManager->unlockPort(pasynUser);
+            if (useDataSocket) {
+                status = dataSocket_->read(framer_->writePointer(), nRequested, TetrAMM_TIMEOUT, &nRead);
+                eomReason = 0;
+            } else {
+                pasynManager->lockPort(pasynUser);
+                status = pasynOctet->read(octetPvt, pasynUser, (char *)framer_->writePointer(), nRequested, 
+                                          &nRead, &eomReason);
+                pasynManager->unlockPort(pasynUser);
+            }
             lock();
 
-            if ((status != asynSuccess) || 
-                (nRead  != nRequested)  || 
-                (eomReason != ASYN_EOM_CNT)) {
+            if (nRead == 0) {
                 if (status == asynTimeout) {
                     asynPrint(pasynUserSelf, ASYN_TRACE_WARNING, 
                         "%s::%s: timeout reading meter\n", 
@@ -258,97 +484,71 @@ void drvTetrAMM::readThread(void)
                 }
                 continue;
             }
-            // If we are on a little-endian machine we need to swap the byte order
-            if (EPICS_BYTE_ORDER == EPICS_ENDIAN_LITTLE) {
-                for (i=0; i<=numChannels_; i++) swapDouble(charData + i*bytesPerValue);
-            }
-            lastValue = i64Data[numChannels_];
-            switch(lastValue) {
-                case 0xfff40002ffffffffull:
-                    // This is a signalling Nan at the end of normal data
-                    for (i=numChannels_; i<4; i++) f64Data[i] = 0.0;
-                    computePositions(f64Data);
-                   break;
-                case 0xfff40000ffffffffull:
-                    // This is a signalling Nan on the rising edge of a trigger
-                    numTrigStarts++;
-                    if (nextExpectedEdge != 0) {
-                        asynPrint(pasynUserSelf, ASYN_TRACE_ERROR, 
-                            "%s::%s Extra trigger start, numTrigStarts=%d, numTrigsEnds=%d\n", 
-                             driverName, functionName, numTrigStarts, numTrigEnds);
-                    }
-                    nextExpectedEdge = 1;
-                    break;
-                case 0xfff40001ffffffffull:
-                    // This is a signalling Nan on the falling edge of a trigger
-                    numTrigEnds++;
-                    if (triggerMode == QETriggerModeExtBulb) {
-                        triggerCallbacks();
-                    }
-                    if (nextExpectedEdge != 1) {
-                        asynPrint(pasynUserSelf, ASYN_TRACE_ERROR, 
-                            "%s::%s Extra trigger end, numTrigStarts=%d, numTrigsEnds=%d\n", 
-                             driverName, functionName, numTrigStarts, numTrigEnds);
-                    }
-                    nextExpectedEdge = 0;
-                    break;
-                case 0xfff40003ffffffffull:
-                    // This is a signaling Nan when the acquistion was stopped
-                    asynPrint(pasynUserSelf, ASYN_TRACEIO_DRIVER,
-                            "%s::%s: seen acq done sNaN (0xfff40003ffffffffull)\n",
-                            driverName, functionName);
-                    break;
-                default: 
-                    // We have lost sync, probably due to a dropped packet.
-                    // Recover sync by reading 2 times length per sample, which is enough to guarantee that
-                    // it will contain a NaN unless we are losing many packets
-                    asynPrint(pasynUserSelf, ASYN_TRACE_WARNING, 
-                            "%s::%s: warning, lost sync, no NaN where expected; resynchronizing\n", 
-                            driverName, functionName);
-                    unlock();
-                    pasynManager->lockPort(pasynUser);
-                    nRequested = ((numChannels_ + 1) * bytesPerValue)*2;
-                    status = pasynOctet->read(octetPvt, pasynUser, charData, nRequested, 
-                                              &nRead, &eomReason);
-                    for (i=0; i<(BINARY_BUFFER_SIZE-bytesPerValue); i++) {
-                        pc = (unsigned char *)charData + i;
-                        if (pc[0]==0xff && pc[1]==0xf4 && pc[2]==0x00 && pc[3]==0x02 &&
-                            pc[4]==0xff && pc[5]==0xff && pc[6]==0xff && pc[7]==0xff) {
-                            // We need to read (BINARY_BUFFER_SIZE - bytesPerValue - i) bytes
-                            nRequested = nRequested - bytesPerValue - i;
-                            status = pasynOctet->read(octetPvt, pasynUser, charData, nRequested, 
-                                                      &nRead, &eomReason);
-                            numResync_++;
+            framer_->commit(nRead);
+            readComplete();
+            // Decode the data samples and the other markers in a single pass
+            while (framer_->decode(blockData, BINARY_MAX_SAMPLES, &numBlock, events, BINARY_MAX_EVENTS, &numEvents)) {
+                // Process the samples before each event so the trigger edges are seen at the correct sample
+                firstSample = 0;
+                for (i=0; i<(int)numEvents; i++) {
+                    computePositionsBlock(blockData + firstSample*QE_MAX_INPUTS, events[i].sample - firstSample);
+                    firstSample = events[i].sample;
+                    switch(events[i].type) {
+                        case TetrAMMEventTrigStart:
+                            // This is a signalling Nan on the rising edge of a trigger
+                            numTrigStarts++;
+                            if (nextExpectedEdge != 0) {
+                                asynPrint(pasynUserSelf, ASYN_TRACE_ERROR, 
+                                    "%s::%s Extra trigger start, numTrigStarts=%d, numTrigsEnds=%d\n", 
+                                     driverName, functionName, numTrigStarts, numTrigEnds);
+                            }
+                            nextExpectedEdge = 1;
+                            break;
+                        case TetrAMMEventTrigEnd:
+                            // This is a signalling Nan on the falling edge of a trigger
+                            numTrigEnds++;
+                            if (triggerMode == QETriggerModeExtBulb) {
+                                triggerCallbacks();
+                            }
+                            if (nextExpectedEdge != 1) {
+                                asynPrint(pasynUserSelf, ASYN_TRACE_ERROR, 
+                                    "%s::%s Extra trigger end, numTrigStarts=%d, numTrigsEnds=%d\n", 
+                                     driverName, functionName, numTrigStarts, numTrigEnds);
+                            }
+                            nextExpectedEdge = 0;
+                            break;
+                        case TetrAMMEventAcqDone:
+                            // This is a signaling Nan when the acquistion was stopped
+                            asynPrint(pasynUserSelf, ASYN_TRACEIO_DRIVER,
+                                    "%s::%s: seen acq done sNaN (0xfff40003ffffffffull)\n",
+                                    driverName, functionName);
+                            break;
+                        default: 
+                            // We have lost sync, probably due to a dropped packet.
+                            // The framer resynchronizes on the next data NaN in the stream.
                             asynPrint(pasynUserSelf, ASYN_TRACE_WARNING, 
-                                "%s::%s: found NaN at position %d, read %d bytes\n", 
-                                driverName, functionName, i, (int)nRequested);
+                                    "%s::%s: warning, lost sync, no NaN where expected; resynchronizing\n", 
+                                    driverName, functionName);
                             break;
-                         }
                     }
-                    if (i == (BINARY_BUFFER_SIZE-bytesPerValue)) {
-                        asynPrint(pasynUserSelf, ASYN_TRACE_ERROR, 
-                            "%s::%s: ERROR, did not find NaN\n", 
-                            driverName, functionName);
-                        asynPrintIO(pasynUserSelf, ASYN_TRACE_ERROR, charData, nRead,
-                            "%s::%s: buffer read when resynchronizing\n", 
-                            driverName, functionName);
-                    }
-                    pasynManager->unlockPort(pasynUser);
-                    lock();
-                    break;
+                }
+                computePositionsBlock(blockData + firstSample*QE_MAX_INPUTS, numBlock - firstSample);
             }
+            setIntegerParam(P_NumResync, framer_->numResync());
+            setIntegerParam(P_DroppedBytes, (int)framer_->droppedBytes());
+            setIntegerParam(P_DroppedSamples, (int)framer_->droppedSamples());
         }
         else {  // ASCII format
-            nRequested = sizeof(ASCIIData);
+            // Read all of the data that is available after the partial line from the previous read
+            nRequested = lineSplitter.writeSpace();
             unlock();
             pasynManager->lockPort(pasynUser);
-            status = pasynOctet->read(octetPvt, pasynUser, ASCIIData, nRequested, 
+            status = pasynOctet->read(octetPvt, pasynUser, lineSplitter.writePointer(), nRequested, 
                                       &nRead, &eomReason);
             pasynManager->unlockPort(pasynUser);
             lock();
 
-            if ((status != asynSuccess) || 
-                (eomReason != ASYN_EOM_EOS)) {
+            if (nRead == 0) {
                 if (status != asynTimeout) {
                     asynPrint(pasynUserSelf, ASYN_TRACE_ERROR, 
                         "%s::%s: unexpected error reading meter status=%d, nRead=%lu, eomReason=%d\n", 
@@ -361,38 +561,51 @@ void drvTetrAMM::readThread(void)
                 }
                 continue;
             }
-
-            if (strstr(ASCIIData, "SEQNR") != 0) {
-                // This is the rising edge of a trigger
-                numTrigStarts++;
-                if (nextExpectedEdge != 0) {
-                    asynPrint(pasynUserSelf, ASYN_TRACE_ERROR, 
-                        "%s::%s Extra trigger start, numTrigStarts=%d, numTrigsEnds=%d\n", 
-                         driverName, functionName, numTrigStarts, numTrigEnds);
-                }
-                nextExpectedEdge = 1;
-            } 
-            else if (strstr(ASCIIData, "EOTRG") != 0) {
-                // This is the falling edge of a trigger
-                numTrigEnds++;
-                if (triggerMode == QETriggerModeExtBulb) {
-                    triggerCallbacks();
-                }
-                if (nextExpectedEdge != 1) {
-                    asynPrint(pasynUserSelf, ASYN_TRACE_ERROR, 
-                        "%s::%s Extra trigger end, numTrigStarts=%d, numTrigsEnds=%d\n", 
-                         driverName, functionName, numTrigStarts, numTrigEnds);
+            lineSplitter.commit(nRead);
+            readComplete();
+            numBlock = 0;
+            while (lineSplitter.nextLine(&line, &lineLength)) {
+                switch (quadEMFindKeyword(line, lineLength, ASCIIKeywords, 2)) {
+                    case 0:
+                        // This is the rising edge of a trigger.  Process the samples before it first.
+                        computePositionsBlock(blockData, numBlock);
+                        numBlock = 0;
+                        numTrigStarts++;
+                        if (nextExpectedEdge != 0) {
+                            asynPrint(pasynUserSelf, ASYN_TRACE_ERROR, 
+                                "%s::%s Extra trigger start, numTrigStarts=%d, numTrigsEnds=%d\n", 
+                                 driverName, functionName, numTrigStarts, numTrigEnds);
+                        }
+                        nextExpectedEdge = 1;
+                        break;
+                    case 1:
+                        // This is the falling edge of a trigger.  Process the samples before it first.
+                        computePositionsBlock(blockData, numBlock);
+                        numBlock = 0;
+                        numTrigEnds++;
+                        if (triggerMode == QETriggerModeExtBulb) {
+                            triggerCallbacks();
+                        }
+                        if (nextExpectedEdge != 1) {
+                            asynPrint(pasynUserSelf, ASYN_TRACE_ERROR, 
+                                "%s::%s Extra trigger end, numTrigStarts=%d, numTrigsEnds=%d\n", 
+                                 driverName, functionName, numTrigStarts, numTrigEnds);
+                        }
+                        nextExpectedEdge = 0;
+                        break;
+                    default:
+                        pData = blockData + numBlock*QE_MAX_INPUTS;
+                        // Lines that are not complete samples are ignored
+                        if (quadEMParseDoubles(line, lineLength, pData, numChannels_) != numChannels_) break;
+                        for (i=numChannels_; i<QE_MAX_INPUTS; i++) pData[i] = 0.0;
+                        if (++numBlock == BINARY_MAX_SAMPLES) {
+                            computePositionsBlock(blockData, numBlock);
+                            numBlock = 0;
+                        }
+                        break;
                 }
-                nextExpectedEdge = 0;
-            }
-            else {
-                inPtr = ASCIIData;
-                for (i=0; i<numChannels_; i++) {
-                    f64Data[i] = strtod(inPtr, &inPtr);
-                }
-                for (i=numChannels_; i<4; i++) f64Data[i] = 0.0;
-                computePositions(f64Data);
             }
+            computePositionsBlock(blockData, numBlock);
         }
         callParamCallbacks();
     }
@@ -424,8 +637,9 @@ asynStatus drvTetrAMM::reset()
 
     // Try to turn off meter.  This will set the output EOS which may be needed.
     setAcquire(0);
+    // This is sent immediately, not in a configuration transaction, because we wait for the meter below
     strcpy(outString_, "HWRESET");
-    status = sendCommand();
+    status = writeReadMeter();
     // Wait for meter to start communicating or max of waitLoops seconds
     for (i=0; i<waitLoops; i++) {
         epicsThreadSleep(1.0);
@@ -438,8 +652,10 @@ asynStatus drvTetrAMM::reset()
             "%s::%s: error, no response from meter after %d seconds\n",
             driverName, functionName, waitLoops);
     }
-    // Call the base class method
-    status = drvQuadEM::reset();
+    // Call the base class method.  All of the settings are sent in a single transaction.
+    beginConfig();
+    drvQuadEM::reset();
+    status = commitConfig();
     return status;
 }
 
@@ -448,6 +664,44 @@ asynStatus drvTetrAMM::reset()
 /** Starts and stops the electrometer.
   * \param[in] value 1 to start the electrometer, 0 to stop it.
   */
+/** Stops the acquisition when the binary data are received with the data socket.
+  * Sends ACQ:OFF on the data socket and discards the rest of the data stream until the ACK.
+  */
+asynStatus drvTetrAMM::stopDataSocket()
+{
+    unsigned char buffer[4096];
+    char tail[6] = {0};
+    size_t nRead, n;
+    asynStatus status;
+    epicsUInt64 start;
+    static const char *functionName = "stopDataSocket";
+
+    status = dataSocket_->write("ACQ:OFF");
+    if (status) return status;
+    start = epicsMonotonicGet();
+    while (1) {
+        // The meter may keep sending data or never send the ACK, so there is a limit on the total time
+        if ((epicsMonotonicGet() - start) * 1e-9 > TetrAMM_STOP_TIMEOUT) {
+            asynPrint(pasynUserSelf, ASYN_TRACE_ERROR, 
+                "%s::%s timeout waiting for ACK response\n",
+                driverName, functionName);
+            return asynTimeout;
+        }
+        status = dataSocket_->read(buffer, sizeof(buffer), TetrAMM_TIMEOUT, &nRead);
+        if (status != asynSuccess) {
+            asynPrint(pasynUserSelf, ASYN_TRACE_ERROR, 
+                "%s::%s error waiting for ACK response, status=%d\n",
+                driverName, functionName, status);
+            return status;
+        }
+        // Keep the last 5 characters, which could span reads
+        n = (nRead < 5) ? nRead : 5;
+        memmove(tail, tail + n, 5 - n);
+        memcpy(tail + 5 - n, buffer + nRead - n, n);
+        if (strcmp(tail, "ACK\r\n") == 0) return asynSuccess;
+    }
+}
+
 asynStatus drvTetrAMM::setAcquire(epicsInt32 value) 
 {
     size_t nread;
@@ -460,6 +714,12 @@ asynStatus drvTetrAMM::setAcquire(epicsInt32 value)
 
     // Return without doing anything if value=1 and already acquiring
     if ((value == 1) && (acquiring_)) return asynSuccess;
+
+    // In a configuration transaction acquisition is started when the transaction is committed
+    if (configDepth_ > 0) {
+        restartAcquire_ = (value == 1);
+        if (value == 1) return asynSuccess;
+    }
     
     // Make sure the input EOS is set
     status = pasynOctetSyncIO->setInputEos(pasynUserMeter_, "\r\n", 2);
@@ -482,12 +742,17 @@ asynStatus drvTetrAMM::setAcquire(epicsInt32 value)
         // Wait for the read thread to stop
         while (readingActive_) {
             unlock();
-            epicsThreadSleep(0.01);
+            (void)epicsEventWaitWithTimeout(readingActiveEvent_, QE_READING_ACTIVE_WAIT);
             lock();
         }
-        status = pasynOctetSyncIO->writeRead(pasynUserMeter_, "ACQ:OFF", strlen("ACQ:OFF"), 
-            response, sizeof(response), TetrAMM_TIMEOUT, &nwrite, &nread, &eomReason);
-        if ((status != asynSuccess) || (nread != 3) || (strcmp(response, "ACK") != 0)) {
+        if (useDataSocket_) {
+            // The data stream and the ACK are on the data socket
+            status = stopDataSocket();
+        } else {
+            status = pasynOctetSyncIO->writeRead(pasynUserMeter_, "ACQ:OFF", strlen("ACQ:OFF"), 
+                response, sizeof(response), TetrAMM_TIMEOUT, &nwrite, &nread, &eomReason);
+        }
+        if (!useDataSocket_ && ((status != asynSuccess) || (nread != 3) || (strcmp(response, "ACK") != 0))) {
             while (1) {
                 // Read until the read terminated on EOS (\r\n) and last 3 characters of the response
                 // are ACK or until we get a timeout.  
@@ -513,13 +778,21 @@ asynStatus drvTetrAMM::setAcquire(epicsInt32 value)
         // Call the base class function because it handles some common tasks.
         drvQuadEM::setAcquire(1);
 
-        // For now we call setAcquireParams().  This seems to be necessary when sending NAQ, and only takes 20 ms.
+        // For now we call setAcquireParams().  This seems to be necessary when sending NAQ, and the commands
+        // are sent with a single write.
         // It also has the effect of flusing any stale input
-        setAcquireParams();
-        status = pasynOctetSyncIO->write(pasynUserMeter_, "ACQ:ON", strlen("ACQ:ON"), 
-                            TetrAMM_TIMEOUT, &nwrite);
+        // This is skipped when a configuration transaction has just sent them and is restarting acquisition.
+        if (!acquireParamsSent_) setAcquireParams();
         getIntegerParam(P_ReadFormat, &readFormat);
-        if (readFormat == QEReadFormatBinary) {
+        // If there is a data socket it is used for the binary data stream
+        useDataSocket_ = (dataSocket_ != 0) && (readFormat == QEReadFormatBinary);
+        if (useDataSocket_) {
+            status = dataSocket_->connect();
+            if (status == asynSuccess) status = dataSocket_->write("ACQ:ON");
+        } else {
+            status = pasynOctetSyncIO->write(pasynUserMeter_, "ACQ:ON", strlen("ACQ:ON"), 
+                                TetrAMM_TIMEOUT, &nwrite);
+            // The read thread splits the ASCII data into lines itself, so it can read many lines at once
             status = pasynOctetSyncIO->setInputEos(pasynUserMeter_, "", 0);
         }
         // Notify the read thread if acquisition status has started
@@ -527,7 +800,7 @@ asynStatus drvTetrAMM::setAcquire(epicsInt32 value)
         // Wait for the read thread to start
         while (!readingActive_) {
             unlock();
-            epicsThreadSleep(0.01);
+            (void)epicsEventWaitWithTimeout(readingActiveEvent_, QE_READING_ACTIVE_WAIT);
             lock();
         }
     }
@@ -538,7 +811,18 @@ asynStatus drvTetrAMM::setAcquire(epicsInt32 value)
 }
 
 
+/** Sends the acquisition settings to the meter.
+  * In a configuration transaction they are sent once when the transaction is committed.
+  */
 asynStatus drvTetrAMM::setAcquireParams()
+{
+    beginConfig();
+    configPending_ = true;
+    return commitConfig();
+}
+
+/** Queues the commands for the acquisition settings in the configuration transaction. */
+void drvTetrAMM::queueAcquireParams()
 {
     int numAverage;
     int acquireMode;
@@ -552,12 +836,8 @@ asynStatus drvTetrAMM::setAcquireParams()
     int triggerPolarity;
     double sampleTime;
     double averagingTime;
-    int prevAcquiring;
     int numAcquire;
-    //static const char *functionName = "setAcquireParams";
-
-    prevAcquiring = acquiring_;
-    if (prevAcquiring) setAcquire(0);
+    //static const char *functionName = "queueAcquireParams";
 
     getIntegerParam(P_NumChannels,      &numChannels);
     for (int i=0; i<4; i++) {
@@ -586,11 +866,11 @@ asynStatus drvTetrAMM::setAcquireParams()
     // Set the range of the individual channels
     for (int i=0; i<4; i++) {
         epicsSnprintf(outString_, sizeof(outString_), "RNG:CH%d:%d", i+1, range[i]);
-        writeReadMeter();
+        queueCommand(outString_);
     }
 
     epicsSnprintf(outString_, sizeof(outString_), "CHN:%d", numChannels);
-    writeReadMeter();
+    queueCommand(outString_);
 
     // Set the desired read format
     if (readFormat == QEReadFormatBinary) {
@@ -598,7 +878,7 @@ asynStatus drvTetrAMM::setAcquireParams()
     } else {
         strcpy(outString_, "ASCII:ON");
     }
-    writeReadMeter();
+    queueCommand(outString_);
 
     if (valuesPerRead > MAX_VALUES_PER_READ ) valuesPerRead = MAX_VALUES_PER_READ;
     if (readFormat == QEReadFormatBinary) {
@@ -609,15 +889,15 @@ asynStatus drvTetrAMM::setAcquireParams()
 
     // Send the NRSAMP command
     sprintf(outString_, "NRSAMP:%d", valuesPerRead);
-    writeReadMeter();
+    queueCommand(outString_);
 
     // Send the TRG:OFF or TRG:ON command
     sprintf(outString_, "TRG:%s", (triggerMode == QETriggerModeFreeRun) ? "OFF" : "ON");
-    writeReadMeter();
+    queueCommand(outString_);
 
     // Send the TRGPOL:POS or TRGPOL:NEG command
     sprintf(outString_, "TRGPOL:%s", (triggerPolarity == QETriggerPolarityPositive) ? "POS" : "NEG");
-    writeReadMeter();
+    queueCommand(outString_);
 
     // Send the NAQ command
     naq = 0;
@@ -627,17 +907,15 @@ asynStatus drvTetrAMM::setAcquireParams()
         naq = numAverage;
     }        
     sprintf(outString_, "NAQ:%d", naq);
-    writeReadMeter();
+    queueCommand(outString_);
     
     // Send the NTRG command (NTRG command does not affect continuous mode)
     ntrg = 0;
     if (acquireMode == QEAcquireModeSingle) ntrg = 1;
     else if (acquireMode == QEAcquireModeMultiple) ntrg = numAcquire;
     sprintf(outString_, "NTRG:%d", ntrg);
-    writeReadMeter();
+    queueCommand(outString_);
 
-    if (prevAcquiring) setAcquire(1);    
-    return asynSuccess;
 }
 
 
@@ -775,72 +1053,92 @@ asynStatus drvTetrAMM::setValuesPerRead(epicsInt32 value)
 }
 
 /** Reads all the settings back from the electrometer.
+  * In a configuration transaction they are read once when the transaction is committed.
   */
 asynStatus drvTetrAMM::readStatus() 
+{
+    beginConfig();
+    statusPending_ = true;
+    return commitConfig();
+}
+
+/** Queues the queries for the status in the configuration transaction.
+  * Returns the index of the first query, which is passed to parseStatus().
+  */
+int drvTetrAMM::queueStatusCommands()
+{
+    int first = numQueued_;
+
+    queueCommand("CHN:?");
+    for (int i=0; i<4; i++) {
+        sprintf(outString_, "RNG:CH%d:?", i+1);
+        queueCommand(outString_);
+    }
+    queueCommand("NRSAMP:?");
+    queueCommand("HVS:?");
+    queueCommand("HVV:?");
+    queueCommand("HVI:?");
+    queueCommand("TEMP:?");
+    queueCommand("STATUS:?");
+    return first;
+}
+
+/** Parses the responses to the status queries, and sets them in the parameter library
+  * \param[in] first The index of the first query in the configuration transaction.
+  */
+asynStatus drvTetrAMM::parseStatus(int first)
 {
     // Reads the values of all the meter parameters, sets them in the parameter library
     int range, numChannels, numAverage, valuesPerRead, triggerMode;
     double biasVoltage, voltageReadback, currentReadback, temperature;
     unsigned long int unitStatus;
-    int prevAcquiring;
     double sampleTime=0., averagingTime;
-    static const char *functionName = "getStatus";
+    int n = first;
+    static const char *functionName = "parseStatus";
     
-    prevAcquiring = acquiring_;
-    if (prevAcquiring) setAcquire(0);
-
-    strcpy(outString_, "CHN:?");
-    writeReadMeter();
-    if (sscanf(inString_, "CHN:%d", &numChannels) != 1) goto error;
+    if (sscanf(queuedResponses_[n], "CHN:%d", &numChannels) != 1) goto error;
     setIntegerParam(P_NumChannels, numChannels);
     numChannels_ = numChannels;
 
     for (int i=0; i<4; i++) {
-        sprintf(outString_, "RNG:CH%d:?", i+1);
-        writeReadMeter();
-        if (sscanf(inString_, "RNG:CH%*1c:%d", &range) != 1) goto error;
+        n++;
+        if (sscanf(queuedResponses_[n], "RNG:CH%*1c:%d", &range) != 1) goto error;
         setIntegerParam(i+1, P_Range, range);
         // Set the main Range readback to the first channel
         if (i == 0) setIntegerParam(P_Range, range);
     }
         
-    strcpy(outString_, "NRSAMP:?");
-    writeReadMeter();
-    if (sscanf(inString_, "NRSAMP:%d", &valuesPerRead) != 1) goto error;
+    n++;
+    if (sscanf(queuedResponses_[n], "NRSAMP:%d", &valuesPerRead) != 1) goto error;
     setIntegerParam(P_ValuesPerRead, valuesPerRead);
 
     // Compute the sample time.  This is 10 microseconds times valuesPerRead. 
     sampleTime = 10e-6 * valuesPerRead;
     setDoubleParam(P_SampleTime, sampleTime);
 
-    strcpy(outString_, "HVS:?");
-    writeReadMeter();
-    if (strncmp(inString_, "HVS:OFF", sizeof(inString_)) == 0) {
+    n++;
+    if (strncmp(queuedResponses_[n], "HVS:OFF", MAX_COMMAND_LEN) == 0) {
         setIntegerParam(P_HVSReadback, 0);
     } else {
         setIntegerParam(P_HVSReadback, 1);
-        if (sscanf(inString_, "HVS:%lf", &biasVoltage) != 1) goto error;
+        if (sscanf(queuedResponses_[n], "HVS:%lf", &biasVoltage) != 1) goto error;
         setDoubleParam(P_BiasVoltage, biasVoltage);
     }
 
-    strcpy(outString_, "HVV:?");
-    writeReadMeter();
-    if (sscanf(inString_, "HVV:%lf", &voltageReadback) != 1) goto error;
+    n++;
+    if (sscanf(queuedResponses_[n], "HVV:%lf", &voltageReadback) != 1) goto error;
     setDoubleParam(P_HVVReadback, voltageReadback);
 
-    strcpy(outString_, "HVI:?");
-    writeReadMeter();
-    if (sscanf(inString_, "HVI:%lf", &currentReadback) != 1) goto error;
+    n++;
+    if (sscanf(queuedResponses_[n], "HVI:%lf", &currentReadback) != 1) goto error;
     setDoubleParam(P_HVIReadback, currentReadback);
 
-    strcpy(outString_, "TEMP:?");
-    writeReadMeter();
-    if (sscanf(inString_, "TEMP:%lf", &temperature) != 1) goto error;
+    n++;
+    if (sscanf(queuedResponses_[n], "TEMP:%lf", &temperature) != 1) goto error;
     setDoubleParam(P_Temperature, temperature);
 
-    strcpy(outString_, "STATUS:?");
-    writeReadMeter();
-    if (sscanf(inString_, "STATUS:%lx", &unitStatus) != 1) goto error;
+    n++;
+    if (sscanf(queuedResponses_[n], "STATUS:%lx", &unitStatus) != 1) goto error;
     //get general fault bit (tetramm user manual pg 40)
     setIntegerParam(P_InterlockStatus, (unitStatus>>8)&0x80);
 
@@ -854,14 +1152,12 @@ asynStatus drvTetrAMM::readStatus()
     }
     setIntegerParam(P_NumAverage, numAverage);
 
-    if (prevAcquiring) setAcquire(1);
-    
     return asynSuccess;
 
     error:
     asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
         "%s::%s: error, outString=%s, inString=%s\n",
-        driverName, functionName, outString_, inString_);
+        driverName, functionName, queuedCommands_[n], queuedResponses_[n]);
     return asynError;
 }
 
@@ -881,8 +1177,11 @@ void drvTetrAMM::report(FILE *fp, int details)
 {
     int prevAcquiring = 0;
 
-    fprintf(fp, "%s: port=%s, IP port=%s, firmware version=%s, numResync=%d\n",
-            driverName, portName, QEPortName_, firmwareVersion_, numResync_);
+    fprintf(fp, "%s: port=%s, IP port=%s, firmware version=%s, binary decoder=%s\n",
+            driverName, portName, QEPortName_, firmwareVersion_, framer_->decoderName());
+    fprintf(fp, "  numResync=%d, droppedBytes=%llu, droppedSamples=%llu\n", framer_->numResync(),
+            (unsigned long long)framer_->droppedBytes(), (unsigned long long)framer_->droppedSamples());
+    if (dataSocket_) dataSocket_->report(fp);
     if (details > 0) {
         prevAcquiring = acquiring_;
         setAcquire(0);
@@ -916,10 +1215,11 @@ extern "C" {
   *            This should be large enough to hold all the samples between reads of the
   *            device, e.g. 1 ms SampleTime and 1 second read rate = 1000 samples.
   *            If 0 then default of 2048 is used.
+  * \param[in] dataAddress Optional address of the meter for the binary data stream, "host:port" or "host:port UDP".
   */
-int drvTetrAMMConfigure(const char *portName, const char *QEPortName, int ringBufferSize)
+int drvTetrAMMConfigure(const char *portName, const char *QEPortName, int ringBufferSize, const char *dataAddress)
 {
-    new drvTetrAMM(portName, QEPortName, ringBufferSize);
+    new drvTetrAMM(portName, QEPortName, ringBufferSize, dataAddress);
     return(asynSuccess);
 }
 
@@ -929,13 +1229,15 @@ int drvTetrAMMConfigure(const char *portName, const char *QEPortName, int ringBu
 static const iocshArg initArg0 = { "portName",iocshArgString};
 static const iocshArg initArg1 = { "QEPortName",iocshArgString};
 static const iocshArg initArg2 = { "ring buffer size",iocshArgInt};
+static const iocshArg initArg3 = { "data address",iocshArgString};
 static const iocshArg * const initArgs[] = {&initArg0,
                                             &initArg1,
-                                            &initArg2};
-static const iocshFuncDef initFuncDef = {"drvTetrAMMConfigure",3,initArgs};
+                                            &initArg2,
+                                            &initArg3};
+static const iocshFuncDef initFuncDef = {"drvTetrAMMConfigure",4,initArgs};
 static void initCallFunc(const iocshArgBuf *args)
 {
-    drvTetrAMMConfigure(args[0].sval, args[1].sval, args[2].ival);
+    drvTetrAMMConfigure(args[0].sval, args[1].sval, args[2].ival, args[3].sval);
 }
 
 void drvTetrAMMRegister(void)
@@ -9,21 +9,33 @@
  */
 
 #include "drvQuadEM.h"
+#include "tetrAMMDecode.h"
+
+class tetrAMMSocket;
 
 #define MAX_COMMAND_LEN 256
+// Maximum number of commands that are sent to the meter in one configuration transaction
+#define MAX_QUEUED_COMMANDS 64
 #define P_InterlockStatusString  "TETRAMM_INTERLOCK_STATUS"             /* asynInt32,    r/w */
+#define P_NumResyncString        "TETRAMM_NUM_RESYNC"                   /* asynInt32,    r/o */
+#define P_DroppedBytesString     "TETRAMM_DROPPED_BYTES"                /* asynInt32,    r/o */
+#define P_DroppedSamplesString   "TETRAMM_DROPPED_SAMPLES"              /* asynInt32,    r/o */
+#define P_ResyncResetString      "TETRAMM_RESYNC_RESET"                 /* asynInt32,    r/w */
 
 /** Class to control the CaenEls TetrAMM 4-Channel Picoammeter */
 class drvTetrAMM : public drvQuadEM {
 public:
-    drvTetrAMM(const char *portName, const char *QEPortName, int ringBufferSize);
+    drvTetrAMM(const char *portName, const char *QEPortName, int ringBufferSize, const char *dataAddress);
     
     /* These are the methods we implement from asynPortDriver */
     void report(FILE *fp, int details);
+    virtual asynStatus writeInt32(asynUser *pasynUser, epicsInt32 value);
+    virtual asynStatus writeFloat64(asynUser *pasynUser, epicsFloat64 value);
                  
     /* These are the methods that are new to this class */
     void readThread(void);
     virtual void exitHandler();
+    void iocRunning();
 
 protected:
     /* These are the methods we implement from quadEM */
@@ -44,20 +56,44 @@ protected:
     virtual asynStatus setTriggerPolarity(epicsInt32 value);
     virtual asynStatus setValuesPerRead(epicsInt32 value);
     int P_InterlockStatus;
+    int P_NumResync;
+    int P_DroppedBytes;
+    int P_DroppedSamples;
+    int P_ResyncReset;
  
 private:
     /* Our data */
     asynUser *pasynUserMeter_;
     epicsEventId acquireStartEvent_;
+    epicsEventId readingActiveEvent_;  // Signalled by the read thread when readingActive_ changes
     int readingActive_;
-    int numResync_;
+    tetrAMMFramer *framer_;
+    tetrAMMSocket *dataSocket_;
+    bool useDataSocket_;
     char *QEPortName_;
     char firmwareVersion_[MAX_COMMAND_LEN];
     char outString_[MAX_COMMAND_LEN];
     char inString_[MAX_COMMAND_LEN];
+    // Settings are changed in configuration transactions, see beginConfig()
+    int configDepth_;
+    bool configPending_;
+    bool statusPending_;
+    bool restartAcquire_;
+    bool acquireParamsSent_;  // The acquisition settings were sent by the transaction that restarts acquisition
+    int numQueued_;
+    char queuedCommands_[MAX_QUEUED_COMMANDS][MAX_COMMAND_LEN];
+    char queuedResponses_[MAX_QUEUED_COMMANDS][MAX_COMMAND_LEN];
     asynStatus sendCommand();
     asynStatus writeReadMeter();
     asynStatus setAcquireParams();
+    void beginConfig();
+    asynStatus commitConfig();
+    void queueCommand(const char *command);
+    asynStatus sendQueuedCommands();
+    void queueAcquireParams();
+    int queueStatusCommands();
+    asynStatus parseStatus(int first);
     asynStatus getFirmwareVersion();
+    asynStatus stopDataSocket();
 };
 
@@ -0,0 +1,495 @@
+/*
+ * tetrAMMDecode.cpp
+ *
+ * Decoders for the binary data stream from the TetrAMM.
+ * See tetrAMMDecode.h for a description.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include <epicsTypes.h>
+#include <epicsThread.h>
+#include <epicsTime.h>
+#include <iocsh.h>
+
+#include <epicsExport.h>
+#include "tetrAMMDecode.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+  #define TETRAMM_DECODE_X86
+  #include <immintrin.h>
+#endif
+
+/** Returns the 64-bit big-endian value at p, which need not be aligned */
+static inline epicsUInt64 bigEndianUInt64(const unsigned char *p)
+{
+    epicsUInt64 value=0;
+    int i;
+    for (i=0; i<8; i++) value = (value << 8) | p[i];
+    return value;
+}
+
+/** Stores a 64-bit value at p in big-endian order */
+static inline void putBigEndianUInt64(unsigned char *p, epicsUInt64 value)
+{
+    int i;
+    for (i=7; i>=0; i--) {
+        p[i] = (unsigned char)(value & 0xff);
+        value >>= 8;
+    }
+}
+
+/** Returns the event type for the marker of a record that is not data */
+static inline int markerEvent(epicsUInt64 marker)
+{
+    switch (marker) {
+        case TETRAMM_MARKER_TRIG_START: return TetrAMMEventTrigStart;
+        case TETRAMM_MARKER_TRIG_END:   return TetrAMMEventTrigEnd;
+        case TETRAMM_MARKER_ACQ_DONE:   return TetrAMMEventAcqDone;
+        default:                        return TetrAMMEventLostSync;
+    }
+}
+
+static size_t decodeScalar(const unsigned char *in, size_t nBytes, int numChannels,
+                           double *samples, size_t maxSamples, size_t *numSamples,
+                           TetrAMMEvent_t *events, size_t maxEvents, size_t *numEvents)
+{
+    size_t recordSize = (numChannels + 1) * TETRAMM_BYTES_PER_VALUE;
+    size_t pos=0, nOut=0, nEvents=0;
+    const unsigned char *p;
+    double *pOut;
+    epicsUInt64 marker, value;
+    int i, type;
+
+    while (pos + recordSize <= nBytes) {
+        p = in + pos;
+        marker = bigEndianUInt64(p + numChannels*TETRAMM_BYTES_PER_VALUE);
+        if (marker == TETRAMM_MARKER_DATA) {
+            if (nOut == maxSamples) break;
+            pOut = samples + nOut*TETRAMM_MAX_CHANNELS;
+            for (i=0; i<numChannels; i++) {
+                value = bigEndianUInt64(p + i*TETRAMM_BYTES_PER_VALUE);
+                memcpy(&pOut[i], &value, sizeof(double));
+            }
+            for (; i<TETRAMM_MAX_CHANNELS; i++) pOut[i] = 0.;
+            nOut++;
+            pos += recordSize;
+            continue;
+        }
+        if (nEvents == maxEvents) break;
+        type = markerEvent(marker);
+        events[nEvents].type = type;
+        events[nEvents].sample = nOut;
+        nEvents++;
+        if (type == TetrAMMEventLostSync) break;
+        pos += recordSize;
+    }
+    *numSamples = nOut;
+    *numEvents = nEvents;
+    return pos;
+}
+
+#ifdef TETRAMM_DECODE_X86
+
+// x86 is little-endian, so the markers are compared with the byte-swapped constants without swapping the data
+
+__attribute__((target("ssse3")))
+static size_t decodeSSSE3(const unsigned char *in, size_t nBytes, int numChannels,
+                          double *samples, size_t maxSamples, size_t *numSamples,
+                          TetrAMMEvent_t *events, size_t maxEvents, size_t *numEvents)
+{
+    size_t recordSize = (numChannels + 1) * TETRAMM_BYTES_PER_VALUE;
+    size_t pos=0, nOut=0, nEvents=0;
+    const unsigned char *p;
+    double *pOut;
+    epicsUInt64 marker, value;
+    const epicsUInt64 dataMarker = __builtin_bswap64(TETRAMM_MARKER_DATA);
+    // Reverses the bytes in each 8-byte half
+    const __m128i swap = _mm_set_epi8(8, 9, 10, 11, 12, 13, 14, 15, 0, 1, 2, 3, 4, 5, 6, 7);
+    int i, type;
+
+    while (pos + recordSize <= nBytes) {
+        p = in + pos;
+        memcpy(&marker, p + numChannels*TETRAMM_BYTES_PER_VALUE, sizeof(marker));
+        if (marker == dataMarker) {
+            if (nOut == maxSamples) break;
+            pOut = samples + nOut*TETRAMM_MAX_CHANNELS;
+            for (i=0; i+1<numChannels; i+=2) {
+                _mm_storeu_si128((__m128i *)(pOut + i),
+                    _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + i*TETRAMM_BYTES_PER_VALUE)), swap));
+            }
+            if (i < numChannels) {
+                memcpy(&value, p + i*TETRAMM_BYTES_PER_VALUE, sizeof(value));
+                value = __builtin_bswap64(value);
+                memcpy(&pOut[i], &value, sizeof(double));
+                i++;
+            }
+            for (; i<TETRAMM_MAX_CHANNELS; i++) pOut[i] = 0.;
+            nOut++;
+            pos += recordSize;
+            continue;
+        }
+        if (nEvents == maxEvents) break;
+        type = markerEvent(__builtin_bswap64(marker));
+        events[nEvents].type = type;
+        events[nEvents].sample = nOut;
+        nEvents++;
+        if (type == TetrAMMEventLostSync) break;
+        pos += recordSize;
+    }
+    *numSamples = nOut;
+    *numEvents = nEvents;
+    return pos;
+}
+
+__attribute__((target("avx2")))
+static size_t decodeAVX2(const unsigned char *in, size_t nBytes, int numChannels,
+                         double *samples, size_t maxSamples, size_t *numSamples,
+                         TetrAMMEvent_t *events, size_t maxEvents, size_t *numEvents)
+{
+    size_t recordSize = (numChannels + 1) * TETRAMM_BYTES_PER_VALUE;
+    size_t pos=0, nOut=0, nEvents=0;
+    const unsigned char *p;
+    double *pOut;
+    epicsUInt64 marker, value;
+    const epicsUInt64 dataMarker = __builtin_bswap64(TETRAMM_MARKER_DATA);
+    // Reverses the bytes in each 8-byte quarter.  The shuffle is done within each 128-bit lane.
+    const __m256i swap256 = _mm256_set_epi8(8, 9, 10, 11, 12, 13, 14, 15, 0, 1, 2, 3, 4, 5, 6, 7,
+                                            8, 9, 10, 11, 12, 13, 14, 15, 0, 1, 2, 3, 4, 5, 6, 7);
+    const __m128i swap128 = _mm_set_epi8(8, 9, 10, 11, 12, 13, 14, 15, 0, 1, 2, 3, 4, 5, 6, 7);
+    int i, type;
+
+    while (pos + recordSize <= nBytes) {
+        p = in + pos;
+        memcpy(&marker, p + numChannels*TETRAMM_BYTES_PER_VALUE, sizeof(marker));
+        if (marker == dataMarker) {
+            if (nOut == maxSamples) break;
+            pOut = samples + nOut*TETRAMM_MAX_CHANNELS;
+            if (numChannels == TETRAMM_MAX_CHANNELS) {
+                // All 4 channels with a single shuffle
+                _mm256_storeu_si256((__m256i *)pOut,
+                    _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i *)p), swap256));
+            } else {
+                for (i=0; i+1<numChannels; i+=2) {
+                    _mm_storeu_si128((__m128i *)(pOut + i),
+                        _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p + i*TETRAMM_BYTES_PER_VALUE)), swap128));
+                }
+                if (i < numChannels) {
+                    memcpy(&value, p + i*TETRAMM_BYTES_PER_VALUE, sizeof(value));
+                    value = __builtin_bswap64(value);
+                    memcpy(&pOut[i], &value, sizeof(double));
+                    i++;
+                }
+                for (; i<TETRAMM_MAX_CHANNELS; i++) pOut[i] = 0.;
+            }
+            nOut++;
+            pos += recordSize;
+            continue;
+        }
+        if (nEvents == maxEvents) break;
+        type = markerEvent(__builtin_bswap64(marker));
+        events[nEvents].type = type;
+        events[nEvents].sample = nOut;
+        nEvents++;
+        if (type == TetrAMMEventLostSync) break;
+        pos += recordSize;
+    }
+    *numSamples = nOut;
+    *numEvents = nEvents;
+    return pos;
+}
+
+#endif /* TETRAMM_DECODE_X86 */
+
+// Supported decoders, slowest first
+static TetrAMMDecoder_t decoders[3];
+static int numDecoders;
+static epicsThreadOnceId decoderOnceId = EPICS_THREAD_ONCE_INIT;
+
+static void decoderInit(void *)
+{
+    decoders[numDecoders].name = "scalar";
+    decoders[numDecoders++].func = decodeScalar;
+#ifdef TETRAMM_DECODE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("ssse3")) {
+        decoders[numDecoders].name = "SSSE3";
+        decoders[numDecoders++].func = decodeSSSE3;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        decoders[numDecoders].name = "AVX2";
+        decoders[numDecoders++].func = decodeAVX2;
+    }
+#endif
+}
+
+const TetrAMMDecoder_t *tetrAMMDecoderGet(void)
+{
+    epicsThreadOnce(&decoderOnceId, decoderInit, NULL);
+    return &decoders[numDecoders-1];
+}
+
+int tetrAMMDecoderList(const TetrAMMDecoder_t **pDecoders)
+{
+    epicsThreadOnce(&decoderOnceId, decoderInit, NULL);
+    *pDecoders = decoders;
+    return numDecoders;
+}
+
+tetrAMMFramer::tetrAMMFramer(size_t bufferSize)
+  : decoder_(tetrAMMDecoderGet()), bufferSize_(bufferSize)
+{
+    buffer_ = (unsigned char *)malloc(bufferSize_);
+    reset(TETRAMM_MAX_CHANNELS);
+    resetStatistics();
+}
+
+tetrAMMFramer::~tetrAMMFramer()
+{
+    free(buffer_);
+}
+
+/** Discards the data in the buffer and starts framing a new stream with numChannels channels */
+void tetrAMMFramer::reset(int numChannels)
+{
+    numChannels_ = numChannels;
+    recordSize_ = (numChannels_ + 1) * TETRAMM_BYTES_PER_VALUE;
+    numBytes_ = 0;
+    position_ = 0;
+    state_ = FramerSynced;
+    searchBytes_ = 0;
+}
+
+void tetrAMMFramer::resetStatistics()
+{
+    numResync_ = 0;
+    droppedBytes_ = 0;
+    droppedSamples_ = 0;
+}
+
+/** Moves the bytes that have not been decoded to the start of the buffer */
+void tetrAMMFramer::compact()
+{
+    numBytes_ -= position_;
+    if (numBytes_ > 0) memmove(buffer_, buffer_ + position_, numBytes_);
+    position_ = 0;
+}
+
+/** Decodes the next complete records in the buffer.
+  * Returns true if any samples or events were decoded, in which case the caller should process them and call
+  * decode() again.  Returns false when more data must be read.
+  */
+bool tetrAMMFramer::decode(double *samples, size_t maxSamples, size_t *numSamples,
+                           TetrAMMEvent_t *events, size_t maxEvents, size_t *numEvents)
+{
+    const unsigned char *pc, *pEnd;
+    size_t skipped;
+
+    *numSamples = 0;
+    *numEvents = 0;
+    while (1) {
+        switch (state_) {
+            case FramerSearching:
+                // Search for the NaN at the end of normal data.  The next record starts after it.
+                pEnd = buffer_ + numBytes_;
+                for (pc = buffer_ + position_; pc + TETRAMM_BYTES_PER_VALUE <= pEnd; pc++) {
+                    if (pc[0]==0xff && pc[1]==0xf4 && pc[2]==0x00 && pc[3]==0x02 &&
+                        pc[4]==0xff && pc[5]==0xff && pc[6]==0xff && pc[7]==0xff) break;
+                }
+                if (pc + TETRAMM_BYTES_PER_VALUE > pEnd) {
+                    // Not found, keep the last bytes in case they are the start of the NaN
+                    if (numBytes_ - position_ >= TETRAMM_BYTES_PER_VALUE) {
+                        skipped = numBytes_ - (TETRAMM_BYTES_PER_VALUE - 1) - position_;
+                        droppedBytes_ += skipped;
+                        searchBytes_ += skipped;
+                        position_ += skipped;
+                    }
+                    compact();
+                    return false;
+                }
+                skipped = (pc - buffer_) + TETRAMM_BYTES_PER_VALUE - position_;
+                droppedBytes_ += skipped;
+                searchBytes_ += skipped;
+                droppedSamples_ += (searchBytes_ + recordSize_ - 1) / recordSize_;
+                numResync_++;
+                position_ += skipped;
+                searchBytes_ = 0;
+                state_ = FramerSynced;
+                break;
+
+            case FramerSynced:
+                position_ += decoder_->func(buffer_ + position_, numBytes_ - position_, numChannels_,
+                                            samples, maxSamples, numSamples, events, maxEvents, numEvents);
+                if ((*numEvents > 0) && (events[*numEvents-1].type == TetrAMMEventLostSync)) {
+                    // The decoder stopped at the invalid record.  Search from its start for the next data marker.
+                    state_ = FramerSearching;
+                    searchBytes_ = 0;
+                }
+                if ((*numSamples > 0) || (*numEvents > 0)) return true;
+                // There is no complete record left
+                compact();
+                return false;
+        }
+    }
+}
+
+/** Reference for the benchmark: the way the driver decoded each record before the decoders were added,
+  * swapping the bytes of each value in place one at a time and then comparing the marker with each sNaN. */
+static size_t decodeSwapInPlace(unsigned char *in, size_t nBytes, int numChannels,
+                                double *samples, size_t *numSamples)
+{
+    size_t recordSize = (numChannels + 1) * TETRAMM_BYTES_PER_VALUE;
+    size_t pos=0, nOut=0;
+    unsigned char *p, temp;
+    epicsUInt64 marker;
+    int i, k;
+
+    for (pos=0; pos + recordSize <= nBytes; pos += recordSize) {
+        p = in + pos;
+        for (i=0; i<=numChannels; i++) {
+            for (k=0; k<4; k++) {
+                temp = p[i*8 + k]; p[i*8 + k] = p[i*8 + 7 - k]; p[i*8 + 7 - k] = temp;
+            }
+        }
+        memcpy(&marker, p + numChannels*TETRAMM_BYTES_PER_VALUE, sizeof(marker));
+        switch (marker) {
+            case TETRAMM_MARKER_DATA:
+                memcpy(samples + nOut*TETRAMM_MAX_CHANNELS, p, numChannels*sizeof(double));
+                for (i=numChannels; i<TETRAMM_MAX_CHANNELS; i++) samples[nOut*TETRAMM_MAX_CHANNELS + i] = 0.;
+                nOut++;
+                break;
+            case TETRAMM_MARKER_TRIG_START:
+            case TETRAMM_MARKER_TRIG_END:
+            case TETRAMM_MARKER_ACQ_DONE:
+                break;
+            default:
+                *numSamples = nOut;
+                return pos;
+        }
+    }
+    *numSamples = nOut;
+    return pos;
+}
+
+/** iocsh command to measure the speed of each decoder.
+  * \param[in] numSamples Number of data samples in the buffer.  A trigger start and end are added every 1000 samples.
+  * \param[in] numLoops Number of times to decode the buffer.
+  * \param[in] numChannels Number of channels in each record, 1 to 4.
+  */
+static void tetrAMMDecodeBenchmark(int numSamples, int numLoops, int numChannels)
+{
+    const TetrAMMDecoder_t *pDecoders;
+    unsigned char *inBuff, *copyBuff, *p;
+    double *outBuff, *refBuff;
+    TetrAMMEvent_t *events, *refEvents;
+    size_t recordSize, nBytes, maxEvents, nSamples, nEvents, numRefSamples, numRefEvents;
+    epicsTimeStamp start, end;
+    double elapsed;
+    epicsFloat64 value;
+    epicsUInt64 ivalue;
+    int nDecoders;
+    int i, j, k, loop;
+    bool same;
+
+    if (numSamples <= 0) numSamples = 10000;
+    if (numLoops <= 0) numLoops = 1000;
+    if ((numChannels < 1) || (numChannels > TETRAMM_MAX_CHANNELS)) numChannels = TETRAMM_MAX_CHANNELS;
+    recordSize = (numChannels + 1) * TETRAMM_BYTES_PER_VALUE;
+    maxEvents = 2*(numSamples/1000 + 1);
+    nBytes = (numSamples + maxEvents) * recordSize;
+    inBuff    = (unsigned char *)malloc(nBytes);
+    copyBuff  = (unsigned char *)malloc(nBytes);
+    outBuff   = (double *)malloc(numSamples * TETRAMM_MAX_CHANNELS * sizeof(double));
+    refBuff   = (double *)malloc(numSamples * TETRAMM_MAX_CHANNELS * sizeof(double));
+    events    = (TetrAMMEvent_t *)malloc(maxEvents * sizeof(TetrAMMEvent_t));
+    refEvents = (TetrAMMEvent_t *)malloc(maxEvents * sizeof(TetrAMMEvent_t));
+
+    // Build the stream with a trigger start before and a trigger end after each 1000 samples
+    p = inBuff;
+    for (i=0; i<numSamples; i++) {
+        if ((i % 1000) == 0) {
+            memset(p, 0, recordSize - TETRAMM_BYTES_PER_VALUE);
+            putBigEndianUInt64(p + numChannels*TETRAMM_BYTES_PER_VALUE, TETRAMM_MARKER_TRIG_START);
+            p += recordSize;
+        }
+        for (k=0; k<numChannels; k++) {
+            value = 1e-6 * rand() / (double)RAND_MAX;
+            memcpy(&ivalue, &value, sizeof(ivalue));
+            putBigEndianUInt64(p + k*TETRAMM_BYTES_PER_VALUE, ivalue);
+        }
+        putBigEndianUInt64(p + numChannels*TETRAMM_BYTES_PER_VALUE, TETRAMM_MARKER_DATA);
+        p += recordSize;
+        if (((i % 1000) == 999) || (i == numSamples-1)) {
+            memset(p, 0, recordSize - TETRAMM_BYTES_PER_VALUE);
+            putBigEndianUInt64(p + numChannels*TETRAMM_BYTES_PER_VALUE, TETRAMM_MARKER_TRIG_END);
+            p += recordSize;
+        }
+    }
+    nBytes = p - inBuff;
+
+    nDecoders = tetrAMMDecoderList(&pDecoders);
+    decodeScalar(inBuff, nBytes, numChannels, refBuff, numSamples, &numRefSamples, refEvents, maxEvents, &numRefEvents);
+    printf("Decoding %d samples with %d channels %d times, %d bytes, best decoder=%s\n",
+           numSamples, numChannels, numLoops, (int)nBytes, tetrAMMDecoderGet()->name);
+    printf("Decoder       Samples/s       MB/s   Same as scalar\n");
+
+    // The old decoder swaps the bytes in place, so it is given a fresh copy of the buffer each time
+    epicsTimeGetCurrent(&start);
+    for (loop=0; loop<numLoops; loop++) {
+        memcpy(copyBuff, inBuff, nBytes);
+        decodeSwapInPlace(copyBuff, nBytes, numChannels, outBuff, &nSamples);
+    }
+    epicsTimeGetCurrent(&end);
+    elapsed = epicsTimeDiffInSeconds(&end, &start);
+    same = (nSamples == numRefSamples) &&
+           (memcmp(outBuff, refBuff, nSamples * TETRAMM_MAX_CHANNELS * sizeof(double)) == 0);
+    printf("%-10s %12.4g %10.4g   %s\n", "in-place",
+           (elapsed > 0.) ? (double)numSamples * numLoops / elapsed : 0.,
+           (elapsed > 0.) ? (double)nBytes * numLoops / elapsed / 1e6 : 0., same ? "Yes" : "No");
+
+    for (j=0; j<nDecoders; j++) {
+        epicsTimeGetCurrent(&start);
+        for (loop=0; loop<numLoops; loop++) {
+            pDecoders[j].func(inBuff, nBytes, numChannels, outBuff, numSamples, &nSamples, events, maxEvents, &nEvents);
+        }
+        epicsTimeGetCurrent(&end);
+        elapsed = epicsTimeDiffInSeconds(&end, &start);
+        same = (nSamples == numRefSamples) && (nEvents == numRefEvents) &&
+               (memcmp(outBuff, refBuff, nSamples * TETRAMM_MAX_CHANNELS * sizeof(double)) == 0);
+        for (i=0; same && (i<(int)nEvents); i++) {
+            same = (events[i].type == refEvents[i].type) && (events[i].sample == refEvents[i].sample);
+        }
+        printf("%-10s %12.4g %10.4g   %s\n", pDecoders[j].name,
+               (elapsed > 0.) ? (double)numSamples * numLoops / elapsed : 0.,
+               (elapsed > 0.) ? (double)nBytes * numLoops / elapsed / 1e6 : 0., same ? "Yes" : "No");
+    }
+    free(inBuff);
+    free(copyBuff);
+    free(outBuff);
+    free(refBuff);
+    free(events);
+    free(refEvents);
+}
+
+extern "C" {
+
+static const iocshArg benchmarkArg0 = { "number of samples", iocshArgInt};
+static const iocshArg benchmarkArg1 = { "number of loops", iocshArgInt};
+static const iocshArg benchmarkArg2 = { "number of channels", iocshArgInt};
+static const iocshArg * const benchmarkArgs[] = {&benchmarkArg0, &benchmarkArg1, &benchmarkArg2};
+static const iocshFuncDef benchmarkFuncDef = {"tetrAMMDecodeBenchmark", 3, benchmarkArgs};
+static void benchmarkCallFunc(const iocshArgBuf *args)
+{
+    tetrAMMDecodeBenchmark(args[0].ival, args[1].ival, args[2].ival);
+}
+
+void tetrAMMDecodeRegister(void)
+{
+    iocshRegister(&benchmarkFuncDef, benchmarkCallFunc);
+}
+
+epicsExportRegistrar(tetrAMMDecodeRegister);
+
+}
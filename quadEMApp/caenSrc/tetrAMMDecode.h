@@ -0,0 +1,111 @@
+/*
+ * tetrAMMDecode.h
+ *
+ * Decoders for the binary data stream from the TetrAMM
+ *
+ * Each record in the stream is numChannels big-endian doubles followed by a big-endian signalling NaN marker.
+ * The marker identifies the record as data, the start or end of a trigger, or the end of the acquisition.
+ * The decoders convert the data records to native doubles in a dense block of samples with QE_MAX_INPUTS values
+ * each, with the unused channels set to 0.  The other records are returned as a list of events, each with the
+ * number of samples that were decoded before it, so the caller can process the samples and events in order.
+ * There is a scalar implementation and SSSE3 and AVX2 implementations on x86 with gcc or clang.
+ * The fastest implementation supported by the CPU is selected at run time.
+ *
+ * The tetrAMMFramer class frames the stream as it is read, and resynchronizes on the next data marker when
+ * bytes have been lost.
+ */
+
+#ifndef TETRAMM_DECODE_H
+#define TETRAMM_DECODE_H
+
+#include <stddef.h>
+#include <epicsTypes.h>
+#include <shareLib.h>
+
+#define TETRAMM_MAX_CHANNELS 4
+#define TETRAMM_BYTES_PER_VALUE 8
+
+/* The markers at the end of each record */
+#define TETRAMM_MARKER_TRIG_START 0xfff40000ffffffffull
+#define TETRAMM_MARKER_TRIG_END   0xfff40001ffffffffull
+#define TETRAMM_MARKER_DATA       0xfff40002ffffffffull
+#define TETRAMM_MARKER_ACQ_DONE   0xfff40003ffffffffull
+
+typedef enum {
+    TetrAMMEventTrigStart,
+    TetrAMMEventTrigEnd,
+    TetrAMMEventAcqDone,
+    TetrAMMEventLostSync
+} TetrAMMEventType_t;
+
+typedef struct {
+    int type;           /* TetrAMMEventType_t */
+    size_t sample;      /* Number of samples decoded before this event */
+} TetrAMMEvent_t;
+
+/** Decodes the complete records in a buffer.
+  * Decoding stops at the end of the last complete record, when maxSamples samples or maxEvents events have
+  * been decoded, or after a TetrAMMEventLostSync event for a record with an invalid marker.
+  * Returns the number of bytes decoded.  After a TetrAMMEventLostSync event this is the start of the invalid record.
+  */
+typedef size_t (*TetrAMMDecodeFunc_t)(const unsigned char *in, size_t nBytes, int numChannels,
+                                      double *samples, size_t maxSamples, size_t *numSamples,
+                                      TetrAMMEvent_t *events, size_t maxEvents, size_t *numEvents);
+
+typedef struct {
+    const char *name;
+    TetrAMMDecodeFunc_t func;
+} TetrAMMDecoder_t;
+
+/** Returns the fastest decoder supported by this CPU */
+epicsShareFunc const TetrAMMDecoder_t *tetrAMMDecoderGet(void);
+/** Returns the number of decoders supported by this CPU, and a pointer to the array of them */
+epicsShareFunc int tetrAMMDecoderList(const TetrAMMDecoder_t **decoders);
+
+/** Incremental framing of the binary stream with a state machine.
+  * The data are read directly into the buffer at writePointer() and added with commit().
+  * Each call to decode() decodes the next complete records with the fastest decoder.
+  * A partial record at the end of the buffer is kept for the next read.
+  * When a record has an invalid marker decode() returns a TetrAMMEventLostSync event and the framer
+  * changes to the searching state.  It then searches the rest of the buffer, and the data from later reads,
+  * for the next data marker, and continues with the record after it, so no extra reads are needed.
+  * The bytes skipped while searching, including the record before the data marker that was found,
+  * are counted as dropped, and the number of records they could have contained as dropped samples.
+  */
+class epicsShareClass tetrAMMFramer {
+public:
+    tetrAMMFramer(size_t bufferSize);
+    ~tetrAMMFramer();
+    void reset(int numChannels);
+    unsigned char *writePointer() { return buffer_ + numBytes_; }
+    size_t writeSpace() const { return bufferSize_ - numBytes_; }
+    void commit(size_t nRead) { numBytes_ += nRead; }
+    bool decode(double *samples, size_t maxSamples, size_t *numSamples,
+                TetrAMMEvent_t *events, size_t maxEvents, size_t *numEvents);
+    void resetStatistics();
+    int numResync() const { return numResync_; }
+    epicsUInt64 droppedBytes() const { return droppedBytes_; }
+    epicsUInt64 droppedSamples() const { return droppedSamples_; }
+    const char *decoderName() const { return decoder_->name; }
+
+private:
+    typedef enum {
+        FramerSynced,
+        FramerSearching
+    } framerState_t;
+    void compact();
+    const TetrAMMDecoder_t *decoder_;
+    unsigned char *buffer_;
+    size_t bufferSize_;
+    size_t numBytes_;       /* Number of bytes in the buffer */
+    size_t position_;       /* Position of the next byte to decode */
+    size_t recordSize_;
+    int numChannels_;
+    framerState_t state_;
+    size_t searchBytes_;    /* Bytes skipped since sync was lost */
+    int numResync_;
+    epicsUInt64 droppedBytes_;
+    epicsUInt64 droppedSamples_;
+};
+
+#endif
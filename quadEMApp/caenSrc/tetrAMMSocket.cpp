@@ -0,0 +1,291 @@
+/*
+ * tetrAMMSocket.cpp
+ *
+ * Socket that receives the binary data stream from the TetrAMM directly, without asynOctet.
+ * See tetrAMMSocket.h for a description.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+
+#include <epicsTypes.h>
+#include <epicsString.h>
+#include <epicsStdio.h>
+#include <osiSock.h>
+
+#ifdef __linux__
+  #include <fcntl.h>
+  #include <unistd.h>
+  #include <sys/epoll.h>
+  #include <netinet/tcp.h>
+#endif
+
+#include "tetrAMMSocket.h"
+
+// Size of the kernel receive buffer, enough for about 1 second of data at 20 kHz with 4 channels
+#define TETRAMM_SOCKET_RCVBUF (1024*1024)
+// Initial size of the space for each UDP datagram, increased if a larger datagram is received
+#define TETRAMM_SOCKET_DATAGRAM_SIZE 2048
+// Maximum size of a UDP datagram
+#define TETRAMM_SOCKET_MAX_DATAGRAM 65536
+// Maximum number of UDP datagrams received with each recvmmsg()
+#define TETRAMM_SOCKET_MAX_MESSAGES 64
+
+static const char *driverName = "tetrAMMSocket";
+
+/** Constructor for the tetrAMMSocket class.  The socket is not connected until connect() is called.
+  * \param[in] address The address of the meter in the same form as drvAsynIPPortConfigure, "host:port" for TCP
+  *            or "host:port UDP" for UDP.
+  * \param[in] pasynUser The asynUser of the driver, whose trace mask controls the error messages.
+  */
+tetrAMMSocket::tetrAMMSocket(const char *address, asynUser *pasynUser)
+  : pasynUser_(pasynUser), udp_(false), fd_(-1), epollFd_(-1), datagramSize_(TETRAMM_SOCKET_DATAGRAM_SIZE),
+    pending_(0), pendingBytes_(0), pendingPos_(0),
+    numReads_(0), numBytes_(0), numDatagrams_(0), numTruncated_(0)
+{
+    char *p;
+
+    address_ = epicsStrDup(address);
+    hostInfo_ = epicsStrDup(address);
+    p = strchr(hostInfo_, ' ');
+    if (p) {
+        *p++ = 0;
+        while (*p == ' ') p++;
+        udp_ = (epicsStrCaseCmp(p, "UDP") == 0);
+    }
+    if (udp_) pending_ = (unsigned char *)malloc(TETRAMM_SOCKET_MAX_DATAGRAM);
+}
+
+tetrAMMSocket::~tetrAMMSocket()
+{
+    disconnect();
+    free(address_);
+    free(hostInfo_);
+    free(pending_);
+}
+
+#ifdef __linux__
+
+/** Connects the socket to the meter. */
+asynStatus tetrAMMSocket::connect()
+{
+    struct sockaddr_in addr;
+    struct epoll_event event;
+    int size = TETRAMM_SOCKET_RCVBUF;
+    int flag = 1;
+    static const char *functionName = "connect";
+
+    if (fd_ >= 0) return asynSuccess;
+    if (aToIPAddr(hostInfo_, 0, &addr) != 0) {
+        asynPrint(pasynUser_, ASYN_TRACE_ERROR,
+            "%s::%s cannot resolve address %s\n", driverName, functionName, hostInfo_);
+        return asynError;
+    }
+    fd_ = socket(AF_INET, udp_ ? SOCK_DGRAM : SOCK_STREAM, 0);
+    if (fd_ < 0) {
+        asynPrint(pasynUser_, ASYN_TRACE_ERROR,
+            "%s::%s socket() failed, error=%s\n", driverName, functionName, strerror(errno));
+        return asynError;
+    }
+    // The receive buffer must be set before connecting for TCP to use a large window
+    if (setsockopt(fd_, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)) < 0) {
+        asynPrint(pasynUser_, ASYN_TRACE_WARNING,
+            "%s::%s warning, cannot set SO_RCVBUF, error=%s\n", driverName, functionName, strerror(errno));
+    }
+    if (!udp_) setsockopt(fd_, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+    if (::connect(fd_, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        asynPrint(pasynUser_, ASYN_TRACE_ERROR,
+            "%s::%s cannot connect to %s, error=%s\n", driverName, functionName, address_, strerror(errno));
+        disconnect();
+        return asynError;
+    }
+    fcntl(fd_, F_SETFL, fcntl(fd_, F_GETFL) | O_NONBLOCK);
+    epollFd_ = epoll_create1(0);
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.fd = fd_;
+    if ((epollFd_ < 0) || (epoll_ctl(epollFd_, EPOLL_CTL_ADD, fd_, &event) < 0)) {
+        asynPrint(pasynUser_, ASYN_TRACE_ERROR,
+            "%s::%s epoll setup failed, error=%s\n", driverName, functionName, strerror(errno));
+        disconnect();
+        return asynError;
+    }
+    return asynSuccess;
+}
+
+void tetrAMMSocket::disconnect()
+{
+    if (epollFd_ >= 0) close(epollFd_);
+    if (fd_ >= 0) close(fd_);
+    epollFd_ = -1;
+    fd_ = -1;
+    pendingBytes_ = 0;
+}
+
+/** Sends a command to the meter.  The command is terminated with a carriage return. */
+asynStatus tetrAMMSocket::write(const char *command)
+{
+    char buffer[256];
+    int len;
+    static const char *functionName = "write";
+
+    if (fd_ < 0) return asynDisconnected;
+    len = epicsSnprintf(buffer, sizeof(buffer), "%s\r", command);
+    if (send(fd_, buffer, len, MSG_NOSIGNAL) != len) {
+        asynPrint(pasynUser_, ASYN_TRACE_ERROR,
+            "%s::%s error sending %s to %s, error=%s\n", driverName, functionName, command, address_, strerror(errno));
+        return asynError;
+    }
+    return asynSuccess;
+}
+
+/** Receives all of the data that is available without waiting.  Returns the number of bytes received. */
+size_t tetrAMMSocket::receive(unsigned char *buffer, size_t maxBytes, bool *closed)
+{
+    size_t nRead = 0;
+    ssize_t n;
+    int i, numMessages;
+    struct mmsghdr messages[TETRAMM_SOCKET_MAX_MESSAGES];
+    struct iovec iovecs[TETRAMM_SOCKET_MAX_MESSAGES];
+    size_t len;
+
+    *closed = false;
+    if (!udp_) {
+        while (nRead < maxBytes) {
+            n = recv(fd_, buffer + nRead, maxBytes - nRead, 0);
+            if (n > 0) {
+                nRead += n;
+                continue;
+            }
+            if ((n == 0) || ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR))) *closed = true;
+            break;
+        }
+        return nRead;
+    }
+
+    // Return the rest of a datagram that did not fit in the previous read first
+    if (pendingBytes_ > 0) {
+        len = (pendingBytes_ < maxBytes) ? pendingBytes_ : maxBytes;
+        memcpy(buffer, pending_ + pendingPos_, len);
+        pendingPos_ += len;
+        pendingBytes_ -= len;
+        return len;
+    }
+    if (maxBytes == 0) return 0;
+
+    // Each datagram is received into its own slot in the buffer, and the slots are then packed together
+    numMessages = (int)(maxBytes / datagramSize_);
+    if (numMessages > TETRAMM_SOCKET_MAX_MESSAGES) numMessages = TETRAMM_SOCKET_MAX_MESSAGES;
+    if (numMessages == 0) {
+        // The buffer cannot hold a whole datagram, so receive one into pending_ and return the part that fits
+        n = recv(fd_, pending_, datagramSize_, MSG_DONTWAIT | MSG_TRUNC);
+        if (n <= 0) {
+            if ((n < 0) && (errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR)) *closed = true;
+            return 0;
+        }
+        len = n;
+        if (len > datagramSize_) {
+            numTruncated_++;
+            len = datagramSize_;
+            datagramSize_ = ((size_t)n > TETRAMM_SOCKET_MAX_DATAGRAM) ? TETRAMM_SOCKET_MAX_DATAGRAM : n;
+        }
+        numDatagrams_++;
+        nRead = (len < maxBytes) ? len : maxBytes;
+        memcpy(buffer, pending_, nRead);
+        pendingPos_ = nRead;
+        pendingBytes_ = len - nRead;
+        return nRead;
+    }
+    memset(messages, 0, numMessages * sizeof(struct mmsghdr));
+    for (i=0; i<numMessages; i++) {
+        iovecs[i].iov_base = buffer + i*datagramSize_;
+        iovecs[i].iov_len = datagramSize_;
+        messages[i].msg_hdr.msg_iov = &iovecs[i];
+        messages[i].msg_hdr.msg_iovlen = 1;
+    }
+    // With MSG_TRUNC msg_len is the real length of the datagram, even if it did not fit
+    numMessages = recvmmsg(fd_, messages, numMessages, MSG_DONTWAIT | MSG_TRUNC, NULL);
+    if (numMessages <= 0) {
+        if ((numMessages < 0) && (errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR)) *closed = true;
+        return 0;
+    }
+    for (i=0; i<numMessages; i++) {
+        len = messages[i].msg_len;
+        if (len > iovecs[i].iov_len) {
+            // The end of the datagram was lost.  The framer will resynchronize.  Use larger slots from now on.
+            numTruncated_++;
+            if (len > datagramSize_) datagramSize_ = len;
+            if (datagramSize_ > TETRAMM_SOCKET_MAX_DATAGRAM) datagramSize_ = TETRAMM_SOCKET_MAX_DATAGRAM;
+            len = iovecs[i].iov_len;
+        }
+        if (buffer + nRead != iovecs[i].iov_base) memmove(buffer + nRead, iovecs[i].iov_base, len);
+        nRead += len;
+    }
+    numDatagrams_ += numMessages;
+    return nRead;
+}
+
+/** Reads all of the data that is available, waiting up to timeout seconds for the first data.
+  * Returns asynTimeout if no data was received. */
+asynStatus tetrAMMSocket::read(unsigned char *buffer, size_t maxBytes, double timeout, size_t *nRead)
+{
+    struct epoll_event event;
+    bool closed;
+    static const char *functionName = "read";
+
+    *nRead = 0;
+    if (fd_ < 0) return asynDisconnected;
+    *nRead = receive(buffer, maxBytes, &closed);
+    if ((*nRead == 0) && !closed) {
+        if (epoll_wait(epollFd_, &event, 1, (int)(timeout * 1000. + 0.5)) <= 0) return asynTimeout;
+        *nRead = receive(buffer, maxBytes, &closed);
+    }
+    if (closed) {
+        asynPrint(pasynUser_, ASYN_TRACE_ERROR,
+            "%s::%s connection to %s closed, error=%s\n", driverName, functionName, address_, strerror(errno));
+        disconnect();
+        return (*nRead > 0) ? asynSuccess : asynDisconnected;
+    }
+    if (*nRead == 0) return asynTimeout;
+    numReads_++;
+    numBytes_ += *nRead;
+    return asynSuccess;
+}
+
+#else
+
+asynStatus tetrAMMSocket::connect()
+{
+    asynPrint(pasynUser_, ASYN_TRACE_ERROR, "%s::connect the data socket is only supported on Linux\n", driverName);
+    return asynError;
+}
+
+void tetrAMMSocket::disconnect()
+{
+}
+
+asynStatus tetrAMMSocket::write(const char *command)
+{
+    return asynDisconnected;
+}
+
+asynStatus tetrAMMSocket::read(unsigned char *buffer, size_t maxBytes, double timeout, size_t *nRead)
+{
+    *nRead = 0;
+    return asynDisconnected;
+}
+
+#endif
+
+void tetrAMMSocket::report(FILE *fp)
+{
+    fprintf(fp, "  Data socket %s, %s, connected=%d, reads=%llu, bytes=%llu\n",
+            address_, udp_ ? "UDP" : "TCP", isConnected(),
+            (unsigned long long)numReads_, (unsigned long long)numBytes_);
+    if (udp_) {
+        fprintf(fp, "  datagrams=%llu, truncated=%llu, datagram size=%d\n",
+                (unsigned long long)numDatagrams_, (unsigned long long)numTruncated_, (int)datagramSize_);
+    }
+}
@@ -0,0 +1,53 @@
+/*
+ * tetrAMMSocket.h
+ *
+ * Socket that receives the binary data stream from the TetrAMM directly, without asynOctet
+ *
+ * This is used for the streaming phase of acquisition: ACQ:ON and ACQ:OFF are sent on this socket so the meter
+ * sends the data to it, while all other commands are sent with the asyn port.
+ * The socket is non-blocking and waits for data with epoll.  The kernel receive buffer is enlarged with SO_RCVBUF.
+ * With TCP each read receives all of the data that is available.  With UDP all of the datagrams that are
+ * available are received with a single recvmmsg() call and packed into the buffer in order.  If the space in the
+ * buffer is smaller than a datagram, one datagram is received into an internal buffer, and the part that does not
+ * fit is returned by the next read.
+ * This is only supported on Linux.
+ */
+
+#ifndef TETRAMM_SOCKET_H
+#define TETRAMM_SOCKET_H
+
+#include <stdio.h>
+#include <epicsTypes.h>
+#include <asynDriver.h>
+#include <shareLib.h>
+
+class epicsShareClass tetrAMMSocket {
+public:
+    tetrAMMSocket(const char *address, asynUser *pasynUser);
+    ~tetrAMMSocket();
+    asynStatus connect();
+    void disconnect();
+    bool isConnected() const { return fd_ >= 0; }
+    asynStatus write(const char *command);
+    asynStatus read(unsigned char *buffer, size_t maxBytes, double timeout, size_t *nRead);
+    void report(FILE *fp);
+
+private:
+    size_t receive(unsigned char *buffer, size_t maxBytes, bool *closed);
+    asynUser *pasynUser_;     /* The asynUser of the driver, used for asynPrint */
+    char *address_;
+    char *hostInfo_;
+    bool udp_;
+    int fd_;
+    int epollFd_;
+    size_t datagramSize_;
+    unsigned char *pending_;  /* A datagram that did not fit in the read buffer */
+    size_t pendingBytes_;     /* Number of bytes of it that have not been returned */
+    size_t pendingPos_;       /* Position of the next byte to return */
+    epicsUInt64 numReads_;
+    epicsUInt64 numBytes_;
+    epicsUInt64 numDatagrams_;
+    epicsUInt64 numTruncated_;
+};
+
+#endif
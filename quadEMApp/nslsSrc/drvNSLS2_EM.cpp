@@ -7,13 +7,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <sys/types.h>
 #ifndef _WIN32
   #include <unistd.h>
+  #include <poll.h>
   #include <sys/mman.h>
 #endif
 #include <fcntl.h>
-#include <signal.h>
 #include <sys/stat.h>
 #include <math.h>
 
@@ -29,6 +30,9 @@
 
 #include <epicsExport.h>
 #include "drvNSLS2_EM.h"
+#ifndef SIMULATION_MODE
+  #include "pl_lib.h"
+#endif
 
 
 #define LEDS 5
@@ -55,6 +59,12 @@
 
 #define DEVNAME "/dev/vipic"
 
+// In DMA mode the FPGA writes every frame to a buffer with 2 halves of DMA_BLOCK_SAMPLES frames each,
+// with QE_MAX_INPUTS 32-bit values per frame in the same units as the AVG registers.
+// It writes the halves alternately, and interrupts after each half is complete.
+#define DMA_BLOCK_SAMPLES 4096
+#define DMA_BLOCK_BYTES (DMA_BLOCK_SAMPLES * QE_MAX_INPUTS * sizeof(epicsInt32))
+
 #define POLL_TIME 0.001 
 #define NOISE 1000.
 
@@ -149,11 +159,22 @@ bool drvNSLS2_EM::isAcquiring()
   return acquiring_;
 }
 
+bool drvNSLS2_EM::isDMAMode()
+{
+  return dmaMode_;
+}
+
 #ifdef POLLING_MODE
 static void pollerThread(void *pPvt)
 {
+    epicsUInt32 count = 0;
+
     while(1) { /* Do forever */
-        if (pdrvNSLS2_EM->isAcquiring()) pdrvNSLS2_EM->callbackFunc();
+        if (pdrvNSLS2_EM->isAcquiring()) {
+            // Each poll is a DMA block in DMA mode, with a count like the interrupt count
+            if (pdrvNSLS2_EM->isDMAMode()) pdrvNSLS2_EM->dmaCallbackFunc(++count);
+            else pdrvNSLS2_EM->callbackFunc();
+        }
         epicsThreadSleep(POLL_TIME);
     }
 }
@@ -171,11 +192,44 @@ asynStatus drvNSLS2_EM::pl_open(int *fd) {
     return(asynSuccess);
 }
 
-// C callback function called by Linux when an interrupt occurs.  
-// It calls the callbackFunc in your C++ driver.
-static void frame_done(int signum)
+static void interruptThreadC(void *pPvt)
 {
-    pdrvNSLS2_EM->callbackFunc();
+    drvNSLS2_EM *pdrv = (drvNSLS2_EM *)pPvt;
+    pdrv->interruptThread();
+}
+
+/** Thread that waits for the frame interrupts and processes each frame.
+  * This runs at the highest EPICS priority, which is a real-time priority on Linux when the IOC is allowed
+  * to use SCHED_FIFO, so the latency from the interrupt to the callbacks is deterministic.
+  * Each read() of /dev/vipic blocks until the next interrupt and returns the interrupt count.
+  */
+void drvNSLS2_EM::interruptThread()
+{
+    struct pollfd pfd;
+    epicsUInt32 count;
+    ssize_t nRead;
+    static const char *functionName = "interruptThread";
+
+    pfd.fd = intfd_;
+    pfd.events = POLLIN;
+    while (1) {
+        // Wait with a timeout so errors are reported even when the interrupts are disabled
+        if (poll(&pfd, 1, 1000) <= 0) continue;
+        nRead = read(intfd_, &count, sizeof(count));
+        if (nRead != sizeof(count)) {
+            if ((nRead < 0) && (errno == EINTR)) continue;
+            asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
+                "%s::%s error reading %s, nRead=%d, error=%s\n",
+                driverName, functionName, DEVNAME, (int)nRead, strerror(errno));
+            epicsThreadSleep(1.0);
+            continue;
+        }
+        interruptCount_ = count;
+        if (isAcquiring()) {
+            if (dmaMode_) dmaCallbackFunc(count);
+            else callbackFunc();
+        }
+    }
 }
 #endif
 
@@ -200,8 +254,34 @@ drvNSLS2_EM::drvNSLS2_EM(const char *portName, int moduleID, int ringBufferSize)
     
     calibrationMode_ = false;
     for (i=0; i<QE_MAX_INPUTS; i++) ADCOffset_[i] = 0;
+    firstFrame_ = true;
+    lastFrame_ = 0;
+    interruptCount_ = 0;
+    missedFrames_ = 0;
+    dmaMode_ = false;
+    dmaBuffer_ = 0;
+    dmaBlockSamples_ = DMA_BLOCK_SAMPLES;
+    dmaStartCount_ = 0;
+    dmaBlocks_ = 0;
+    dmaRunning_ = false;
+    blockData_ = (epicsFloat64 *)malloc(DMA_BLOCK_SAMPLES * QE_MAX_INPUTS * sizeof(epicsFloat64));
+  
+    // set up register memory map
+    mmap_fpga();
   
-    // Initialize Linux driver, set callback function
+    // Create new parameter for DACs
+    createParam(P_DACString,             asynParamInt32, &P_DAC);
+    createParam(P_CalibrationModeString, asynParamInt32, &P_CalibrationMode);
+    createParam(P_ADCOffsetString,       asynParamInt32, &P_ADCOffset);
+    createParam(P_MissedFramesString,    asynParamInt32, &P_MissedFrames);
+    setIntegerParam(P_MissedFrames, 0);
+    createParam(P_DMAModeString,         asynParamInt32, &P_DMAMode);
+    setIntegerParam(P_DMAMode, 0);
+
+    // Initialize Linux driver, start the thread that processes the frames
+#ifdef SIMULATION_MODE
+    dmaBuffer_ = (epicsInt32 *)calloc(2, DMA_BLOCK_BYTES);
+#endif
 #ifdef POLLING_MODE
     epicsThreadCreate("NSLS2_EMPoller",
                       epicsThreadPriorityMedium,
@@ -209,19 +289,19 @@ drvNSLS2_EM::drvNSLS2_EM(const char *portName, int moduleID, int ringBufferSize)
                       (EPICSTHREADFUNC)pollerThread,
                       this);
 #else
-    pl_open(&intfd_);
-    signal(SIGIO, &frame_done);
-    fcntl(intfd_, F_SETOWN, getpid());
-    int oflags = fcntl(intfd_, F_GETFL);
-    fcntl(intfd_, F_SETFL, oflags | FASYNC);
+    if (pl_open(&intfd_) == asynSuccess) {
+  #ifndef SIMULATION_MODE
+        // Map the DMA buffer.  DMA mode cannot be used if this fails.
+        epicsUInt32 *buffer;
+        if (pl_get_data(intfd_, &buffer, 2*DMA_BLOCK_BYTES) == 0) dmaBuffer_ = (const epicsInt32 *)buffer;
+  #endif
+        epicsThreadCreate("NSLS2_EMInterrupt",
+                          epicsThreadPriorityMax,
+                          epicsThreadGetStackSize(epicsThreadStackMedium),
+                          (EPICSTHREADFUNC)interruptThreadC,
+                          this);
+    }
 #endif   
-    // set up register memory map
-    mmap_fpga();
-  
-    // Create new parameter for DACs
-    createParam(P_DACString,             asynParamInt32, &P_DAC);
-    createParam(P_CalibrationModeString, asynParamInt32, &P_CalibrationMode);
-    createParam(P_ADCOffsetString,       asynParamInt32, &P_ADCOffset);
 
     fpgabase_[SA_RATE_DIV] = (int)(50e6/FREQ + 0.5); /* set for a FREQ interrupr rate */
     fsd=(pow(2.0,17)-1.0);
@@ -279,6 +359,24 @@ asynStatus drvNSLS2_EM::writeInt32(asynUser *pasynUser, epicsInt32 value)
     else if (function == P_ADCOffset) {
         ADCOffset_[channel] = value;
     }
+    else if (function == P_DMAMode) {
+        if (value && !dmaBuffer_) {
+            asynPrint(pasynUser, ASYN_TRACE_ERROR,
+                "%s::%s DMA buffer is not available\n", driverName, functionName);
+            setIntegerParam(P_DMAMode, 0);
+            status = asynError;
+        }
+        else {
+            // The FPGA must be stopped while the mode is changed.  The mode changes SampleTime and NumAverage,
+            // so the samples with the old mode are flushed.
+            int acquiring = acquiring_;
+            if (acquiring) setAcquire(0);
+            dmaMode_ = (value != 0);
+            setAcquireParams();
+            resetAcquisition();
+            if (acquiring) status = setAcquire(1);
+        }
+    }
     
     /* Do callbacks so higher layers see any changes */
     callParamCallbacks();
@@ -314,12 +412,23 @@ void drvNSLS2_EM::callbackFunc()
 {
     int input[QE_MAX_INPUTS];
     int i, range, nvalues;
+    epicsUInt32 frame;
     //static const char *functionName="callbackFunc";
 
     lock();
     /* Read the new data as integers */
     readMeter(input);
 
+    /* Count the frames that were missed since the previous frame with the FPGA frame counter */
+    frame = fpgabase_[FRAME_NO];
+    if (!firstFrame_ && (frame - lastFrame_ > 1)) {
+        missedFrames_ += frame - lastFrame_ - 1;
+        setIntegerParam(P_MissedFrames, missedFrames_);
+        callParamCallbacks();
+    }
+    firstFrame_ = false;
+    lastFrame_ = frame;
+
     getIntegerParam(P_Range, &range);  
     getIntegerParam(P_ValuesPerRead, &nvalues); 
 
@@ -335,15 +444,129 @@ void drvNSLS2_EM::callbackFunc()
     unlock();
 }
 
+/** Called for each DMA block in DMA mode.
+  * \param[in] count The interrupt count, which selects the half of the DMA buffer that is complete.
+  * The frames are converted directly from the DMA buffer into a block for computePositionsBlock(), so every frame
+  * is passed to the base class while the FPGA writes the other half.
+  */
+void drvNSLS2_EM::dmaCallbackFunc(epicsUInt32 count)
+{
+    const epicsInt32 *input;
+    epicsFloat64 *out = blockData_;
+    epicsFloat64 gain[QE_MAX_INPUTS];
+    epicsFloat64 offset[QE_MAX_INPUTS];
+    size_t j, numSamples;
+    int i, range, nvalues;
+    //static const char *functionName="dmaCallbackFunc";
+
+    lock();
+    /* Acquisition may have stopped, and the buffer been unmapped, since the interrupt */
+    if (!acquiring_ || !dmaBuffer_) {
+        unlock();
+        return;
+    }
+    /* The first interrupt after acquisition starts is for the first half of the buffer */
+    if (firstFrame_) {
+        dmaStartCount_ = count - 1;
+        lastFrame_ = dmaStartCount_;
+        firstFrame_ = false;
+    }
+    /* Count the frames in the blocks that were missed since the previous block */
+    if (count - lastFrame_ > 1) {
+        missedFrames_ += (count - lastFrame_ - 1) * (int)dmaBlockSamples_;
+        setIntegerParam(P_MissedFrames, missedFrames_);
+        callParamCallbacks();
+    }
+    lastFrame_ = count;
+    numSamples = dmaBlockSamples_;
+    input = dmaBuffer_ + ((count - dmaStartCount_ - 1) & 1) * DMA_BLOCK_SAMPLES * QE_MAX_INPUTS;
+#ifdef SIMULATION_MODE
+    for (j=0; j<numSamples; j++) readMeter((int *)input + j*QE_MAX_INPUTS);
+#endif
+
+    getIntegerParam(P_Range, &range);  
+    getIntegerParam(P_ValuesPerRead, &nvalues); 
+
+    /* The same conversion as callbackFunc(), with the offset and scale factor combined for each channel */
+    for (i=0; i<QE_MAX_INPUTS; i++) {
+        gain[i] = 16.0 / (double)nvalues;
+        offset[i] = 0;
+        if (!calibrationMode_) {
+            gain[i] *= scaleFactor_[i][range];
+            offset[i] = ADCOffset_[i] * scaleFactor_[i][range];
+        }
+    }
+    for (j=0; j<numSamples; j++) {
+        out[0] = input[0] * gain[0] - offset[0];
+        out[1] = input[1] * gain[1] - offset[1];
+        out[2] = input[2] * gain[2] - offset[2];
+        out[3] = input[3] * gain[3] - offset[3];
+        input += QE_MAX_INPUTS;
+        out += QE_MAX_INPUTS;
+    }
+    dmaBlocks_++;
+
+    readComplete();
+    computePositionsBlock(blockData_, numSamples);
+    unlock();
+}
+
 
 // Other functions
 
+/** Programs the DMA buffer and starts the DMA before acquisition starts in DMA mode.
+  * The FPGA writes the frames to the halves of the buffer alternately, with an interrupt after each half.
+  */
+asynStatus drvNSLS2_EM::startDMA()
+{
+#ifndef SIMULATION_MODE
+    static const char *functionName = "startDMA";
+
+    if ((pl_set_buff_len(intfd_, 2*DMA_BLOCK_BYTES) != 0) ||
+        (pl_set_brust_len(intfd_, DMA_BLOCK_BYTES) != 0) ||
+        (pl_set_dma_control(intfd_, 1) != 0) ||
+        (pl_trigger_dma(intfd_) != 0)) {
+        asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
+            "%s::%s error starting DMA, error=%s\n",
+            driverName, functionName, strerror(errno));
+        stopDMA();
+        return asynError;
+    }
+#endif
+    dmaRunning_ = true;
+    return asynSuccess;
+}
+
+/** Stops the DMA when acquisition stops, so the FPGA does not write to the buffer after the interrupts
+  * are disabled, e.g. when the mode is changed back to Registers.
+  */
+void drvNSLS2_EM::stopDMA()
+{
+#ifndef SIMULATION_MODE
+    pl_set_dma_control(intfd_, 0);
+#endif
+    dmaRunning_ = false;
+}
+
 asynStatus drvNSLS2_EM::setAcquire(epicsInt32 value)
 {
+    asynStatus status = asynSuccess;
+
     // 1=start acquire, 0=stop.
+    if (value) {
+        // The frame counter is not compared for the first frame
+        firstFrame_ = true;
+        missedFrames_ = 0;
+        setIntegerParam(P_MissedFrames, 0);
+        if (dmaMode_) {
+            status = startDMA();
+            if (status) value = 0;
+        }
+    }
     acquiring_ = value;
     fpgabase_[IRQ_ENABLE]=value;
-    return asynSuccess;
+    if (!value && dmaRunning_) stopDMA();
+    return status;
 }
 
 asynStatus drvNSLS2_EM::setAcquireParams()
@@ -362,8 +585,16 @@ asynStatus drvNSLS2_EM::setAcquireParams()
 
 #ifdef POLLING_MODE
     sampleTime = POLL_TIME;
+    if (dmaMode_) {
+        // Each poll simulates a DMA block with the frames in POLL_TIME
+        sampleTime = valuesPerRead / FREQ;
+        dmaBlockSamples_ = (size_t)(POLL_TIME / sampleTime + 0.5);
+        if (dmaBlockSamples_ < 1) dmaBlockSamples_ = 1;
+        if (dmaBlockSamples_ > DMA_BLOCK_SAMPLES) dmaBlockSamples_ = DMA_BLOCK_SAMPLES;
+    }
 #else
     // Compute the sample time.  This is valuesPerRead / FREQ. 
+    // In DMA mode every frame is a sample, so with valuesPerRead=1 this is the ADC rate.
     sampleTime = valuesPerRead / FREQ;
 #endif
     setDoubleParam(P_SampleTime, sampleTime);
@@ -450,6 +681,10 @@ asynStatus drvNSLS2_EM::reset()
 void drvNSLS2_EM::report(FILE *fp, int details)
 {
     // Print any information you want about your driver
+    fprintf(fp, "%s: port=%s, interrupts=%u, missed frames=%d\n",
+            driverName, portName, (unsigned)interruptCount_, missedFrames_);
+    fprintf(fp, "  DMA mode=%d, DMA buffer=%s, samples per block=%d, blocks=%u\n",
+            dmaMode_, dmaBuffer_ ? "mapped" : "not mapped", (int)dmaBlockSamples_, (unsigned)dmaBlocks_);
     
     // Call the base class report method
     drvQuadEM::report(fp, details);
@@ -458,6 +693,15 @@ void drvNSLS2_EM::report(FILE *fp, int details)
 void drvNSLS2_EM::exitHandler()
 {
     // Do anything that needs to be done when the EPICS is shutting down
+    lock();
+    acquiring_ = 0;
+    fpgabase_[IRQ_ENABLE] = 0;
+    if (dmaRunning_) stopDMA();
+#ifndef SIMULATION_MODE
+    if (dmaBuffer_) munmap((void *)dmaBuffer_, 2*DMA_BLOCK_BYTES);
+    dmaBuffer_ = 0;
+#endif
+    unlock();
 }
 
 /* That's all you need to send the data to the quadEM base class.  
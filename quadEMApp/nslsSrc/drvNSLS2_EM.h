@@ -15,6 +15,8 @@
 #define P_DACString               "QE_DAC"                 /* asynInt32,    r/w */
 #define P_CalibrationModeString   "QE_CALIBRATION_MODE"    /* asynInt32,    r/w */
 #define P_ADCOffsetString         "QE_ADC_OFFSET"          /* asynInt32,    r/w */
+#define P_MissedFramesString      "QE_MISSED_FRAMES"       /* asynInt32,    r/o */
+#define P_DMAModeString           "QE_DMA_MODE"            /* asynInt32,    r/w */
 
 /** Class to control the NSLS Precision Integrator */
 class drvNSLS2_EM : public drvQuadEM {
@@ -27,9 +29,12 @@ public:
                  
     /* These are the methods that are new to this class */
     virtual void exitHandler();
-    /* This should be private but we call it from C so it needs to be public */
+    /* These should be private but we call them from C so they need to be public */
     void callbackFunc();
+    void dmaCallbackFunc(epicsUInt32 count);
+    void interruptThread();
     bool isAcquiring();
+    bool isDMAMode();
 
 protected:
     /* These are the methods we implement from quadEM */
@@ -47,6 +52,8 @@ protected:
     #define FIRST_NSLS2_COMMAND P_DAC
     int P_CalibrationMode;
     int P_ADCOffset;
+    int P_MissedFrames;
+    int P_DMAMode;
  
 private:
     /* Our data */
@@ -61,10 +68,23 @@ private:
     epicsFloat64 scaleFactor_[QE_MAX_INPUTS][MAX_RANGES];
     int memfd_;
     int intfd_;
+    bool firstFrame_;         // True until the first frame after acquisition starts is processed
+    epicsUInt32 lastFrame_;   // FPGA frame counter of the previous frame
+    epicsUInt32 interruptCount_;
+    int missedFrames_;
+    bool dmaMode_;            // True when the FPGA writes every frame to the DMA buffer
+    const epicsInt32 *dmaBuffer_;  // The two halves of the DMA buffer, mmap'd from /dev/vipic
+    size_t dmaBlockSamples_;  // Number of samples in each half of the DMA buffer
+    epicsUInt32 dmaStartCount_;  // Interrupt count before the first DMA block after acquisition starts
+    epicsUInt32 dmaBlocks_;   // Number of DMA blocks processed
+    bool dmaRunning_;         // True from startDMA() until stopDMA()
+    epicsFloat64 *blockData_; // The samples of a DMA block converted for computePositionsBlock()
 
     /* our functions */
     asynStatus getFirmwareVersion();
     asynStatus readMeter(int *adcbuf);
+    asynStatus startDMA();
+    void stopDMA();
     asynStatus setDAC(int channel, int value);
     void mmap_fpga();
     asynStatus pl_open(int *fd);
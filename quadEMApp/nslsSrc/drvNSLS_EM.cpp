@@ -27,6 +27,7 @@
 
 #include <epicsExport.h>
 #include "drvNSLS_EM.h"
+#include "quadEMAscii.h"
 
 #define BROADCAST_TIMEOUT 0.2
 #define NSLS_EM_TIMEOUT   0.1
@@ -39,6 +40,10 @@
 #define FREQUENCY 1e6
 // 2^20 is maximum counts for 20-bit ADC
 #define MAX_COUNTS 1048576.0
+// Size of read buffer for the data in units of char.  Each read returns many lines.
+#define ASCII_BUFFER_SIZE 65536
+// Maximum number of samples passed to computePositionsBlock() at once
+#define ASCII_MAX_SAMPLES 4096
 typedef enum {
   Phase0, 
   Phase1, 
@@ -83,6 +88,7 @@ drvNSLS_EM::drvNSLS_EM(const char *portName, const char *broadcastAddress, int m
     broadcastAddress_ = epicsStrDup(broadcastAddress);
     
     acquireStartEvent_ = epicsEventCreate(epicsEventEmpty);
+    readingActiveEvent_ = epicsEventCreate(epicsEventEmpty);
     
     strcpy(udpPortName_, "UDP_");
     strcat(udpPortName_, portName);
@@ -251,7 +257,8 @@ asynStatus drvNSLS_EM::findModule()
                driverName, functionName, status, pasynUserTCPData_->errorMessage);
         return asynError;
     }
-    pasynOctetSyncIO->setInputEos(pasynUserTCPData_, "\n", 1);
+    // The read thread splits the data into lines itself, so it can read many lines at once
+    pasynOctetSyncIO->setInputEos(pasynUserTCPData_, "", 0);
 
     return asynSuccess;
 }
@@ -294,6 +301,8 @@ asynStatus drvNSLS_EM::writeReadMeter()
 
 /** Read thread to read the data from the electrometer when it is in continuous acquire mode.
   * Reads the data, computes the sums and positions, and does callbacks.
+  * Each read returns all of the data available, which is split into lines with a quadEMLineSplitter.
+  * The samples are passed to computePositionsBlock() as blocks.
   */
 
 void drvNSLS_EM::readThread(void)
@@ -307,10 +316,15 @@ void drvNSLS_EM::readThread(void)
     asynInterface *pasynInterface;
     asynOctet *pasynOctet;
     void *octetPvt;
-    int phase;
-    epicsInt32 raw[4];
-    epicsFloat64 data[4];
-    char ASCIIData[150];
+    int phase=0;
+    int numValues;
+    long raw[5];
+    quadEMLineSplitter lineSplitter(ASCII_BUFFER_SIZE);
+    const char *line;
+    size_t lineLength;
+    epicsFloat64 *blockData;
+    epicsFloat64 *pData;
+    size_t numBlock;
     size_t nRequested;
     static const char *functionName = "readThread";
 
@@ -331,29 +345,35 @@ void drvNSLS_EM::readThread(void)
     }
     pasynOctet = (asynOctet *)pasynInterface->pinterface;
     octetPvt = pasynInterface->drvPvt;
+
+    // The buffer is too large for the stack of the thread
+    blockData = (epicsFloat64 *)malloc(ASCII_MAX_SAMPLES * QE_MAX_INPUTS * sizeof(epicsFloat64));
     
     /* Loop forever */
     lock();
     while (1) {
         if (acquiring_ == 0) {
             readingActive_ = 0;
+            epicsEventSignal(readingActiveEvent_);
             unlock();
             (void)epicsEventWait(acquireStartEvent_);
             lock();
             readingActive_ = 1;
+            epicsEventSignal(readingActiveEvent_);
             status = pasynOctet->flush(octetPvt, pasynUser);
+            lineSplitter.reset();
             getIntegerParam(P_PingPong,       &pingPong);
-            nRequested = sizeof(ASCIIData);
         }
+        // Read all of the data that is available after the partial line from the previous read
+        nRequested = lineSplitter.writeSpace();
         unlock();
         pasynManager->lockPort(pasynUser);
-        status = pasynOctet->read(octetPvt, pasynUser, ASCIIData, nRequested, 
+        status = pasynOctet->read(octetPvt, pasynUser, lineSplitter.writePointer(), nRequested, 
                                   &nRead, &eomReason);
         pasynManager->unlockPort(pasynUser);
         lock();
 
-        if ((status != asynSuccess) || 
-            (eomReason != ASYN_EOM_EOS)) {
+        if (nRead == 0) {
             if (status != asynTimeout) {
                 asynPrint(pasynUserSelf, ASYN_TRACE_ERROR, 
                     "%s:%s: unexpected error reading meter status=%d, nRead=%lu, eomReason=%d\n", 
@@ -367,19 +387,35 @@ void drvNSLS_EM::readThread(void)
             continue;
         }
 
-        if (strstr(ASCIIData, ":")) {
-            sscanf(ASCIIData, "%d: %d %d %d %d", &phase, &raw[0], &raw[1], &raw[2], &raw[3]);
-        } else {
-            sscanf(ASCIIData, "%d %d %d %d", &raw[0], &raw[1], &raw[2], &raw[3]);
-        }
-        if (((phase == 0) && (pingPong == Phase0)) ||
-            ((phase == 1) && (pingPong == Phase1)) ||
-            (pingPong == PhaseBoth)) {
-            for (i=0; i<4; i++) {
-                data[i] = raw[i] * scaleFactor_;
-            }         
-            computePositions(data);
+        lineSplitter.commit(nRead);
+        readComplete();
+        numBlock = 0;
+        while (lineSplitter.nextLine(&line, &lineLength)) {
+            // The lines are either "phase: value1 value2 value3 value4" or "value1 value2 value3 value4"
+            pData = blockData + numBlock*QE_MAX_INPUTS;
+            if (memchr(line, ':', lineLength)) {
+                numValues = quadEMParseLongs(line, lineLength, 10, raw, 5);
+                if (numValues != 5) continue;
+                phase = raw[0];
+                for (i=0; i<4; i++) pData[i] = raw[i+1];
+            } else {
+                numValues = quadEMParseLongs(line, lineLength, 10, raw, 4);
+                if (numValues != 4) continue;
+                for (i=0; i<4; i++) pData[i] = raw[i];
+            }
+            if (((phase == 0) && (pingPong == Phase0)) ||
+                ((phase == 1) && (pingPong == Phase1)) ||
+                (pingPong == PhaseBoth)) {
+                for (i=0; i<4; i++) {
+                    pData[i] *= scaleFactor_;
+                }
+                if (++numBlock == ASCII_MAX_SAMPLES) {
+                    computePositionsBlock(blockData, numBlock);
+                    numBlock = 0;
+                }
+            }
         }
+        computePositionsBlock(blockData, numBlock);
     }
 }
 
@@ -399,7 +435,7 @@ asynStatus drvNSLS_EM::setAcquire(epicsInt32 value)
         // Wait for the read thread to stop
         while (readingActive_) {
             unlock();
-            epicsThreadSleep(0.01);
+            (void)epicsEventWaitWithTimeout(readingActiveEvent_, QE_READING_ACTIVE_WAIT);
             lock();
         }
     } else {
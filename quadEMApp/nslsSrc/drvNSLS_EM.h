@@ -54,6 +54,7 @@ private:
     asynUser *pasynUserTCPCommandConnect_;
     asynUser *pasynUserTCPData_;
     epicsEventId acquireStartEvent_;
+    epicsEventId readingActiveEvent_;  // Signalled by the read thread when readingActive_ changes
     int moduleID_;
     int numModules_;
     double ranges_[MAX_RANGES];
@@ -63,6 +63,17 @@ uint32_t pl_get_dma_status(int fd) {
     return p.data;
 }
     
+int pl_set_dma_control(int fd, uint32_t data) {
+    pldrv_io_t p;
+    p.address = 0x0;
+    p.data = data;
+    if (ioctl(fd, SET_DMA_CONTROL, &p) == -1) {
+        perror(__func__);
+        return -1;
+    }
+    return 0;
+}
+
 int pl_set_rate(int fd, uint32_t data) {
     pldrv_io_t p;
     p.address = 0x0;
@@ -108,10 +119,11 @@ int pl_set_debug_level(int fd, uint32_t level) {
     return 0;
 }
 
-int pl_get_data(int fd, uint32_t *buff, size_t len) {
-    buff = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
-    if (buff == MAP_FAILED) {
+int pl_get_data(int fd, uint32_t **buff, size_t len) {
+    *buff = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+    if (*buff == MAP_FAILED) {
         perror(__func__);
+        *buff = NULL;
         return -1;
     }
     
@@ -11,12 +11,12 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <math.h>
 
 #include <epicsTypes.h>
 #include <epicsString.h>
 #include <epicsThread.h>
 #include <epicsExit.h>
-#include <epicsRingBytes.h>
 #include <epicsEvent.h>
 
 #include <asynNDArrayDriver.h>
@@ -38,6 +38,12 @@ static void callbackTaskC(void *pPvt)
     pdrvQuadEM->callbackTask();
 }
 
+static void spectrumTaskC(void *pPvt)
+{
+    drvQuadEM *pdrvQuadEM = (drvQuadEM *)pPvt;
+    pdrvQuadEM->spectrumTask();
+}
+
 
 /** Constructor for the drvQuadEM class.
   * Calls constructor for the asynPortDriver base class.
@@ -51,7 +57,7 @@ drvQuadEM::drvQuadEM(const char *portName, int ringBufferSize)
    : asynNDArrayDriver(portName, 
                     QE_MAX_DATA+1, /* maxAddr */ 
                     0, 0,        /* maxBuffers, maxMemory, no limits */
-                    asynInt32Mask | asynInt32ArrayMask | asynFloat64Mask | asynFloat64ArrayMask | asynEnumMask | asynGenericPointerMask | asynDrvUserMask, /* Interface mask */
+                    asynInt32Mask | asynInt32ArrayMask | asynFloat32ArrayMask | asynFloat64Mask | asynFloat64ArrayMask | asynEnumMask | asynGenericPointerMask | asynDrvUserMask, /* Interface mask */
                     asynInt32Mask | asynInt32ArrayMask | asynFloat64Mask | asynFloat64ArrayMask | asynEnumMask | asynGenericPointerMask,                   /* Interrupt mask */
                     ASYN_CANBLOCK | ASYN_MULTIDEVICE, /* asynFlags.  This driver blocks it is multi-device */
                     1, /* Autoconnect */
@@ -103,6 +109,33 @@ drvQuadEM::drvQuadEM(const char *portName, int ringBufferSize)
     createParam(P_NumAveragedString,        asynParamInt32,         &P_NumAveraged);
     createParam(P_ModelString,              asynParamInt32,         &P_Model);
     createParam(P_FirmwareString,           asynParamOctet,         &P_Firmware);
+    createParam(P_DirectFillString,         asynParamInt32,         &P_DirectFill);
+    createParam(P_ScalarUpdateModeString,   asynParamInt32,         &P_ScalarUpdateMode);
+    createParam(P_ScalarUpdateNString,      asynParamInt32,         &P_ScalarUpdateN);
+    createParam(P_ScalarUpdateRateString,   asynParamFloat64,       &P_ScalarUpdateRate);
+    createParam(P_ScalarUpdateSamplesString, asynParamInt32,        &P_ScalarUpdateSamples);
+    createParam(P_SampleTimestampsString,   asynParamInt32,         &P_SampleTimestamps);
+    createParam(P_SampleTimeZeroString,     asynParamFloat64,       &P_SampleTimeZero);
+    createParam(P_ComputeStatsString,       asynParamInt32,         &P_ComputeStats);
+    createParam(P_StatsMeanString,          asynParamFloat64,       &P_StatsMean);
+    createParam(P_StatsSigmaString,         asynParamFloat64,       &P_StatsSigma);
+    createParam(P_StatsMinString,           asynParamFloat64,       &P_StatsMin);
+    createParam(P_StatsMaxString,           asynParamFloat64,       &P_StatsMax);
+    createParam(P_StatsTotalString,         asynParamFloat64,       &P_StatsTotal);
+    createParam(P_SpectrumEnableString,     asynParamInt32,         &P_SpectrumEnable);
+    createParam(P_SpectrumSizeString,       asynParamInt32,         &P_SpectrumSize);
+    createParam(P_SpectrumWindowString,     asynParamInt32,         &P_SpectrumWindow);
+    createParam(P_SpectrumOverlapString,    asynParamFloat64,       &P_SpectrumOverlap);
+    createParam(P_SpectrumNumAverageString, asynParamInt32,         &P_SpectrumNumAverage);
+    createParam(P_SpectrumString,           asynParamFloat64Array,  &P_Spectrum);
+    createParam(P_SpectrumFreqString,       asynParamFloat64Array,  &P_SpectrumFreq);
+    createParam(P_SpectrumCountString,      asynParamInt32,         &P_SpectrumCount);
+    createParam(P_LatencyMeanString,        asynParamFloat64,       &P_LatencyMean);
+    createParam(P_LatencyMaxString,         asynParamFloat64,       &P_LatencyMax);
+    createParam(P_LatencyHistogramString,   asynParamInt32Array,    &P_LatencyHistogram);
+    createParam(P_LatencyResetString,       asynParamInt32,         &P_LatencyReset);
+    createParam(P_SampleRateString,         asynParamFloat64,       &P_SampleRate);
+    createParam(P_BlockRateString,          asynParamFloat64,       &P_BlockRate);
     
     setIntegerParam(P_RingOverflows, 0);
     setIntegerParam(P_PingPong, 0);
@@ -118,15 +151,94 @@ drvQuadEM::drvQuadEM(const char *portName, int ringBufferSize)
     setIntegerParam(P_Resolution, 16);
     setIntegerParam(P_ValuesPerRead, 1);
     setIntegerParam(P_ReadFormat, 0);
+    setIntegerParam(P_DirectFill, 0);
+    setIntegerParam(P_ScalarUpdateMode, QEScalarUpdateEverySample);
+    setIntegerParam(P_ScalarUpdateN, 1);
+    setDoubleParam(P_ScalarUpdateRate, 0.);
+    setIntegerParam(P_ScalarUpdateSamples, 1);
+    setIntegerParam(P_SampleTimestamps, 0);
+    setDoubleParam(P_SampleTimeZero, 0.);
+    setIntegerParam(P_ComputeStats, 1);
+    computeStats_ = 1;
+    memset(&stats_, 0, sizeof(stats_));
+    setIntegerParam(P_SpectrumEnable, 0);
+    setIntegerParam(P_SpectrumSize, 1024);
+    setIntegerParam(P_SpectrumWindow, QESpectrumWindowHann);
+    setDoubleParam(P_SpectrumOverlap, 0.5);
+    setIntegerParam(P_SpectrumNumAverage, 10);
+    setIntegerParam(P_SpectrumCount, 0);
+    spectrumEnable_ = 0;
+    spectrumConfig_ = 0;
+    spectrum_ = 0;
+    spectrumRing_ = 0;
+    spectrumEvent_ = 0;
+    listenerLock_ = epicsMutexMustCreate();
+    receivedTime_ = 0;
+    readTime_ = 0;
+    samplesReceived_ = 0;
+    blocksDone_ = 0;
+    lastLatencyUpdate_ = epicsMonotonicGet();
+    lastSamplesReceived_ = 0;
+    lastBlocksDone_ = 0;
+    setDoubleParam(P_SampleRate, 0.);
+    setDoubleParam(P_BlockRate, 0.);
+    for (i=0; i<QE_LATENCY_STAGES; i++) {
+        setDoubleParam(i, P_LatencyMean, 0.);
+        setDoubleParam(i, P_LatencyMax, 0.);
+    }
+    numListeners_ = 0;
+    for (i=0; i<QE_MAX_LISTENERS; i++) {
+        listeners_[i] = 0;
+    }
+    scalarUpdateMode_ = QEScalarUpdateEverySample;
+    scalarUpdateN_ = 1;
+    scalarUpdatePeriod_ = 0.;
+    scalarCount_ = 0;
     for (i=0; i<QE_MAX_DATA; i++) {
         setDoubleParam(i, P_DoubleData, 0.0);
+        setDoubleParam(i, P_StatsMean,  0.0);
+        setDoubleParam(i, P_StatsSigma, 0.0);
+        setDoubleParam(i, P_StatsMin,   0.0);
+        setDoubleParam(i, P_StatsMax,   0.0);
+        setDoubleParam(i, P_StatsTotal, 0.0);
+        scalarSum_[i] = 0.;
     }
+    for (i=0; i<QE_MAX_SAMPLE_VALUES; i++) {
+        fillArrays_[i] = 0;
+        spareArrays_[i] = 0;
+    }
+    sampleTimestamps_ = 0;
+    resetSampleTimes();
+    directFill_ = 0;
+    fillCount_ = 0;
+    flushEpoch_ = 0;
     valuesPerRead_ = 1;
+    // Default processing configuration, used until the records write the actual values
+    memset(&processConfig_, 0, sizeof(processConfig_));
+    processConfig_.geometry = QEGeometrySquare;
+    for (i=0; i<QE_MAX_INPUTS; i++) {
+        processConfig_.kernel.currentScale[i] = 1.0;
+    }
+    for (i=0; i<2; i++) {
+        processConfig_.kernel.positionScale[i] = 1.0;
+    }
+    quadEMKernelWeights(processConfig_.geometry, processConfig_.customWeights, processConfig_.kernel.weights);
+    kernel_ = quadEMKernelGet();
     
     if (ringBufferSize <= 0) ringBufferSize = QE_DEFAULT_RING_BUFFER_SIZE;
+    ringBufferSize_ = ringBufferSize;
     
-    ringBuffer_ = epicsRingBytesCreate(ringBufferSize * QE_MAX_DATA * sizeof(epicsFloat64));
-    msgQId_ = epicsMessageQueueCreate(ringBufferSize, sizeof(int));
+    sampleRing_ = new quadEMRing<QESample_t>(ringBufferSize);
+    sampleTimes_ = (epicsFloat64 *)calloc(ringBufferSize, sizeof(epicsFloat64));
+    for (i=0; i<QE_MAX_INPUTS; i++) {
+        blockIn_[i] = (epicsFloat64 *)calloc(QE_MAX_BLOCK_SIZE, sizeof(epicsFloat64));
+    }
+    for (i=0; i<QE_MAX_DATA; i++) {
+        blockOut_[i] = (epicsFloat64 *)calloc(QE_MAX_BLOCK_SIZE, sizeof(epicsFloat64));
+    }
+    listenerSamples_ = (QESample_t *)calloc(QE_MAX_BLOCK_SIZE, sizeof(QESample_t));
+    blockRing_ = new quadEMRing<QEBlock_t>(ringBufferSize);
+    blockEvent_ = epicsEventCreate(epicsEventEmpty);
 
     /* Create the thread that does callbacks when the ring buffer has numAverage samples */
     status = (asynStatus)(epicsThreadCreate("drvQuadEMCallbackTask",
@@ -155,173 +267,696 @@ drvQuadEM::drvQuadEM(const char *portName, int ringBufferSize)
 }
 
 /** This function computes the sums, diffs and positions, and does callbacks 
+  * It is used by drivers that read one sample at a time, so it also calls readComplete().
   * \param[in] raw Array of raw current readings 
   */
 void drvQuadEM::computePositions(epicsFloat64 raw[QE_MAX_INPUTS])
+{
+    readComplete();
+    computePositionsBlock(raw, 1);
+}
+
+/** This function computes the sums, diffs and positions for a block of samples, and does callbacks.
+  * The calibration and geometry are taken from the cached processing configuration, the values are computed
+  * with the fastest kernel that the CPU supports (see quadEMKernel.h), and the computed values are written to the
+  * ring buffer with a single commit for each chunk of up to QE_MAX_BLOCK_SIZE samples.
+  * If the ring buffer is full the oldest samples are dropped.
+  * Chunks are split at NumAverage boundaries so callbacks are triggered at exactly the same sample
+  * as when computePositions() is called once per sample.
+  * \param[in] raw Array of raw current readings, nSamples*stride values.
+  *            The first QE_MAX_INPUTS values of each sample are used.
+  * \param[in] nSamples Number of samples in the raw array.
+  * \param[in] stride Number of values between the start of successive samples in the raw array.
+  * \param[in] timeIndex If >= 0 then raw[timeIndex] of each sample is the device time of that sample in seconds.
+  *            This is only used if sample timestamps are enabled.  If it is < 0 then the sample times are
+  *            interpolated from the times passed to setDeviceTime(), or computed from the SampleTime.
+  * If listeners have been registered with addListener() they are called with the lock held after each chunk.
+  */
+void drvQuadEM::computePositionsBlock(const epicsFloat64 *raw, size_t nSamples, size_t stride, int timeIndex)
 {
     int i;
-    int count;
+    size_t j;
     int numAverage;
     int ringOverflows;
-    int geometry;
-    epicsFloat64 currentOffset[QE_MAX_INPUTS];
-    epicsFloat64 currentScale[QE_MAX_INPUTS];
-    epicsFloat64 positionOffset[2];
-    epicsFloat64 positionScale[2];
-    epicsInt32 intData[QE_MAX_DATA];
-    epicsFloat64 doubleData[QE_MAX_DATA];
-    epicsFloat64 denom;
-    static const char *functionName = "computePositions";
+    int fillSize;
+    size_t numFree;
+    size_t numDrop;
+    size_t numChunk;
+    size_t maxChunk;
+    size_t n1, n2;
+    size_t timeStart;
+    bool store;
+    QESample_t *p1, *p2, *pSample;
+    const epicsFloat64 *pRaw;
+    epicsFloat64 *out[QE_MAX_DATA];
+    epicsFloat64 *pTimes;
+    epicsFloat64 time;
+    double sampleTime;
+    int scalarN;
+    epicsUInt64 chunkStart, now64;
+    bool listen;
+    static const char *functionName = "computePositionsBlock";
     
-    getIntegerParam(P_Geometry, &geometry);
-    // If the ring buffer is full then remove the oldest entry
-    if (epicsRingBytesFreeBytes(ringBuffer_) < (int)sizeof(doubleData)) {
-        asynPrint(pasynUserSelf, ASYN_TRACE_WARNING,
-            "%s::%s warning ring buffer overflow\n",
-            driverName, functionName);
-        count = epicsRingBytesGet(ringBuffer_, (char *)&doubleData, sizeof(doubleData));
-        ringCount_--;
-        rawCount_--;
-        getIntegerParam(P_RingOverflows, &ringOverflows);
-        ringOverflows++;
-        setIntegerParam(P_RingOverflows, ringOverflows);
+    if (nSamples == 0) return;
+    chunkStart = epicsMonotonicGet();
+    receivedTime_ = chunkStart;
+    samplesReceived_ += nSamples;
+    epicsMutexMustLock(listenerLock_);
+    listen = (numListeners_ > 0);
+    epicsMutexUnlock(listenerLock_);
+
+    // Take a copy of the processing configuration so it cannot change while this block is processed
+    const QEProcessConfig_t config = processConfig_;
+
+    getIntegerParam(P_NumAverage, &numAverage);
+    if (sampleTimestamps_ && !sampleTimeValid_) startSampleTimes();
+
+    // Number of samples in each scalar callback.  In QEScalarUpdateMaxRate mode the update period is converted
+    // to a number of samples, so each callback averages the same window and is not affected by when blocks arrive.
+    scalarN = 1;
+    if (scalarUpdateMode_ == QEScalarUpdateEveryN) {
+        scalarN = scalarUpdateN_;
     }
-    
+    else if (scalarUpdateMode_ == QEScalarUpdateMaxRate) {
+        getDoubleParam(P_SampleTime, &sampleTime);
+        if ((sampleTime > 0.) && (scalarUpdatePeriod_ > sampleTime)) {
+            scalarN = (int)ceil(scalarUpdatePeriod_/sampleTime - 1e-6);
+        }
+    }
+
+    // The ring buffer can never hold more than ringBufferSize_ samples
+    maxChunk = QE_MAX_BLOCK_SIZE;
+    if ((size_t)ringBufferSize_ < maxChunk) maxChunk = ringBufferSize_;
+
+    pRaw = raw;
+    while (nSamples > 0) {
+        numChunk = nSamples;
+        if (numChunk > maxChunk) numChunk = maxChunk;
+        // Don't process past the next NumAverage boundary, so that callbacks are triggered at the right sample
+        if ((numAverage > 0) && (rawCount_ < numAverage) && (numChunk > (size_t)(numAverage - rawCount_))) {
+            numChunk = numAverage - rawCount_;
+        }
+
+        store = true;
+        for (i=0; i<QE_MAX_DATA; i++) {
+            out[i] = blockOut_[i];
+        }
+        pTimes = 0;
+        if (directFill_) {
+            // Compute the values directly into the NDArrays
+            fillSize = fillArraySize();
+            if (fillArrays_[0] &&
+                ((fillCount_ >= (int)fillArrays_[0]->dims[0].size) || ((int)fillArrays_[0]->dims[0].size != fillSize))) {
+                // The arrays are full, which happens when NumAverage is 0, or NumAverage has changed since they were
+                // allocated, e.g. when a driver changes the SampleTime while acquiring.
+                // Pass the samples in them to callbackTask and continue with new arrays.
+                triggerCallbacks();
+                releaseFillArrays(fillArrays_);
+                fillCount_ = 0;
+                rawCount_ = 0;
+            }
+            if (!fillArrays_[0]) {
+                if (spareArrays_[0] && ((int)spareArrays_[0]->dims[0].size == fillSize)) {
+                    memcpy(fillArrays_, spareArrays_, sizeof(fillArrays_));
+                    memset(spareArrays_, 0, sizeof(spareArrays_));
+                } else {
+                    allocFillArrays(fillArrays_, fillSize);
+                }
+                fillCount_ = 0;
+            }
+            fillSize = fillArrays_[0] ? (int)fillArrays_[0]->dims[0].size : 0;
+            if (fillCount_ >= fillSize) {
+                // The arrays could not be allocated.  Discard these samples.
+                asynPrint(pasynUserSelf, ASYN_TRACE_WARNING,
+                    "%s::%s warning no room in arrays, dropping %d samples\n",
+                    driverName, functionName, (int)numChunk);
+                getIntegerParam(P_RingOverflows, &ringOverflows);
+                ringOverflows += (int)numChunk;
+                setIntegerParam(P_RingOverflows, ringOverflows);
+                store = false;
+            } else {
+                if (numChunk > (size_t)(fillSize - fillCount_)) numChunk = fillSize - fillCount_;
+                for (i=0; i<QE_MAX_DATA; i++) {
+                    out[i] = (epicsFloat64 *)fillArrays_[i]->pData + fillCount_;
+                }
+                if (fillArrays_[QE_SAMPLE_TIME]) {
+                    pTimes = (epicsFloat64 *)fillArrays_[QE_SAMPLE_TIME]->pData + fillCount_;
+                }
+            }
+        }
+        else {
+            // If the ring buffer does not have room for this chunk then remove the oldest entries
+            numFree = sampleRing_->freeSpace();
+            if (numFree < numChunk) {
+                numDrop = sampleRing_->dropOldest(numChunk - numFree);
+                asynPrint(pasynUserSelf, ASYN_TRACE_WARNING,
+                    "%s::%s warning ring buffer overflow, dropping %d samples\n",
+                    driverName, functionName, (int)numDrop);
+                getIntegerParam(P_RingOverflows, &ringOverflows);
+                ringOverflows += (int)numDrop;
+                setIntegerParam(P_RingOverflows, ringOverflows);
+            }
+        }
+
+        if (sampleTimestamps_) {
+            // Compute the sample times.  Device times are interpolated linearly from the last anchor.
+            timeStart = (size_t)(sampleRing_->head() % ringBufferSize_);
+            time = nextSampleTime_;
+            for (j=0; j<numChunk; j++) {
+                if (timeIndex >= 0) {
+                    time = relativeDeviceTime(pRaw[j*stride + timeIndex]);
+                } else {
+                    time = nextSampleTime_ + j*sampleTimeStep_;
+                }
+                if (pTimes) {
+                    pTimes[j] = time;
+                } else if (!directFill_) {
+                    sampleTimes_[(timeStart + j) % ringBufferSize_] = time;
+                }
+            }
+            nextSampleTime_ = time + sampleTimeStep_;
+            sampleCount_ += numChunk;
+        }
+
+        // Convert the raw values to structure-of-arrays and compute all values with the kernel
+        for (j=0; j<numChunk; j++) {
+            for (i=0; i<QE_MAX_INPUTS; i++) {
+                blockIn_[i][j] = pRaw[i];
+            }
+            pRaw += stride;
+        }
+        kernel_->func(&config.kernel, blockIn_, out, numChunk);
+        if (listen) {
+            // The listeners are called after this chunk is complete, and out may not be valid then
+            for (j=0; j<numChunk; j++) {
+                for (i=0; i<QE_MAX_DATA; i++) {
+                    listenerSamples_[j].data[i] = out[i][j];
+                }
+            }
+        }
+        if (!store) {
+            // Nothing to do
+        }
+        else if (directFill_) {
+            fillCount_ += (int)numChunk;
+            rawCount_ += (int)numChunk;
+        }
+        else {
+            // Copy the values into the ring buffer as one QESample_t per sample
+            sampleRing_->reserve(numChunk, &p1, &n1, &p2, &n2);
+            for (j=0; j<numChunk; j++) {
+                pSample = (j < n1) ? &p1[j] : &p2[j-n1];
+                for (i=0; i<QE_MAX_DATA; i++) {
+                    pSample->data[i] = out[i][j];
+                }
+            }
+            sampleRing_->commit(numChunk);
+            rawCount_ += (int)numChunk;
+        }
+        if (store && computeStats_) {
+            accumulateStats(out, numChunk);
+        }
+        if (store && spectrumEnable_) {
+            putSpectrumSamples(out, numChunk);
+        }
+
+        // Accumulate the samples for the scalar callbacks.  The callbacks are done with the average of
+        // the accumulated samples, so the asynFloat64Average device support used for fast averaging
+        // still averages every sample.
+        for (j=0; j<numChunk; j++) {
+            for (i=0; i<QE_MAX_DATA; i++) {
+                scalarSum_[i] += out[i][j];
+            }
+            scalarCount_++;
+            if ((scalarUpdateMode_ != QEScalarUpdateBlockComplete) && (scalarCount_ >= scalarN)) {
+                doScalarCallbacks();
+            }
+        }
+
+        // This is done after the scalar values are accumulated because in direct fill mode it passes the arrays
+        // to callbackTask, and in QEScalarUpdateBlockComplete mode it does the scalar callbacks
+        if (numAverage > 0) {
+            if (rawCount_ >= numAverage) {
+                triggerCallbacks();
+            }
+        }
+        now64 = epicsMonotonicGet();
+        latency_[QELatencyCompute].add(now64 - chunkStart);
+        if (listen) {
+            callListeners(numChunk, chunkStart);
+        }
+        nSamples -= numChunk;
+        chunkStart = epicsMonotonicGet();
+    }
+}
+
+/** Calls each registered listener with the chunk of samples in listenerSamples_.
+  * This is called with the lock held.
+  * \param[in] nSamples The number of samples.
+  * \param[in] received The epicsMonotonicGet() time when computing the chunk was started.
+  */
+void drvQuadEM::callListeners(size_t nSamples, epicsUInt64 received)
+{
+    int i;
+
+    epicsMutexMustLock(listenerLock_);
+    for (i=0; i<numListeners_; i++) {
+        listeners_[i]->samplesComputed(listenerSamples_, nSamples, received);
+    }
+    epicsMutexUnlock(listenerLock_);
+}
+
+/** Registers a listener that is called with every sample as soon as it is computed.
+  * See quadEMListener for the restrictions on what the listener can do.
+  * \param[in] pListener The listener.
+  */
+asynStatus drvQuadEM::addListener(quadEMListener *pListener)
+{
+    asynStatus status = asynSuccess;
+    static const char *functionName = "addListener";
+
+    epicsMutexMustLock(listenerLock_);
+    if (numListeners_ >= QE_MAX_LISTENERS) {
+        asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
+            "%s::%s error, maximum number of listeners (%d) already registered\n",
+            driverName, functionName, QE_MAX_LISTENERS);
+        status = asynError;
+    } else {
+        listeners_[numListeners_++] = pListener;
+    }
+    epicsMutexUnlock(listenerLock_);
+    return status;
+}
+
+/** Removes a listener that was registered with addListener().
+  * When this returns the listener is not running and will not be called again, so it can be deleted.
+  * \param[in] pListener The listener.
+  */
+asynStatus drvQuadEM::removeListener(quadEMListener *pListener)
+{
+    int i;
+    asynStatus status = asynError;
+
+    epicsMutexMustLock(listenerLock_);
+    for (i=0; i<numListeners_; i++) {
+        if (listeners_[i] == pListener) {
+            numListeners_--;
+            listeners_[i] = listeners_[numListeners_];
+            listeners_[numListeners_] = 0;
+            status = asynSuccess;
+            break;
+        }
+    }
+    epicsMutexUnlock(listenerLock_);
+    return status;
+}
+
+/** Rebuilds the cached processing configuration from the parameter library.
+  * This must be called whenever the geometry, current offsets and scales, position offsets
+  * and scales, or custom weights are changed.  Parameters that have not yet been defined
+  * keep their previous values.
+  */
+void drvQuadEM::updateProcessConfig()
+{
+    int i;
+    QEProcessConfig_t config = processConfig_;
+
+    getIntegerParam(P_Geometry, &config.geometry);
     for (i=0; i<QE_MAX_INPUTS; i++) {
-        getDoubleParam(i, P_CurrentOffset, &currentOffset[i]);
-        getDoubleParam(i, P_CurrentScale,  &currentScale[i]);
-        doubleData[i] = raw[i]*currentScale[i] - currentOffset[i];
+        getDoubleParam(i, P_CurrentOffset, &config.kernel.currentOffset[i]);
+        getDoubleParam(i, P_CurrentScale,  &config.kernel.currentScale[i]);
+        getDoubleParam(i, P_WeightXsum,    &config.customWeights[QEWeightSumX][i]);
+        getDoubleParam(i, P_WeightYsum,    &config.customWeights[QEWeightSumY][i]);
+        getDoubleParam(i, P_WeightXdelta,  &config.customWeights[QEWeightDiffX][i]);
+        getDoubleParam(i, P_WeightYdelta,  &config.customWeights[QEWeightDiffY][i]);
     }
     for (i=0; i<2; i++) {
-        getDoubleParam(i, P_PositionOffset, &positionOffset[i]);
-        getDoubleParam(i, P_PositionScale, &positionScale[i]);
+        getDoubleParam(i, P_PositionOffset, &config.kernel.positionOffset[i]);
+        getDoubleParam(i, P_PositionScale,  &config.kernel.positionScale[i]);
     }
-    
-    doubleData[QESumAll] = doubleData[QECurrent1] + doubleData[QECurrent2] +
-                           doubleData[QECurrent3] + doubleData[QECurrent4];
-    if (geometry == QEGeometrySquare) {
-        doubleData[QESumX]   = doubleData[QESumAll];
-        doubleData[QESumY]   = doubleData[QESumAll];
-        doubleData[QEDiffX]  = (doubleData[QECurrent2] + doubleData[QECurrent3]) -
-                               (doubleData[QECurrent1] + doubleData[QECurrent4]);
-        doubleData[QEDiffY]  = (doubleData[QECurrent1] + doubleData[QECurrent2]) -
-                               (doubleData[QECurrent3] + doubleData[QECurrent4]);
-    }
-    else if (geometry == QEGeometrySquareCC) {
-        doubleData[QESumX]   = doubleData[QESumAll];
-        doubleData[QESumY]   = doubleData[QESumAll];
-        doubleData[QEDiffX]  = (doubleData[QECurrent3] + doubleData[QECurrent4]) -
-                               (doubleData[QECurrent1] + doubleData[QECurrent2]);
-        doubleData[QEDiffY]  = (doubleData[QECurrent1] + doubleData[QECurrent4]) -
-                               (doubleData[QECurrent2] + doubleData[QECurrent3]);
-    }
-    else if (geometry == QEGeometryDiamond) {
-        doubleData[QESumX]   = doubleData[QECurrent1] + doubleData[QECurrent2];
-        doubleData[QESumY]   = doubleData[QECurrent3] + doubleData[QECurrent4];
-        doubleData[QEDiffX]  = doubleData[QECurrent2] - doubleData[QECurrent1];
-        doubleData[QEDiffY]  = doubleData[QECurrent4] - doubleData[QECurrent3];
-    }
-    else if (geometry == QEGeometryCustom) {
-        epicsFloat64 weightXsum[QE_MAX_INPUTS];
-        epicsFloat64 weightYsum[QE_MAX_INPUTS];
-        epicsFloat64 weightXdelta[QE_MAX_INPUTS];
-        epicsFloat64 weightYdelta[QE_MAX_INPUTS];
-        
-        for (i=0; i<QE_MAX_INPUTS; i++) {
-            getDoubleParam(i, P_WeightXsum, &weightXsum[i]);
-            getDoubleParam(i, P_WeightYsum, &weightYsum[i]);
-            getDoubleParam(i, P_WeightXdelta, &weightXdelta[i]);
-            getDoubleParam(i, P_WeightYdelta, &weightYdelta[i]);
-        }
-        
-        doubleData[QESumX]  = weightXsum[0] * doubleData[QECurrent1] +
-                              weightXsum[1] * doubleData[QECurrent2] +
-                              weightXsum[2] * doubleData[QECurrent3] +
-                              weightXsum[3] * doubleData[QECurrent4];
-        doubleData[QESumY]  = weightYsum[0] * doubleData[QECurrent1] +
-                              weightYsum[1] * doubleData[QECurrent2] +
-                              weightYsum[2] * doubleData[QECurrent3] +
-                              weightYsum[3] * doubleData[QECurrent4];
-        doubleData[QEDiffX] = weightXdelta[0] * doubleData[QECurrent1] +
-                              weightXdelta[1] * doubleData[QECurrent2] +
-                              weightXdelta[2] * doubleData[QECurrent3] +
-                              weightXdelta[3] * doubleData[QECurrent4];
-        doubleData[QEDiffY] = weightYdelta[0] * doubleData[QECurrent1] +
-                              weightYdelta[1] * doubleData[QECurrent2] +
-                              weightYdelta[2] * doubleData[QECurrent3] +
-                              weightYdelta[3] * doubleData[QECurrent4];
-    }
-    denom = doubleData[QESumX];
-    if (denom == 0.) denom = 1.;
-    doubleData[QEPositionX] = (positionScale[0] * doubleData[QEDiffX] / denom) -  positionOffset[0];
-    denom = doubleData[QESumY];
-    if (denom == 0.) denom = 1.;
-    doubleData[QEPositionY] = (positionScale[1] * doubleData[QEDiffY] / denom) -  positionOffset[1];
-
-    count = epicsRingBytesPut(ringBuffer_, (char *)&doubleData, sizeof(doubleData));
-    ringCount_++;
-    rawCount_++;
-    if (count != sizeof(doubleData)) {
-        asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
-               "%s:%s: error writing ring buffer, count=%d, should be %d\n", 
-               driverName, functionName, count, (int)sizeof(doubleData));
+    // All geometries are computed with a weight matrix
+    quadEMKernelWeights(config.geometry, config.customWeights, config.kernel.weights);
+    config.version = processConfig_.version + 1;
+    processConfig_ = config;
+}
+
+/** Adds a chunk of samples to the statistics of the current block.
+  * The mean, m2, minimum and maximum of the chunk are computed first, with loops over the samples
+  * of one value that the compiler can vectorize, and these are then combined with the statistics
+  * of the previous chunks.
+  * \param[in] values Array of QE_MAX_DATA pointers to the values in QEData_t order.
+  * \param[in] nSamples Number of samples.
+  */
+void drvQuadEM::accumulateStats(epicsFloat64 * const values[QE_MAX_DATA], size_t nSamples)
+{
+    int i;
+    size_t j;
+    const epicsFloat64 *pIn;
+    epicsFloat64 sum, chunkMean, chunkM2, chunkMin, chunkMax, delta, diff;
+    epicsFloat64 nA, nB, nTotal;
+
+    if (nSamples == 0) return;
+    nA = (epicsFloat64)stats_.count;
+    nB = (epicsFloat64)nSamples;
+    nTotal = nA + nB;
+    for (i=0; i<QE_MAX_DATA; i++) {
+        pIn = values[i];
+        sum = 0.;
+        chunkMin = pIn[0];
+        chunkMax = pIn[0];
+        for (j=0; j<nSamples; j++) {
+            sum += pIn[j];
+            chunkMin = (pIn[j] < chunkMin) ? pIn[j] : chunkMin;
+            chunkMax = (pIn[j] > chunkMax) ? pIn[j] : chunkMax;
+        }
+        chunkMean = sum / nB;
+        // The chunk is still in the cache so a second pass for m2 is cheap
+        chunkM2 = 0.;
+        for (j=0; j<nSamples; j++) {
+            diff = pIn[j] - chunkMean;
+            chunkM2 += diff * diff;
+        }
+        if (stats_.count == 0) {
+            stats_.mean[i] = chunkMean;
+            stats_.m2[i]   = chunkM2;
+            stats_.min[i]  = chunkMin;
+            stats_.max[i]  = chunkMax;
+        } else {
+            delta = chunkMean - stats_.mean[i];
+            stats_.mean[i] += delta * nB / nTotal;
+            stats_.m2[i]   += chunkM2 + delta * delta * nA * nB / nTotal;
+            if (chunkMin < stats_.min[i]) stats_.min[i] = chunkMin;
+            if (chunkMax > stats_.max[i]) stats_.max[i] = chunkMax;
+        }
     }
+    stats_.count += nSamples;
+}
 
-    getIntegerParam(P_NumAverage, &numAverage);
-    if (numAverage > 0) {
-        if (rawCount_ >= numAverage) {
-            triggerCallbacks();
+/** Publishes the statistics of the current block in the QE_STATS_* parameters and resets them */
+void drvQuadEM::doStatsCallbacks()
+{
+    int i;
+
+    if (stats_.count == 0) return;
+    for (i=0; i<QE_MAX_DATA; i++) {
+        setDoubleParam(i, P_StatsMean,  stats_.mean[i]);
+        setDoubleParam(i, P_StatsSigma, sqrt(stats_.m2[i] / stats_.count));
+        setDoubleParam(i, P_StatsMin,   stats_.min[i]);
+        setDoubleParam(i, P_StatsMax,   stats_.max[i]);
+        setDoubleParam(i, P_StatsTotal, stats_.mean[i] * stats_.count);
+        callParamCallbacks(i);
+    }
+    stats_.count = 0;
+}
+
+/** Passes a chunk of samples to spectrumTask().
+  * If spectrumTask() has not kept up the chunk is discarded and the averaging is restarted.
+  * \param[in] values Array of QE_MAX_DATA pointers to the values in QEData_t order.
+  * \param[in] nSamples Number of samples.
+  */
+void drvQuadEM::putSpectrumSamples(epicsFloat64 * const values[QE_MAX_DATA], size_t nSamples)
+{
+    QESample_t *p1, *p2, *pSample;
+    size_t n1, n2;
+    size_t i, j;
+
+    if (spectrumRing_->freeSpace() < nSamples) {
+        spectrumConfig_++;
+    } else {
+        spectrumRing_->reserve(nSamples, &p1, &n1, &p2, &n2);
+        for (j=0; j<nSamples; j++) {
+            pSample = (j < n1) ? &p1[j] : &p2[j-n1];
+            for (i=0; i<QE_MAX_DATA; i++) {
+                pSample->data[i] = values[i][j];
+            }
         }
+        spectrumRing_->commit(nSamples);
     }
+    epicsEventSignal(spectrumEvent_);
+}
+
+/** Creates the spectrum ring buffer and starts spectrumTask() the first time the spectra are enabled */
+asynStatus drvQuadEM::startSpectrum()
+{
+    static const char *functionName = "startSpectrum";
+
+    if (spectrumRing_) return asynSuccess;
+    spectrum_ = new quadEMSpectrum(QE_MAX_DATA);
+    spectrumRing_ = new quadEMRing<QESample_t>(QE_MAX_SPECTRUM_SIZE);
+    spectrumEvent_ = epicsEventCreate(epicsEventEmpty);
+    if (epicsThreadCreate("drvQuadEMSpectrumTask",
+                          epicsThreadPriorityLow,
+                          epicsThreadGetStackSize(epicsThreadStackMedium),
+                          (EPICSTHREADFUNC)::spectrumTaskC,
+                          this) == NULL) {
+        asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
+            "%s::%s epicsThreadCreate failure\n",
+            driverName, functionName);
+        // Delete everything so the next attempt to enable the spectra starts again
+        delete spectrum_;
+        delete spectrumRing_;
+        epicsEventDestroy(spectrumEvent_);
+        spectrum_ = 0;
+        spectrumRing_ = 0;
+        spectrumEvent_ = 0;
+        return asynError;
+    }
+    return asynSuccess;
+}
+
+/** Flushes the ring buffer, discards the samples accumulated for the scalar callbacks and resets the sample times,
+  * as is done when acquisition is started.
+  * Drivers call this with acquisition stopped after changing a driver-specific setting that changes
+  * the SampleTime or NumAverage, so the samples with the old settings are not averaged with the new ones.
+  */
+void drvQuadEM::resetAcquisition()
+{
+    int i;
+
+    flushRing();
+    for (i=0; i<QE_MAX_DATA; i++) {
+        scalarSum_[i] = 0.;
+    }
+    scalarCount_ = 0;
+    resetSampleTimes();
+}
+
+/** Resets the sample timestamps, so the next sample is time 0.  This is called when acquisition is started. */
+void drvQuadEM::resetSampleTimes()
+{
+    sampleTimeValid_ = false;
+    deviceTimeValid_ = false;
+    anchorValid_ = false;
+    nextSampleTime_ = 0.;
+    sampleTimeStep_ = 0.;
+    deviceTimeZero_ = 0.;
+    anchorTime_ = 0.;
+    anchorSample_ = 0;
+    sampleCount_ = 0;
+}
+
+/** Starts the sample timestamps when the first samples after a reset are received.
+  * The time step is initially the SampleTime, and QE_SAMPLE_TIME_ZERO is set to the current time.
+  */
+void drvQuadEM::startSampleTimes()
+{
+    epicsTimeStamp now;
+
+    epicsTimeGetCurrent(&now);
+    setDoubleParam(P_SampleTimeZero, now.secPastEpoch + now.nsec / 1.e9);
+    getDoubleParam(P_SampleTime, &sampleTimeStep_);
+    nextSampleTime_ = 0.;
+    sampleTimeValid_ = true;
+}
+
+/** Converts a device time to a time relative to the first sample.
+  * The first device time that is received is mapped to the time of the next sample.
+  * \param[in] deviceTime The device time in seconds.
+  */
+epicsFloat64 drvQuadEM::relativeDeviceTime(epicsFloat64 deviceTime)
+{
+    if (!sampleTimeValid_) startSampleTimes();
+    if (!deviceTimeValid_) {
+        deviceTimeZero_ = deviceTime - nextSampleTime_;
+        deviceTimeValid_ = true;
+    }
+    return deviceTime - deviceTimeZero_;
+}
+
+/** Drivers call this function before computePositionsBlock() when the device provides a time for the
+  * first sample of the block, for example a time stamp in each packet.
+  * The time step between samples is computed from the times and sample counts of successive calls,
+  * so the times of the other samples are interpolated from the device clock.
+  * This must be called with the lock held.  It does nothing if sample timestamps are not enabled.
+  * \param[in] deviceTime The device time of the next sample in seconds.  The origin can be arbitrary.
+  */
+void drvQuadEM::setDeviceTime(epicsFloat64 deviceTime)
+{
+    epicsFloat64 time;
+
+    if (!sampleTimestamps_) return;
+    time = relativeDeviceTime(deviceTime);
+    if (anchorValid_ && (sampleCount_ > anchorSample_) && (time > anchorTime_)) {
+        sampleTimeStep_ = (time - anchorTime_) / (sampleCount_ - anchorSample_);
+    }
+    anchorTime_ = time;
+    anchorSample_ = sampleCount_;
+    anchorValid_ = true;
+    nextSampleTime_ = time;
+}
+
+/** Does the QE_DOUBLE_DATA and QE_INT_ARRAY_DATA callbacks with the average of the samples
+  * accumulated since the previous call.
+  */
+void drvQuadEM::doScalarCallbacks()
+{
+    int i;
+    epicsFloat64 value;
+    epicsInt32 intData[QE_MAX_DATA];
 
+    if (scalarCount_ < 1) return;
+    setIntegerParam(P_ScalarUpdateSamples, scalarCount_);
     for (i=0; i<QE_MAX_DATA; i++) {
-        intData[i] = (epicsInt32)doubleData[i];
-        setDoubleParam(i, P_DoubleData, doubleData[i]);
+        value = (scalarCount_ == 1) ? scalarSum_[i] : scalarSum_[i] / scalarCount_;
+        intData[i] = (epicsInt32)value;
+        setDoubleParam(i, P_DoubleData, value);
         callParamCallbacks(i);
+        scalarSum_[i] = 0.;
     }
     doCallbacksInt32Array(intData, QE_MAX_DATA, P_IntArrayData, 0);
+    scalarCount_ = 0;
 }
 
 asynStatus drvQuadEM::triggerCallbacks()
 {
-    int status;
+    QEBlock_t block;
     static const char *functionName = "triggerCallbacks";
 
+    if (scalarUpdateMode_ == QEScalarUpdateBlockComplete) {
+        doScalarCallbacks();
+    }
+    doStatsCallbacks();
+
     // If rawCount_ < 1 there is nothing to do.  This can happen if users presses Read when not acquiring
     if (rawCount_ < 1) return asynSuccess;
-    status = epicsMessageQueueSend(msgQId_, &rawCount_, sizeof(rawCount_));
-    if (status) {
+    rawCount_ = 0;
+    memset(&block, 0, sizeof(block));
+    block.epoch = flushEpoch_;
+    block.received = receivedTime_;
+    if (directFill_) {
+        if (!fillArrays_[0] || (fillCount_ < 1)) return asynSuccess;
+        block.numSamples = fillCount_;
+        memcpy(block.pArrays, fillArrays_, sizeof(block.pArrays));
+        // The spare arrays are used for the next block, or new ones are allocated on the next sample
+        memset(fillArrays_, 0, sizeof(fillArrays_));
+        fillCount_ = 0;
+    } else {
+        block.end = sampleRing_->head();
+    }
+    block.queued = epicsMonotonicGet();
+    if (blockRing_->put(&block, 1) != 1) {
         asynPrint(pasynUserSelf, ASYN_TRACE_ERROR, 
-            "%s::%s, error calling epicsMessageQueueSend\n",
+            "%s::%s, error block queue is full\n",
             driverName, functionName);
+        releaseFillArrays(block.pArrays);
+        return asynError;
     }
+    epicsEventSignal(blockEvent_);
+    return asynSuccess;
+}
+
+/** Removes all samples from the ring buffer, or the partly filled arrays in direct fill mode.
+  * Blocks that have already been queued to callbackTask are skipped.
+  */
+void drvQuadEM::flushRing()
+{
+    sampleRing_->flush();
+    releaseFillArrays(fillArrays_);
+    fillCount_ = 0;
+    flushEpoch_++;
     rawCount_ = 0;
-    return (status ? asynError : asynSuccess);
+    stats_.count = 0;
+}
+
+/** Returns the number of samples that the arrays in direct fill mode must hold.
+  * This is NumAverage, or the ring buffer size if NumAverage is 0.
+  */
+int drvQuadEM::fillArraySize()
+{
+    int numAverage;
+
+    getIntegerParam(P_NumAverage, &numAverage);
+    return (numAverage > 0) ? numAverage : ringBufferSize_;
 }
 
+/** Allocates one 1-D NDArray per QEData_t value for direct fill mode, and one for the sample times
+  * if sample timestamps are enabled.
+  * \param[out] pArrays The arrays.  These are all NULL if the allocation fails.
+  * \param[in] size Number of samples in each array.
+  */
+void drvQuadEM::allocFillArrays(NDArray *pArrays[QE_MAX_SAMPLE_VALUES], int size)
+{
+    size_t dims[1];
+    int i;
+    int numArrays = sampleTimestamps_ ? QE_MAX_SAMPLE_VALUES : QE_MAX_DATA;
+    static const char *functionName = "allocFillArrays";
+
+    dims[0] = size;
+    pArrays[QE_SAMPLE_TIME] = 0;
+    for (i=0; i<numArrays; i++) {
+        pArrays[i] = pNDArrayPool->alloc(1, dims, NDFloat64, 0, 0);
+        if (!pArrays[i]) {
+            asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
+                "%s::%s error allocating NDArray\n",
+                driverName, functionName);
+            pArrays[i] = 0;
+            releaseFillArrays(pArrays);
+            return;
+        }
+    }
+}
+
+/** Releases the arrays allocated with allocFillArrays() and sets the pointers to NULL */
+void drvQuadEM::releaseFillArrays(NDArray *pArrays[QE_MAX_SAMPLE_VALUES])
+{
+    int i;
+
+    for (i=0; i<QE_MAX_SAMPLE_VALUES; i++) {
+        if (pArrays[i]) pArrays[i]->release();
+        pArrays[i] = 0;
+    }
+}
+
+/** Does the NDArray callbacks for the oldest numRead samples in the ring buffer.
+  * This is called with the lock held.  The lock is released while the data are copied from the
+  * ring buffer and while the plugins are called, so the threads calling computePositionsBlock()
+  * are not blocked.
+  * \param[in] numRead Number of samples to read from the ring buffer.
+  */
 asynStatus drvQuadEM::doDataCallbacks(int numRead)
 {
+    const QESample_t *p1, *p2;
+    size_t n1, n2;
+    epicsUInt64 tail;
     epicsFloat64 *pIn, *pOut;
-    int sampleSize = QE_MAX_DATA * sizeof(epicsFloat64);
-    int ringSize;
-    int count;
     epicsTimeStamp now;
     epicsFloat64 timeStamp;
     int arrayCounter;
+    int numRows = sampleTimestamps_ ? QE_MAX_SAMPLE_VALUES : QE_MAX_DATA;
+    size_t timeStart;
     int i, j;
     size_t dims[2];
-    NDArray *pArrayAll, *pArraySingle;
+    NDArray *pArrayAll, *pArraySingle[QE_MAX_DATA];
     static const char *functionName = "doDataCallbacks";
     
-    ringSize = epicsRingBytesUsedBytes(ringBuffer_) / sampleSize;
-    if (ringSize < numRead) {
+    if ((int)sampleRing_->used() < numRead) {
         asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
-            "%s::%s: not enough bytes in ring buffer, expecting %d actually %d, rawCount_=%d, ringCount_=%d\n",
-            driverName, functionName, numRead, ringSize, rawCount_, ringCount_);
+            "%s::%s: not enough samples in ring buffer, expecting %d actually %d, rawCount_=%d\n",
+            driverName, functionName, numRead, (int)sampleRing_->used(), rawCount_);
         return asynError;
     }
 
-    dims[0] = QE_MAX_DATA;
+    dims[0] = numRows;
     dims[1] = numRead;
     setIntegerParam(P_NumAveraged, numRead);
 
@@ -335,33 +970,138 @@ asynStatus drvQuadEM::doDataCallbacks(int numRead)
     timeStamp = now.secPastEpoch + now.nsec / 1.e9;
     pArrayAll->timeStamp = timeStamp;
     getAttributes(pArrayAll->pAttributeList);
+    dims[0] = numRead;
+    for (i=0; i<QE_MAX_DATA; i++) {
+        pArraySingle[i] = pNDArrayPool->alloc(1, dims, NDFloat64, 0, 0);
+        pArraySingle[i]->uniqueId = arrayCounter;
+        pArraySingle[i]->timeStamp = timeStamp;
+        getAttributes(pArraySingle[i]->pAttributeList);
+    }
+    unlock();
 
-    count = epicsRingBytesGet(ringBuffer_, (char *)pArrayAll->pData, numRead * sampleSize);
-    if (count != numRead * sampleSize) {
+    sampleRing_->peek(numRead, &p1, &n1, &p2, &n2, &tail);
+    if (numRows == QE_MAX_DATA) {
+        memcpy(pArrayAll->pData, p1, n1 * sizeof(QESample_t));
+        memcpy((QESample_t *)pArrayAll->pData + n1, p2, n2 * sizeof(QESample_t));
+    } else {
+        // Append the time to each sample
+        pOut = (epicsFloat64 *)pArrayAll->pData;
+        timeStart = (size_t)(tail % ringBufferSize_);
+        for (j=0; j<numRead; j++) {
+            memcpy(pOut, ((size_t)j < n1) ? &p1[j] : &p2[j-n1], sizeof(QESample_t));
+            pOut[QE_SAMPLE_TIME] = sampleTimes_[(timeStart + j) % ringBufferSize_];
+            pOut += numRows;
+        }
+    }
+    if (!sampleRing_->release(numRead, tail)) {
+        // Samples were dropped by computePositionsBlock while we were copying them, so they may have been overwritten
         asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
-            "%s::%s ring read failed\n",
-            driverName, functionName);
+            "%s::%s ring buffer overflow while reading, discarding %d samples\n",
+            driverName, functionName, numRead);
+        sampleRing_->releaseTo(tail + numRead);
+        pArrayAll->release();
+        for (i=0; i<QE_MAX_DATA; i++) {
+            pArraySingle[i]->release();
+        }
+        lock();
         return asynError;
     }
-    ringCount_ -= numRead;
     doCallbacksGenericPointer(pArrayAll, NDArrayData, QE_MAX_DATA);
     // Copy data to arrays for each type of data, do callbacks on that.
-    dims[0] = numRead;
     for (i=0; i<QE_MAX_DATA; i++) {
-        pArraySingle = pNDArrayPool->alloc(1, dims, NDFloat64, 0, 0);
-        pArraySingle->uniqueId = arrayCounter;
-        pArraySingle->timeStamp = timeStamp;
-        getAttributes(pArraySingle->pAttributeList);
         pIn = (epicsFloat64 *)pArrayAll->pData;
-        pOut = (epicsFloat64 *)pArraySingle->pData;
+        pOut = (epicsFloat64 *)pArraySingle[i]->pData;
         for (j=0; j<numRead; j++) {
             pOut[j] = pIn[i];
-            pIn += QE_MAX_DATA;
+            pIn += numRows;
         }
-        doCallbacksGenericPointer(pArraySingle, NDArrayData, i);
-        pArraySingle->release();
+        doCallbacksGenericPointer(pArraySingle[i], NDArrayData, i);
+        pArraySingle[i]->release();
     }   
     pArrayAll->release();
+    lock();
+    callParamCallbacks();
+    setIntegerParam(P_RingOverflows, 0);
+    callParamCallbacks();
+    return asynSuccess;
+}
+
+/** Does the NDArray callbacks for a block of samples that were written directly into NDArrays.
+  * This is called with the lock held.  The lock is released while the [QE_MAX_DATA, N] array is
+  * built and while the plugins are called.
+  * \param[in] pBlock The block.  The arrays in the block are released.
+  */
+asynStatus drvQuadEM::doDirectCallbacks(QEBlock_t *pBlock)
+{
+    epicsFloat64 *pOut;
+    const epicsFloat64 *pIn[QE_MAX_SAMPLE_VALUES];
+    epicsTimeStamp now;
+    epicsFloat64 timeStamp;
+    int arrayCounter;
+    int numRead = pBlock->numSamples;
+    int numRows = pBlock->pArrays[QE_SAMPLE_TIME] ? QE_MAX_SAMPLE_VALUES : QE_MAX_DATA;
+    int i, j, k, jMax;
+    size_t dims[2];
+    NDArray *pArrayAll;
+    static const char *functionName = "doDirectCallbacks";
+    // Number of samples per pass of the transpose, chosen so the output fits in the L1 cache
+    const int transposeBlock = 64;
+
+    dims[0] = numRows;
+    dims[1] = numRead;
+    setIntegerParam(P_NumAveraged, numRead);
+
+    epicsTimeGetCurrent(&now);
+    getIntegerParam(NDArrayCounter, &arrayCounter);
+    arrayCounter++;
+    setIntegerParam(NDArrayCounter, arrayCounter);
+    timeStamp = now.secPastEpoch + now.nsec / 1.e9;
+
+    pArrayAll = pNDArrayPool->alloc(2, dims, NDFloat64, 0, 0);
+    if (!pArrayAll) {
+        asynPrint(pasynUserSelf, ASYN_TRACE_ERROR,
+            "%s::%s error allocating NDArray\n",
+            driverName, functionName);
+        releaseFillArrays(pBlock->pArrays);
+        return asynError;
+    }
+    pArrayAll->uniqueId = arrayCounter;
+    pArrayAll->timeStamp = timeStamp;
+    getAttributes(pArrayAll->pAttributeList);
+    for (i=0; i<QE_MAX_DATA; i++) {
+        // The arrays can be larger than the number of samples when NumAverage=0
+        pBlock->pArrays[i]->dims[0].size = numRead;
+        pBlock->pArrays[i]->uniqueId = arrayCounter;
+        pBlock->pArrays[i]->timeStamp = timeStamp;
+        getAttributes(pBlock->pArrays[i]->pAttributeList);
+        pIn[i] = (const epicsFloat64 *)pBlock->pArrays[i]->pData;
+    }
+    if (numRows > QE_MAX_DATA) {
+        pIn[QE_SAMPLE_TIME] = (const epicsFloat64 *)pBlock->pArrays[QE_SAMPLE_TIME]->pData;
+    }
+    unlock();
+
+    // Build the [numRows, numRead] array with a blocked transpose of the per-value arrays
+    pOut = (epicsFloat64 *)pArrayAll->pData;
+    for (j=0; j<numRead; j+=transposeBlock) {
+        jMax = (j + transposeBlock < numRead) ? j + transposeBlock : numRead;
+        for (i=0; i<numRows; i++) {
+            for (k=j; k<jMax; k++) {
+                pOut[k*numRows + i] = pIn[i][k];
+            }
+        }
+    }
+    doCallbacksGenericPointer(pArrayAll, NDArrayData, QE_MAX_DATA);
+    pArrayAll->release();
+    for (i=0; i<QE_MAX_DATA; i++) {
+        doCallbacksGenericPointer(pBlock->pArrays[i], NDArrayData, i);
+    }
+    releaseFillArrays(pBlock->pArrays);
+    lock();
+    // Allocate the arrays for the next block now, so computePositionsBlock does not need to
+    if (directFill_ && !spareArrays_[0]) {
+        allocFillArrays(spareArrays_, fillArraySize());
+    }
     callParamCallbacks();
     setIntegerParam(P_RingOverflows, 0);
     callParamCallbacks();
@@ -373,42 +1113,225 @@ void drvQuadEM::callbackTask()
     int numAcquire;
     int acquireMode;
     int numRead;
-    int readSize = sizeof(numRead);
-    int status;
-    static const char *functionName = "callbackTask";
+    bool direct;
+    QEBlock_t block;
+    epicsUInt64 tail;
+    epicsUInt64 start, end;
     
     lock();
     while (1) {
         unlock();
-        status = epicsMessageQueueReceive(msgQId_, &numRead, readSize);
+        epicsEventWaitWithTimeout(blockEvent_, QE_LATENCY_UPDATE_PERIOD);
         lock();
-        if (status != readSize) {
-            asynPrint(pasynUserSelf, ASYN_TRACE_ERROR, 
-                "%s::%s error calling epicsMessageQueueReceive expected %d bytes, actual=%d\n",
-                driverName, functionName, readSize, status);
-            continue;
-        } 
-        getIntegerParam(P_AcquireMode, &acquireMode);
-        getIntegerParam(P_NumAcquire, &numAcquire);
-        if (acquireMode == QEAcquireModeSingle) numAcquire = 1;
-
-        if (acquireMode == QEAcquireModeContinuous) {
-            doDataCallbacks(numRead);
-            numAcquired_++;
-            setIntegerParam(P_NumAcquired, numAcquired_);
-        } 
-        else {
-            if (numAcquired_ < numAcquire) {
-                doDataCallbacks(numRead);
+        if ((epicsMonotonicGet() - lastLatencyUpdate_) * 1e-9 >= QE_LATENCY_UPDATE_PERIOD) {
+            doLatencyCallbacks();
+        }
+        while (blockRing_->get(&block, 1) == 1) {
+            direct = (block.pArrays[0] != 0);
+            if (direct) {
+                // Skip blocks that were queued before a flush
+                if (block.epoch != flushEpoch_) {
+                    releaseFillArrays(block.pArrays);
+                    continue;
+                }
+                numRead = block.numSamples;
+            } else {
+                // The block starts at the oldest sample in the ring buffer.
+                // If the ring buffer was flushed, or all of the samples were dropped, there is nothing to do.
+                tail = sampleRing_->tail();
+                if (block.end <= tail) continue;
+                numRead = (int)(block.end - tail);
+            }
+            getIntegerParam(P_AcquireMode, &acquireMode);
+            getIntegerParam(P_NumAcquire, &numAcquire);
+            if (acquireMode == QEAcquireModeSingle) numAcquire = 1;
+
+            if ((acquireMode == QEAcquireModeContinuous) || (numAcquired_ < numAcquire)) {
+                start = epicsMonotonicGet();
+                latency_[QELatencyQueue].add(start - block.queued);
+                if (direct) {
+                    doDirectCallbacks(&block);
+                } else {
+                    doDataCallbacks(numRead);
+                }
+                end = epicsMonotonicGet();
+                latency_[QELatencyCallbacks].add(end - start);
+                if (block.received != 0) latency_[QELatencyTotal].add(end - block.received);
+                blocksDone_++;
                 numAcquired_++;
                 setIntegerParam(P_NumAcquired, numAcquired_);
-                if (numAcquired_ == numAcquire) {
+                if ((acquireMode != QEAcquireModeContinuous) && (numAcquired_ == numAcquire)) {
                     setAcquire(0);
                     setIntegerParam(ADAcquire, 0);
                 }
+            } 
+            else if (direct) {
+                releaseFillArrays(block.pArrays);
+            }
+            else {
+                sampleRing_->releaseTo(block.end);
             }
+            callParamCallbacks();
         }
-        callParamCallbacks();
+    }
+}
+
+/** Updates the latency and rate parameters.  This is called by callbackTask() every QE_LATENCY_UPDATE_PERIOD seconds
+  * with the lock held.  The rates are the number of samples received and blocks processed per second since
+  * the previous call.
+  */
+void drvQuadEM::doLatencyCallbacks()
+{
+    int i, j;
+    epicsUInt64 now = epicsMonotonicGet();
+    epicsUInt64 count;
+    epicsInt32 histogram[QE_LATENCY_BINS];
+    double elapsed;
+
+    elapsed = (now - lastLatencyUpdate_) * 1e-9;
+    if (elapsed > 0.) {
+        setDoubleParam(P_SampleRate, (samplesReceived_ - lastSamplesReceived_) / elapsed);
+        setDoubleParam(P_BlockRate, (blocksDone_ - lastBlocksDone_) / elapsed);
+    }
+    lastLatencyUpdate_ = now;
+    lastSamplesReceived_ = samplesReceived_;
+    lastBlocksDone_ = blocksDone_;
+    for (i=0; i<QE_LATENCY_STAGES; i++) {
+        setDoubleParam(i, P_LatencyMean, latency_[i].mean());
+        setDoubleParam(i, P_LatencyMax, latency_[i].max());
+        for (j=0; j<QE_LATENCY_BINS; j++) {
+            count = latency_[i].bin(j);
+            histogram[j] = (count > 0x7fffffff) ? 0x7fffffff : (epicsInt32)count;
+        }
+        doCallbacksInt32Array(histogram, QE_LATENCY_BINS, P_LatencyHistogram, i);
+        callParamCallbacks(i);
+    }
+}
+
+/** Resets the latency histograms of all stages of the data path and updates the latency parameters */
+/** Records the ReadPeriod latency stage.  Drivers call this with the lock held once for each read from the device
+  * that returned data, before the samples of that read are passed to computePositionsBlock(), which can be called
+  * several times for one read.
+  */
+void drvQuadEM::readComplete()
+{
+    epicsUInt64 now = epicsMonotonicGet();
+
+    if (readTime_ != 0) latency_[QELatencyReadPeriod].add(now - readTime_);
+    readTime_ = now;
+}
+
+void drvQuadEM::resetLatency()
+{
+    int i;
+
+    for (i=0; i<QE_LATENCY_STAGES; i++) {
+        latency_[i].reset();
+    }
+    doLatencyCallbacks();
+}
+
+/** Report parameters
+  * \param[in] fp The file pointer to write to
+  * \param[in] details The level of detail requested
+  */
+void drvQuadEM::report(FILE *fp, int details)
+{
+    static const char *stageNames[QE_LATENCY_STAGES] = {"ReadPeriod", "Compute", "Queue", "Callbacks", "Total"};
+    int i, j;
+    epicsUInt64 count;
+
+    fprintf(fp, "%s: port=%s, kernel=%s, ring buffer size=%d, samples in ring=%d\n",
+            driverName, portName, kernel_->name, ringBufferSize_, (int)sampleRing_->used());
+    fprintf(fp, "  Samples received=%llu, blocks processed=%llu\n",
+            (unsigned long long)samplesReceived_, (unsigned long long)blocksDone_);
+    fprintf(fp, "  Stage            Count     Mean (us)      Max (us)\n");
+    for (i=0; i<QE_LATENCY_STAGES; i++) {
+        fprintf(fp, "  %-10s %11llu %13.2f %13.2f\n", stageNames[i],
+                (unsigned long long)latency_[i].count(), latency_[i].mean(), latency_[i].max());
+    }
+    if (details > 1) {
+        fprintf(fp, "  Latency histograms, microseconds\n");
+        for (i=0; i<QE_LATENCY_STAGES; i++) {
+            fprintf(fp, "    %s\n", stageNames[i]);
+            for (j=0; j<QE_LATENCY_BINS; j++) {
+                count = latency_[i].bin(j);
+                if (count == 0) continue;
+                if (j == 0) {
+                    fprintf(fp, "      %16s %11llu\n", "< 1", (unsigned long long)count);
+                } else if (j == QE_LATENCY_BINS-1) {
+                    fprintf(fp, "      >= %-13u %11llu\n", 1u << (j-1), (unsigned long long)count);
+                } else {
+                    fprintf(fp, "      %7u-%-8u %11llu\n", 1u << (j-1), 1u << j, (unsigned long long)count);
+                }
+            }
+        }
+    }
+    asynNDArrayDriver::report(fp, details);
+}
+
+/** Computes the spectra of the samples that computePositionsBlock() passes in spectrumRing_,
+  * and does the QE_SPECTRUM callbacks each time an averaged spectrum is complete.
+  * The samples are read and the spectra are computed without holding the lock.
+  */
+void drvQuadEM::spectrumTask()
+{
+    QESample_t *buffer;
+    size_t numRead;
+    int config = -1;
+    int fftSize, window, numAverage, count, i;
+    epicsFloat64 overlap, sampleTime, lastSampleTime = 0.;
+    epicsFloat64 *freq = 0;
+    epicsFloat64 *zeros = 0;
+
+    buffer = (QESample_t *)calloc(QE_MAX_BLOCK_SIZE, sizeof(QESample_t));
+    lock();
+    while (1) {
+        unlock();
+        epicsEventWait(spectrumEvent_);
+        lock();
+        getDoubleParam(P_SampleTime, &sampleTime);
+        if ((config != spectrumConfig_) || (sampleTime != lastSampleTime)) {
+            // A parameter changed or there was a gap in the samples, restart the averaging
+            config = spectrumConfig_;
+            lastSampleTime = sampleTime;
+            getIntegerParam(P_SpectrumSize, &fftSize);
+            getIntegerParam(P_SpectrumWindow, &window);
+            getDoubleParam(P_SpectrumOverlap, &overlap);
+            getIntegerParam(P_SpectrumNumAverage, &numAverage);
+            spectrum_->configure(fftSize, window, overlap, numAverage);
+            setIntegerParam(P_SpectrumSize, spectrum_->fftSize());
+            freq = (epicsFloat64 *)realloc(freq, spectrum_->spectrumSize() * sizeof(epicsFloat64));
+            for (i=0; i<spectrum_->spectrumSize(); i++) {
+                freq[i] = (sampleTime > 0.) ? i / (spectrum_->fftSize() * sampleTime) : i;
+            }
+            doCallbacksFloat64Array(freq, spectrum_->spectrumSize(), P_SpectrumFreq, 0);
+            // Clear the spectra, which are for the old parameters or for the samples before the gap
+            zeros = (epicsFloat64 *)realloc(zeros, spectrum_->spectrumSize() * sizeof(epicsFloat64));
+            memset(zeros, 0, spectrum_->spectrumSize() * sizeof(epicsFloat64));
+            for (i=0; i<QE_MAX_DATA; i++) {
+                doCallbacksFloat64Array(zeros, spectrum_->spectrumSize(), P_Spectrum, i);
+            }
+            callParamCallbacks();
+        }
+        unlock();
+        while ((numRead = spectrumRing_->get(buffer, QE_MAX_BLOCK_SIZE)) > 0) {
+            if (!spectrum_->addSamples(buffer[0].data, numRead, QE_MAX_DATA)) continue;
+            lock();
+            if (config != spectrumConfig_) {
+                // Samples were discarded or a parameter changed while this spectrum was averaged, so it is not
+                // published.  The averaging is restarted above.
+                break;
+            }
+            for (i=0; i<QE_MAX_DATA; i++) {
+                doCallbacksFloat64Array((epicsFloat64 *)spectrum_->getSpectrum(i), spectrum_->spectrumSize(), P_Spectrum, i);
+            }
+            getIntegerParam(P_SpectrumCount, &count);
+            setIntegerParam(P_SpectrumCount, count+1);
+            callParamCallbacks();
+            unlock();
+        }
+        if (numRead == 0) lock();
     }
 }
 
@@ -433,9 +1356,7 @@ asynStatus drvQuadEM::writeInt32(asynUser *pasynUser, epicsInt32 value)
 
     if (function == ADAcquire) {
         if (value) {
-            epicsRingBytesFlush(ringBuffer_);
-            ringCount_ = 0;
-            rawCount_ = 0;
+            resetAcquisition();
         }
         status |= setAcquire(value);
     } 
@@ -478,6 +1399,51 @@ asynStatus drvQuadEM::writeInt32(asynUser *pasynUser, epicsInt32 value)
     else if (function == P_ReadData) {
         status |= triggerCallbacks();
     }
+    else if (function == P_Geometry) {
+        updateProcessConfig();
+    }
+    else if (function == P_ScalarUpdateMode) {
+        scalarUpdateMode_ = value;
+        doScalarCallbacks();
+    }
+    else if (function == P_ScalarUpdateN) {
+        scalarUpdateN_ = (value > 0) ? value : 1;
+    }
+    else if (function == P_DirectFill) {
+        flushRing();
+        directFill_ = value;
+        if (!directFill_) releaseFillArrays(spareArrays_);
+    }
+    else if (function == P_SpectrumEnable) {
+        if (value && (startSpectrum() != asynSuccess)) {
+            // The spectra cannot be computed, so they stay disabled
+            status = asynError;
+            value = 0;
+            setIntegerParam(P_SpectrumEnable, 0);
+        }
+        if (value) {
+            spectrumRing_->flush();
+            spectrumConfig_++;
+        }
+        spectrumEnable_ = value;
+    }
+    else if ((function == P_SpectrumSize) || (function == P_SpectrumWindow) || (function == P_SpectrumNumAverage)) {
+        spectrumConfig_++;
+    }
+    else if (function == P_LatencyReset) {
+        resetLatency();
+    }
+    else if (function == P_ComputeStats) {
+        computeStats_ = value;
+        stats_.count = 0;
+    }
+    else if (function == P_SampleTimestamps) {
+        // The arrays and ring buffer contents have the wrong format after this changes
+        flushRing();
+        releaseFillArrays(spareArrays_);
+        sampleTimestamps_ = value;
+        resetSampleTimes();
+    }
     else if (function == P_Resolution) {
         status |= setResolution(value);
         status |= readStatus();
@@ -550,9 +1516,7 @@ asynStatus drvQuadEM::writeFloat64(asynUser *pasynUser, epicsFloat64 value)
 
     if (function == P_AveragingTime) {
         status |= setAveragingTime(value);
-        epicsRingBytesFlush(ringBuffer_);
-        ringCount_ = 0;
-        rawCount_ = 0;
+        flushRing();
         status |= readStatus();
     }
     else if (function == P_BiasVoltage) {
@@ -563,6 +1527,19 @@ asynStatus drvQuadEM::writeFloat64(asynUser *pasynUser, epicsFloat64 value)
         status |= setIntegrationTime(value);
         status |= readStatus();
     } 
+    else if (function == P_SpectrumOverlap) {
+        spectrumConfig_++;
+    }
+    else if (function == P_ScalarUpdateRate) {
+        scalarUpdatePeriod_ = (value > 0.) ? 1./value : 0.;
+        doScalarCallbacks();
+    }
+    else if ((function == P_CurrentOffset)  || (function == P_CurrentScale)  ||
+             (function == P_PositionOffset) || (function == P_PositionScale) ||
+             (function == P_WeightXsum)     || (function == P_WeightYsum)    ||
+             (function == P_WeightXdelta)   || (function == P_WeightYdelta)) {
+        updateProcessConfig();
+    }
     else {
         /* All other parameters just get set in parameter list, no need to
          * act on them here */
@@ -9,10 +9,15 @@
  */
 
 #include <epicsExit.h>
-#include <epicsRingBytes.h>
-#include <epicsMessageQueue.h>
+#include <epicsEvent.h>
+#include <epicsMutex.h>
+#include <epicsTime.h>
 #include <shareLib.h>
 #include "asynNDArrayDriver.h"
+#include "quadEMKernel.h"
+#include "quadEMLatency.h"
+#include "quadEMRing.h"
+#include "quadEMSpectrum.h"
 
 /* These are the drvInfo strings that are used to identify the parameters.
  * They are used by asyn clients, including standard asyn device support */
@@ -56,6 +61,33 @@
 #define P_NumAcquiredString        "QE_NUM_ACQUIRED"            /* asynInt32,    r/o */
 #define P_ModelString              "QE_MODEL"                   /* asynInt32,    r/w */
 #define P_FirmwareString           "QE_FIRMWARE"                /* asynOctet,    r/w */
+#define P_DirectFillString         "QE_DIRECT_FILL"             /* asynInt32,    r/w */
+#define P_ScalarUpdateModeString   "QE_SCALAR_UPDATE_MODE"      /* asynInt32,    r/w */
+#define P_ScalarUpdateNString      "QE_SCALAR_UPDATE_N"         /* asynInt32,    r/w */
+#define P_ScalarUpdateRateString   "QE_SCALAR_UPDATE_RATE"      /* asynFloat64,  r/w */
+#define P_ScalarUpdateSamplesString "QE_SCALAR_UPDATE_SAMPLES"  /* asynInt32,    r/o */
+#define P_SampleTimestampsString   "QE_SAMPLE_TIMESTAMPS"       /* asynInt32,    r/w */
+#define P_SampleTimeZeroString     "QE_SAMPLE_TIME_ZERO"        /* asynFloat64,  r/o */
+#define P_ComputeStatsString       "QE_COMPUTE_STATS"           /* asynInt32,    r/w */
+#define P_StatsMeanString          "QE_STATS_MEAN"              /* asynFloat64,  r/o */
+#define P_StatsSigmaString         "QE_STATS_SIGMA"             /* asynFloat64,  r/o */
+#define P_StatsMinString           "QE_STATS_MIN"               /* asynFloat64,  r/o */
+#define P_StatsMaxString           "QE_STATS_MAX"               /* asynFloat64,  r/o */
+#define P_StatsTotalString         "QE_STATS_TOTAL"             /* asynFloat64,  r/o */
+#define P_SpectrumEnableString     "QE_SPECTRUM_ENABLE"         /* asynInt32,    r/w */
+#define P_SpectrumSizeString       "QE_SPECTRUM_SIZE"           /* asynInt32,    r/w */
+#define P_SpectrumWindowString     "QE_SPECTRUM_WINDOW"         /* asynInt32,    r/w */
+#define P_SpectrumOverlapString    "QE_SPECTRUM_OVERLAP"        /* asynFloat64,  r/w */
+#define P_SpectrumNumAverageString "QE_SPECTRUM_NUM_AVERAGE"    /* asynInt32,    r/w */
+#define P_SpectrumString           "QE_SPECTRUM"                /* asynFloat64Array, r/o */
+#define P_SpectrumFreqString       "QE_SPECTRUM_FREQ"           /* asynFloat64Array, r/o */
+#define P_SpectrumCountString      "QE_SPECTRUM_COUNT"          /* asynInt32,    r/o */
+#define P_LatencyMeanString        "QE_LATENCY_MEAN"            /* asynFloat64,  r/o */
+#define P_LatencyMaxString         "QE_LATENCY_MAX"             /* asynFloat64,  r/o */
+#define P_LatencyHistogramString   "QE_LATENCY_HISTOGRAM"       /* asynInt32Array, r/o */
+#define P_LatencyResetString       "QE_LATENCY_RESET"           /* asynInt32,    r/w */
+#define P_SampleRateString         "QE_SAMPLE_RATE"             /* asynFloat64,  r/o */
+#define P_BlockRateString          "QE_BLOCK_RATE"              /* asynFloat64,  r/o */
 
 
 /* Models */
@@ -123,6 +155,29 @@ typedef enum {
 } QETriggerPolarity_t;
 
 
+/* Scalar update modes for QE_DOUBLE_DATA and QE_INT_ARRAY_DATA callbacks */
+typedef enum {
+    QEScalarUpdateEverySample,
+    QEScalarUpdateEveryN,
+    QEScalarUpdateMaxRate,
+    QEScalarUpdateBlockComplete
+} QEScalarUpdateMode_t;
+
+
+/* Stages of the data path for which the latency is measured.  These are the addresses of the latency parameters. */
+typedef enum {
+    QELatencyReadPeriod,  // Time between successive reads from the device, recorded by readComplete()
+    QELatencyCompute,     // computePositionsBlock() for each chunk of samples, including triggerCallbacks()
+    QELatencyQueue,       // From when triggerCallbacks() queues a block to when callbackTask() starts it
+    QELatencyCallbacks,   // doDataCallbacks() or doDirectCallbacks() for each block
+    QELatencyTotal        // From when the last sample of a block was received to when its callbacks are complete
+} QELatencyStage_t;
+
+#define QE_LATENCY_STAGES (QELatencyTotal+1)
+// Period in seconds at which callbackTask() updates the latency and rate parameters
+#define QE_LATENCY_UPDATE_PERIOD 1.0
+
+
 /* Read format */
 typedef enum {
     QEReadFormatBinary,
@@ -131,8 +186,76 @@ typedef enum {
 
 
 #define QE_MAX_DATA (QEPositionY+1)
+// When sample timestamps are enabled the time of each sample is an extra row after the QEData_t values
+#define QE_SAMPLE_TIME QE_MAX_DATA
+#define QE_MAX_SAMPLE_VALUES (QE_SAMPLE_TIME+1)
 #define QE_MAX_INPUTS 4
 #define QE_DEFAULT_RING_BUFFER_SIZE 2048
+// Maximum number of samples that computePositionsBlock() processes with a single ring buffer put
+#define QE_MAX_BLOCK_SIZE 256
+// Maximum time that setAcquire() waits for the read thread to signal a change of readingActive_ before it checks the
+// flag again.  More than one thread can be waiting, and the read thread only signals once per change.
+#define QE_READING_ACTIVE_WAIT 0.01
+
+/** One sample in the ring buffer, the QE_MAX_DATA values in QEData_t order */
+typedef struct {
+    epicsFloat64 data[QE_MAX_DATA];
+} QESample_t;
+
+/** A block of samples that is ready for callbackTask() to do the NDArray callbacks.
+  * In ring buffer mode the samples are in the ring buffer, and end is the sample number after the last sample.
+  * In direct fill mode pArrays contains one NDArray per QEData_t value that has already been filled
+  * with numSamples samples, and epoch is used to discard blocks that were queued before a flush.
+  * pArrays[QE_SAMPLE_TIME] contains the sample times if sample timestamps are enabled, else it is NULL.
+  * received and queued are the epicsMonotonicGet() times when the last sample was received and the block was queued. */
+typedef struct {
+    epicsUInt64 end;
+    epicsUInt64 received;
+    epicsUInt64 queued;
+    int epoch;
+    int numSamples;
+    NDArray *pArrays[QE_MAX_SAMPLE_VALUES];
+} QEBlock_t;
+
+/** Statistics of each QEData_t value for the samples in the current block.
+  * The mean and sum of squared deviations (m2) are updated once per chunk of samples with
+  * Welford's method, so the variance is accurate even when the mean is large. */
+typedef struct {
+    epicsUInt64 count;
+    epicsFloat64 mean[QE_MAX_DATA];
+    epicsFloat64 m2[QE_MAX_DATA];
+    epicsFloat64 min[QE_MAX_DATA];
+    epicsFloat64 max[QE_MAX_DATA];
+} QEStats_t;
+
+/** Calibration and geometry values used to compute the sums, differences and positions.
+  * This is rebuilt by drvQuadEM::updateProcessConfig() whenever one of the parameters changes,
+  * so that the fast data path does not need to read the parameter library.
+  * version is incremented each time the structure is rebuilt. */
+typedef struct {
+    int version;
+    int geometry;
+    epicsFloat64 customWeights[QE_KERNEL_WEIGHTS][QE_MAX_INPUTS];
+    QEKernelParams_t kernel;
+} QEProcessConfig_t;
+
+// Maximum number of listeners that can be registered with drvQuadEM::addListener()
+#define QE_MAX_LISTENERS 8
+
+/** Interface for code in the IOC that needs every sample with the minimum latency, for example a fast feedback loop.
+  * Listeners are registered with drvQuadEM::addListener().  samplesComputed() is called from the thread that reads
+  * the device immediately after each chunk of samples has been computed, with the driver lock held.
+  * It must be short because it delays the data path and every other thread that needs the lock,
+  * and must not call any drvQuadEM methods, including addListener() and removeListener(). */
+class epicsShareClass quadEMListener {
+public:
+    virtual ~quadEMListener() {}
+    /** Called for each chunk of up to QE_MAX_BLOCK_SIZE samples.
+      * \param[in] pSamples The samples.  These are only valid until samplesComputed() returns.
+      * \param[in] nSamples The number of samples.
+      * \param[in] received The epicsMonotonicGet() time when the driver started to compute this chunk. */
+    virtual void samplesComputed(const QESample_t *pSamples, size_t nSamples, epicsUInt64 received) = 0;
+};
 
 /** Base class to control the quad electrometer */
 class epicsShareClass drvQuadEM : public asynNDArrayDriver {
@@ -143,7 +266,11 @@ public:
     virtual asynStatus writeInt32(asynUser *pasynUser, epicsInt32 value);
     virtual asynStatus writeFloat64(asynUser *pasynUser, epicsFloat64 value);
     virtual void exitHandler();
+    virtual void report(FILE *fp, int details);
     void callbackTask();
+    void spectrumTask();
+    asynStatus addListener(quadEMListener *pListener);
+    asynStatus removeListener(quadEMListener *pListener);
 
 protected:
     /** Values used for pasynUser->reason, and indexes into the parameter library. */
@@ -188,6 +315,33 @@ protected:
     int P_NumAcquired;
     int P_Model;
     int P_Firmware;
+    int P_DirectFill;
+    int P_ScalarUpdateMode;
+    int P_ScalarUpdateN;
+    int P_ScalarUpdateRate;
+    int P_ScalarUpdateSamples;
+    int P_SampleTimestamps;
+    int P_SampleTimeZero;
+    int P_ComputeStats;
+    int P_StatsMean;
+    int P_StatsSigma;
+    int P_StatsMin;
+    int P_StatsMax;
+    int P_StatsTotal;
+    int P_SpectrumEnable;
+    int P_SpectrumSize;
+    int P_SpectrumWindow;
+    int P_SpectrumOverlap;
+    int P_SpectrumNumAverage;
+    int P_Spectrum;
+    int P_SpectrumFreq;
+    int P_SpectrumCount;
+    int P_LatencyMean;
+    int P_LatencyMax;
+    int P_LatencyHistogram;
+    int P_LatencyReset;
+    int P_SampleRate;
+    int P_BlockRate;
     // We cache these values so we don't need to call getIntegerParam inside the
     // fast data reading loop
     int resolution_;
@@ -197,6 +351,9 @@ protected:
     int numAcquired_;
 
     void computePositions(epicsFloat64 raw[QE_MAX_INPUTS]);
+    void computePositionsBlock(const epicsFloat64 *raw, size_t nSamples, size_t stride=QE_MAX_INPUTS, int timeIndex=-1);
+    void setDeviceTime(epicsFloat64 deviceTime);
+    void updateProcessConfig();
     virtual asynStatus readStatus()=0;
     virtual asynStatus reset()=0;
     virtual asynStatus setAcquire(epicsInt32 value);
@@ -217,12 +374,98 @@ protected:
     virtual asynStatus setTriggerPolarity(epicsInt32 value);
     virtual asynStatus setValuesPerRead(epicsInt32 value);
     virtual asynStatus triggerCallbacks();
+    void resetLatency();
+    void resetAcquisition();
+    void readComplete();
+    /** Returns the latency histogram of a stage of the data path, QELatencyStage_t */
+    const quadEMLatency& latency(int stage) const { return latency_[stage]; }
     
 private:
     virtual asynStatus doDataCallbacks(int numRead);
-    int ringCount_;
+    asynStatus doDirectCallbacks(QEBlock_t *pBlock);
+    void flushRing();
+    void doScalarCallbacks();
+    void accumulateStats(epicsFloat64 * const values[QE_MAX_DATA], size_t nSamples);
+    void doStatsCallbacks();
+    void putSpectrumSamples(epicsFloat64 * const values[QE_MAX_DATA], size_t nSamples);
+    asynStatus startSpectrum();
+    int fillArraySize();
+    void allocFillArrays(NDArray *pArrays[QE_MAX_SAMPLE_VALUES], int size);
+    void releaseFillArrays(NDArray *pArrays[QE_MAX_SAMPLE_VALUES]);
+    void resetSampleTimes();
+    void startSampleTimes();
+    epicsFloat64 relativeDeviceTime(epicsFloat64 deviceTime);
+    void callListeners(size_t nSamples, epicsUInt64 received);
+    void doLatencyCallbacks();
     int rawCount_;
-    epicsRingBytesId ringBuffer_;
-    epicsMessageQueueId msgQId_;
+    int ringBufferSize_;
+    epicsFloat64 *blockIn_[QE_MAX_INPUTS];
+    epicsFloat64 *blockOut_[QE_MAX_DATA];
+    const QEKernel_t *kernel_;
+    QEProcessConfig_t processConfig_;
+    // Samples are passed from the threads that call computePositionsBlock() to callbackTask() in sampleRing_.
+    // Each block to be averaged is passed in blockRing_.
+    quadEMRing<QESample_t> *sampleRing_;
+    quadEMRing<QEBlock_t> *blockRing_;
+    epicsEventId blockEvent_;
+    int flushEpoch_;
+    // In direct fill mode samples are written into fillArrays_, one NDArray per QEData_t value.
+    // spareArrays_ are allocated by callbackTask() so they are ready when fillArrays_ are complete.
+    int directFill_;
+    NDArray *fillArrays_[QE_MAX_SAMPLE_VALUES];
+    NDArray *spareArrays_[QE_MAX_SAMPLE_VALUES];
+    int fillCount_;
+    // The scalar QE_DOUBLE_DATA and QE_INT_ARRAY_DATA callbacks are done with the average of the
+    // samples accumulated since the previous callback
+    int scalarUpdateMode_;
+    int scalarUpdateN_;
+    double scalarUpdatePeriod_;
+    epicsFloat64 scalarSum_[QE_MAX_DATA];
+    int scalarCount_;
+    // Sample timestamps, in seconds relative to the first sample after acquisition was started.
+    // In ring buffer mode sampleTimes_[n % ringBufferSize_] is the time of sample number n in sampleRing_.
+    // The times come from the device clock if the driver provides it, else from the SampleTime.
+    // Device times are interpolated linearly between the anchors passed to setDeviceTime().
+    int sampleTimestamps_;
+    epicsFloat64 *sampleTimes_;
+    bool sampleTimeValid_;
+    epicsFloat64 nextSampleTime_;
+    epicsFloat64 sampleTimeStep_;
+    bool deviceTimeValid_;
+    epicsFloat64 deviceTimeZero_;
+    bool anchorValid_;
+    epicsFloat64 anchorTime_;
+    epicsUInt64 anchorSample_;
+    epicsUInt64 sampleCount_;
+    // Statistics of the current block, published when the block is complete
+    int computeStats_;
+    QEStats_t stats_;
+    // The spectra are computed by spectrumTask(), which reads the samples from spectrumRing_.
+    // These are created the first time the spectra are enabled.
+    // spectrumConfig_ is incremented when a parameter changes or there is a gap in the samples,
+    // so that spectrumTask() restarts the averaging.
+    int spectrumEnable_;
+    int spectrumConfig_;
+    quadEMSpectrum *spectrum_;
+    quadEMRing<QESample_t> *spectrumRing_;
+    epicsEventId spectrumEvent_;
+    // Listeners are called with a copy of each chunk in listenerSamples_.  listenerLock_ protects listeners_,
+    // and is held while they are called so that removeListener() does not return while a listener is running.
+    // The listeners are called with the driver lock held, so listenerSamples_ is only used by one thread at a time.
+    epicsMutexId listenerLock_;
+    quadEMListener *listeners_[QE_MAX_LISTENERS];
+    int numListeners_;
+    QESample_t *listenerSamples_;
+    // Latency of each stage of the data path, measured with epicsMonotonicGet().
+    // receivedTime_ is the time of the most recent call to computePositionsBlock(), and readTime_ the time of the
+    // most recent call to readComplete().  The sample and block counts are used to compute the rates.
+    quadEMLatency latency_[QE_LATENCY_STAGES];
+    epicsUInt64 receivedTime_;
+    epicsUInt64 readTime_;
+    epicsUInt64 samplesReceived_;
+    epicsUInt64 blocksDone_;
+    epicsUInt64 lastLatencyUpdate_;
+    epicsUInt64 lastSamplesReceived_;
+    epicsUInt64 lastBlocksDone_;
 
 };
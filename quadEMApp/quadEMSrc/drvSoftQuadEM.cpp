@@ -1,11 +1,19 @@
 /*  drvSoftQuadEM.cpp
-    A driver to get electronmeter readouts from a 4-element EPICS array (waveform record).
+    A driver to get electronmeter readouts from an EPICS array (waveform record) of N samples of 4 currents.
+    It can also generate synthetic data at high rates in its own thread, which is used to load-test
+    the quadEM base class and IOC host without hardware.
 */
 
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
 #include <math.h>
 
 #include <epicsThread.h>
+#include <epicsEvent.h>
 #include <epicsTime.h>
+#include <epicsString.h>
 #include <errlog.h>
 #include <iocsh.h>
 
@@ -13,9 +21,32 @@
 
 #include <epicsExport.h>
 
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
 static const char *driverName = "drvSoftQuadEM";
 
-#define QES_DataInString  "QES_DATA_IN"
+#define QES_DataInString        "QES_DATA_IN"
+#define QES_BlockTimeString     "QES_BLOCK_TIME"
+#define QES_SynthModeString     "QES_SYNTH_MODE"
+#define QES_SynthCurrentString  "QES_SYNTH_CURRENT"
+#define QES_SynthNoiseString    "QES_SYNTH_NOISE"
+#define QES_SynthMotionString   "QES_SYNTH_MOTION"
+#define QES_SynthMotionFreqString "QES_SYNTH_MOTION_FREQ"
+#define QES_SynthGatePeriodString "QES_SYNTH_GATE_PERIOD"
+#define QES_SynthGateWidthString  "QES_SYNTH_GATE_WIDTH"
+#define QES_SynthMissedString   "QES_SYNTH_MISSED"
+
+// Maximum number of samples that the generator passes to computePositionsBlock() at once
+#define QES_MAX_VALUES_PER_READ 10000
+// If the generator falls further behind than this many seconds the samples are skipped and counted as missed
+#define QES_MAX_BEHIND 0.1
+
+typedef enum {
+    QESSynthModeExternal,
+    QESSynthModeSynthetic
+} QESSynthMode_t;
 
 class drvSoftQuadEM : public drvQuadEM
 {
@@ -23,7 +54,13 @@ public:
     drvSoftQuadEM(const char *portName, int ringBufferSize);
     ~drvSoftQuadEM();
 
+    asynStatus writeInt32(asynUser *pasynUser, epicsInt32 value);
+    asynStatus writeFloat64(asynUser *pasynUser, epicsFloat64 value);
+    asynStatus writeInt32Array(asynUser *pasynUser, epicsInt32 *value, size_t nElements);
+    asynStatus writeFloat32Array(asynUser *pasynUser, epicsFloat32 *value, size_t nElements);
     asynStatus writeFloat64Array(asynUser *pasynUser, epicsFloat64 *value, size_t nElements);
+    void generatorTask();
+    void benchmark(double rate, double seconds, const char *numAverages);
 
 protected:
     virtual asynStatus setAveragingTime(epicsFloat64 value);
@@ -34,16 +71,89 @@ protected:
 private:
     int QES_DataIn;
     #define FIRST_QES_COMMAND QES_DataIn
+    int QES_BlockTime;
+    int QES_SynthMode;
+    int QES_SynthCurrent;
+    int QES_SynthNoise;
+    int QES_SynthMotion;
+    int QES_SynthMotionFreq;
+    int QES_SynthGatePeriod;
+    int QES_SynthGateWidth;
+    int QES_SynthMissed;
+
+    void generate(epicsFloat64 *raw, int numSamples);
+    double gaussian();
+    asynStatus processDataIn(const epicsFloat64 *value, size_t nElements);
+    template <typename T> asynStatus convertDataIn(const T *value, size_t nElements);
 
     int acquire_;
+    // Time of the next block written to QES_DATA_IN from QES_BLOCK_TIME, and the buffer used to convert
+    // Int32 and Float32 arrays to Float64
+    bool blockTimeValid_;
+    epicsFloat64 blockTime_;
+    epicsFloat64 *convertBuffer_;
+    size_t convertBufferSize_;
+    // The generator thread waits for generatorEvent_ when it is not generating.
+    // generatorRestart_ is set when the generator must restart its clock, for example when the SampleTime changes.
+    epicsEventId generatorEvent_;
+    bool generatorRestart_;
+    epicsFloat64 *generatorBuffer_;
+    // Number of samples generated since acquisition started, and the number skipped because the thread fell behind
+    epicsUInt64 numGenerated_;
+    epicsUInt64 numMissed_;
+    // Sample clock and state of the random number generator for the synthetic signal
+    epicsUInt64 sampleNumber_;
+    epicsUInt64 randomState_;
+    double spareGaussian_;
+    bool haveSpareGaussian_;
 };
 
+static void generatorTaskC(void *drvPvt)
+{
+    drvSoftQuadEM *pPvt = (drvSoftQuadEM *)drvPvt;
+    pPvt->generatorTask();
+}
+
 drvSoftQuadEM::drvSoftQuadEM(const char *portName, int ringBufferSize)
-    : drvQuadEM(portName, ringBufferSize), acquire_(0)
+    : drvQuadEM(portName, ringBufferSize), acquire_(0), blockTimeValid_(false), blockTime_(0.),
+      convertBuffer_(0), convertBufferSize_(0), generatorRestart_(true),
+      numGenerated_(0), numMissed_(0), sampleNumber_(0), randomState_(0x853c49e6748fea9bULL),
+      spareGaussian_(0.), haveSpareGaussian_(false)
 {
-    createParam(QES_DataInString,     asynParamFloat64Array,  &QES_DataIn);
+    const char *functionName = "drvSoftQuadEM";
+
+    createParam(QES_DataInString,          asynParamFloat64Array,  &QES_DataIn);
+    createParam(QES_BlockTimeString,       asynParamFloat64,       &QES_BlockTime);
+    createParam(QES_SynthModeString,       asynParamInt32,         &QES_SynthMode);
+    createParam(QES_SynthCurrentString,    asynParamFloat64,       &QES_SynthCurrent);
+    createParam(QES_SynthNoiseString,      asynParamFloat64,       &QES_SynthNoise);
+    createParam(QES_SynthMotionString,     asynParamFloat64,       &QES_SynthMotion);
+    createParam(QES_SynthMotionFreqString, asynParamFloat64,       &QES_SynthMotionFreq);
+    createParam(QES_SynthGatePeriodString, asynParamFloat64,       &QES_SynthGatePeriod);
+    createParam(QES_SynthGateWidthString,  asynParamFloat64,       &QES_SynthGateWidth);
+    createParam(QES_SynthMissedString,     asynParamInt32,         &QES_SynthMissed);
 
     setIntegerParam(P_Model, QE_ModelSoftDevice);
+    setIntegerParam(QES_SynthMode, QESSynthModeExternal);
+    setDoubleParam(QES_SynthCurrent, 1.0);
+    setDoubleParam(QES_SynthNoise, 0.001);
+    setDoubleParam(QES_SynthMotion, 0.01);
+    setDoubleParam(QES_SynthMotionFreq, 10.);
+    setDoubleParam(QES_SynthGatePeriod, 0.);
+    setDoubleParam(QES_SynthGateWidth, 0.);
+    setIntegerParam(QES_SynthMissed, 0);
+
+    generatorBuffer_ = (epicsFloat64 *)calloc(QES_MAX_VALUES_PER_READ * QE_MAX_INPUTS, sizeof(epicsFloat64));
+    generatorEvent_ = epicsEventCreate(epicsEventEmpty);
+    if (epicsThreadCreate("drvSoftQuadEMGenerator",
+                          epicsThreadPriorityMedium,
+                          epicsThreadGetStackSize(epicsThreadStackMedium),
+                          (EPICSTHREADFUNC)::generatorTaskC,
+                          this) == NULL) {
+        printf("%s::%s: epicsThreadCreate failure\n", driverName, functionName);
+        return;
+    }
+    callParamCallbacks();
 }
 
 drvSoftQuadEM::~drvSoftQuadEM()
@@ -53,6 +163,8 @@ drvSoftQuadEM::~drvSoftQuadEM()
 asynStatus drvSoftQuadEM::setAcquire(epicsInt32 value)
 {
     acquire_ = value;
+    generatorRestart_ = true;
+    epicsEventSignal(generatorEvent_);
     return asynSuccess;
 }
 
@@ -84,6 +196,304 @@ asynStatus drvSoftQuadEM::setAveragingTime(epicsFloat64 value)
     return asynSuccess;
 }
 
+/** Returns a normally distributed random number with mean 0 and standard deviation 1.
+  * This uses the xorshift64* generator and the Box-Muller transform, which are much faster than rand().
+  */
+double drvSoftQuadEM::gaussian()
+{
+    double u1, u2, r;
+
+    if (haveSpareGaussian_) {
+        haveSpareGaussian_ = false;
+        return spareGaussian_;
+    }
+    randomState_ ^= randomState_ >> 12;
+    randomState_ ^= randomState_ << 25;
+    randomState_ ^= randomState_ >> 27;
+    u1 = ((randomState_ * 0x2545F4914F6CDD1DULL) >> 11) * (1.0 / 9007199254740992.0);
+    randomState_ ^= randomState_ >> 12;
+    randomState_ ^= randomState_ << 25;
+    randomState_ ^= randomState_ >> 27;
+    u2 = ((randomState_ * 0x2545F4914F6CDD1DULL) >> 11) * (1.0 / 9007199254740992.0);
+    if (u1 < 1e-300) u1 = 1e-300;
+    r = sqrt(-2.0 * log(u1));
+    spareGaussian_ = r * sin(2.*M_PI*u2);
+    haveSpareGaussian_ = true;
+    return r * cos(2.*M_PI*u2);
+}
+
+/** Generates the raw currents for numSamples samples starting at sampleNumber_.
+  * The beam moves in a circle with amplitude SynthMotion at SynthMotionFreq, and the currents are computed so
+  * that the positions have these values with the Square geometry and unit scales and offsets.
+  * Gaussian noise with standard deviation SynthNoise*SynthCurrent/4 is added to each current.
+  * This is called without the lock held.  It takes the lock briefly to read SampleTime, SynthCurrent, SynthNoise,
+  * SynthMotion and SynthMotionFreq from the parameter library, and generates the samples without the lock.
+  */
+void drvSoftQuadEM::generate(epicsFloat64 *raw, int numSamples)
+{
+    double current, noise, motion, motionFreq, sampleTime;
+    double phase, x, y, c, sigma, cosStep, sinStep, temp;
+    int j;
+
+    lock();
+    getDoubleParam(P_SampleTime, &sampleTime);
+    getDoubleParam(QES_SynthCurrent, &current);
+    getDoubleParam(QES_SynthNoise, &noise);
+    getDoubleParam(QES_SynthMotion, &motion);
+    getDoubleParam(QES_SynthMotionFreq, &motionFreq);
+    unlock();
+
+    c = current / 4.;
+    sigma = noise * c;
+    // The position is rotated by a fixed angle for each sample, starting from the exact phase for each read
+    phase = 2.*M_PI*motionFreq*sampleTime;
+    cosStep = cos(phase);
+    sinStep = sin(phase);
+    phase = fmod(phase * (double)sampleNumber_, 2.*M_PI);
+    x = motion * cos(phase);
+    y = motion * sin(phase);
+    for (j=0; j<numSamples; j++) {
+        raw[0] = c * (1. - x + y);
+        raw[1] = c * (1. + x + y);
+        raw[2] = c * (1. + x - y);
+        raw[3] = c * (1. - x - y);
+        if (sigma > 0.) {
+            raw[0] += sigma * gaussian();
+            raw[1] += sigma * gaussian();
+            raw[2] += sigma * gaussian();
+            raw[3] += sigma * gaussian();
+        }
+        temp = x*cosStep - y*sinStep;
+        y = x*sinStep + y*cosStep;
+        x = temp;
+        raw += QE_MAX_INPUTS;
+    }
+}
+
+/** Thread that generates the synthetic data when SynthMode=Synthetic and acquisition is active.
+  * The samples are generated at the rate given by SampleTime, paced by the monotonic clock.
+  * Each time the thread wakes up it generates all of the samples that are due, in reads of ValuesPerRead samples.
+  * If it falls more than QES_MAX_BEHIND seconds behind the extra samples are skipped and counted in SynthMissed.
+  * When SynthGatePeriod > 0 samples are only sent to computePositionsBlock() during the first SynthGateWidth seconds
+  * of each period, like a device in external gate mode.
+  */
+void drvSoftQuadEM::generatorTask()
+{
+    int synthMode;
+    int numRead;
+    int valuesPerRead;
+    int j, n;
+    double sampleTime, gatePeriod, gateWidth, t;
+    epicsUInt64 start = 0, now, due, behind;
+
+    lock();
+    while (1) {
+        getIntegerParam(QES_SynthMode, &synthMode);
+        if (!acquire_ || (synthMode != QESSynthModeSynthetic)) {
+            unlock();
+            epicsEventWait(generatorEvent_);
+            lock();
+            continue;
+        }
+        getDoubleParam(P_SampleTime, &sampleTime);
+        if (sampleTime <= 0.) sampleTime = 1e-3;
+        if (generatorRestart_) {
+            generatorRestart_ = false;
+            start = epicsMonotonicGet();
+            sampleNumber_ = 0;
+        }
+        now = epicsMonotonicGet();
+        due = (epicsUInt64)((now - start) * 1e-9 / sampleTime);
+        if (due <= sampleNumber_) {
+            // Sleep until the next read is due
+            unlock();
+            epicsThreadSleep((valuesPerRead_ * sampleTime < QES_MAX_BEHIND) ? valuesPerRead_ * sampleTime : QES_MAX_BEHIND);
+            lock();
+            continue;
+        }
+        behind = due - sampleNumber_;
+        if (behind * sampleTime > QES_MAX_BEHIND) {
+            n = (int)(behind - (epicsUInt64)(QES_MAX_BEHIND / sampleTime));
+            sampleNumber_ += n;
+            numMissed_ += n;
+            setIntegerParam(QES_SynthMissed, (int)numMissed_);
+            callParamCallbacks();
+        }
+        valuesPerRead = valuesPerRead_;
+        if (valuesPerRead < 1) valuesPerRead = 1;
+        if (valuesPerRead > QES_MAX_VALUES_PER_READ) valuesPerRead = QES_MAX_VALUES_PER_READ;
+        getDoubleParam(QES_SynthGatePeriod, &gatePeriod);
+        getDoubleParam(QES_SynthGateWidth, &gateWidth);
+        while (acquire_ && !generatorRestart_ && (sampleNumber_ + valuesPerRead <= due)) {
+            // Generate the samples without the lock, as a real driver reads from the device
+            unlock();
+            generate(generatorBuffer_, valuesPerRead);
+            lock();
+            if (!acquire_ || generatorRestart_) break;
+            numRead = valuesPerRead;
+            if (gatePeriod > 0.) {
+                // Only pass the samples that are inside the gate
+                numRead = 0;
+                for (j=0; j<valuesPerRead; j++) {
+                    t = fmod((sampleNumber_ + j) * sampleTime, gatePeriod);
+                    if (t < gateWidth) {
+                        if (numRead != j) {
+                            memcpy(&generatorBuffer_[numRead*QE_MAX_INPUTS], &generatorBuffer_[j*QE_MAX_INPUTS],
+                                   QE_MAX_INPUTS*sizeof(epicsFloat64));
+                        }
+                        numRead++;
+                    }
+                }
+            }
+            sampleNumber_ += valuesPerRead;
+            numGenerated_ += numRead;
+            if (numRead > 0) {
+                readComplete();
+                computePositionsBlock(generatorBuffer_, numRead);
+            }
+        }
+    }
+}
+
+/** Runs the synthetic generator for each NumAverage in a list and prints the performance.
+  * For each NumAverage this prints the samples/s, the process CPU time per sample, the ring buffer overflows,
+  * the samples the generator missed, the NDArray callbacks per second, and the mean and maximum latency from
+  * when the last sample of a block was received to when its callbacks were complete.
+  * The plugins that are enabled in the IOC are included, so the command can be repeated with different plugin chains.
+  * The command refuses to run while acquisition is running, and it flushes the ring buffer before each test
+  * and when it finishes, so the benchmark samples are never averaged with real data.
+  * \param[in] rate Sample rate in Hz.
+  * \param[in] seconds Time to run for each NumAverage.
+  * \param[in] numAverages List of NumAverage values separated by spaces or commas, for example "1 10 100 1000".
+  */
+void drvSoftQuadEM::benchmark(double rate, double seconds, const char *numAverages)
+{
+    char *list, *token, *save;
+    int numAverage;
+    int saveMode, saveNumAverage;
+    int acquire;
+    int overflowsStart, overflowsEnd;
+    double saveSampleTime, saveAveragingTime, elapsed, cpu;
+    epicsUInt64 generatedStart, missedStart, blocksStart, samples;
+    epicsUInt64 startTime;
+    clock_t cpuStart;
+
+    if (rate <= 0.) rate = 10000.;
+    if (seconds <= 0.) seconds = 5.;
+    list = epicsStrDup((numAverages && *numAverages) ? numAverages : "1 10 100 1000");
+
+    lock();
+    getIntegerParam(ADAcquire, &acquire);
+    if (acquire || acquire_) {
+        unlock();
+        printf("%s::benchmark: stop acquisition before running the benchmark\n", driverName);
+        free(list);
+        return;
+    }
+    getIntegerParam(QES_SynthMode, &saveMode);
+    getDoubleParam(P_SampleTime, &saveSampleTime);
+    getIntegerParam(P_NumAverage, &saveNumAverage);
+    getDoubleParam(P_AveragingTime, &saveAveragingTime);
+    setIntegerParam(QES_SynthMode, QESSynthModeSynthetic);
+    setDoubleParam(P_SampleTime, 1./rate);
+    unlock();
+
+    printf("Port %s, rate=%g Hz, %g seconds per test, ValuesPerRead=%d, kernel=%s\n",
+           portName, rate, seconds, valuesPerRead_, quadEMKernelGet()->name);
+    printf("NumAverage   Samples/s  CPU us/sample  Overflows    Missed   Blocks/s  Latency mean/max (us)\n");
+    for (token = epicsStrtok_r(list, " ,", &save); token; token = epicsStrtok_r(NULL, " ,", &save)) {
+        numAverage = atoi(token);
+        if (numAverage < 1) continue;
+        lock();
+        setIntegerParam(P_NumAverage, numAverage);
+        setDoubleParam(P_AveragingTime, numAverage / rate);
+        resetLatency();
+        getIntegerParam(P_RingOverflows, &overflowsStart);
+        generatedStart = numGenerated_;
+        missedStart = numMissed_;
+        blocksStart = latency(QELatencyCallbacks).count();
+        startTime = epicsMonotonicGet();
+        cpuStart = clock();
+        resetAcquisition();
+        setIntegerParam(ADAcquire, 1);
+        setAcquire(1);
+        callParamCallbacks();
+        unlock();
+
+        epicsThreadSleep(seconds);
+
+        lock();
+        setAcquire(0);
+        setIntegerParam(ADAcquire, 0);
+        triggerCallbacks();
+        callParamCallbacks();
+        elapsed = (epicsMonotonicGet() - startTime) * 1e-9;
+        cpu = (double)(clock() - cpuStart) / CLOCKS_PER_SEC;
+        samples = numGenerated_ - generatedStart;
+        getIntegerParam(P_RingOverflows, &overflowsEnd);
+        unlock();
+        // Let the callback thread finish the last block
+        epicsThreadSleep(0.5);
+        printf("%10d %11.4g %14.3f %10d %9llu %10.2f %10.1f/%.1f\n", numAverage,
+               samples / elapsed,
+               (samples > 0) ? cpu * 1e6 / samples : 0.,
+               overflowsEnd - overflowsStart,
+               (unsigned long long)(numMissed_ - missedStart),
+               (latency(QELatencyCallbacks).count() - blocksStart) / elapsed,
+               latency(QELatencyTotal).mean(), latency(QELatencyTotal).max());
+    }
+
+    lock();
+    // Discard the benchmark samples so they are not averaged with the next acquisition
+    resetAcquisition();
+    setIntegerParam(QES_SynthMode, saveMode);
+    setDoubleParam(P_SampleTime, saveSampleTime);
+    setIntegerParam(P_NumAverage, saveNumAverage);
+    setDoubleParam(P_AveragingTime, saveAveragingTime);
+    callParamCallbacks();
+    unlock();
+    free(list);
+}
+
+asynStatus drvSoftQuadEM::writeInt32(asynUser *pasynUser, epicsInt32 value)
+{
+    int function = pasynUser->reason;
+    int status = asynSuccess;
+
+    if (function == QES_SynthMode) {
+        setIntegerParam(function, value);
+        generatorRestart_ = true;
+        epicsEventSignal(generatorEvent_);
+        callParamCallbacks();
+    }
+    else {
+        status = drvQuadEM::writeInt32(pasynUser, value);
+    }
+    return (asynStatus)status;
+}
+
+asynStatus drvSoftQuadEM::writeFloat64(asynUser *pasynUser, epicsFloat64 value)
+{
+    int function = pasynUser->reason;
+    int status = asynSuccess;
+
+    if (function == QES_BlockTime) {
+        // This is the time of the first sample of the next block written to QES_DATA_IN
+        setDoubleParam(function, value);
+        blockTime_ = value;
+        blockTimeValid_ = true;
+        return asynSuccess;
+    }
+    status = drvQuadEM::writeFloat64(pasynUser, value);
+    if (function == P_SampleTime) {
+        // The averaging time is converted to NumAverage with the SampleTime, and the generator restarts its clock
+        setAveragingTime(0.);
+        generatorRestart_ = true;
+        callParamCallbacks();
+    }
+    return (asynStatus)status;
+}
+
 asynStatus drvSoftQuadEM::writeFloat64Array(asynUser *pasynUser, epicsFloat64 *value, size_t nElements)
 {
     int function = pasynUser->reason;
@@ -95,13 +505,7 @@ asynStatus drvSoftQuadEM::writeFloat64Array(asynUser *pasynUser, epicsFloat64 *v
     getParamName(function, &paramName);
 
     if (function == QES_DataIn) {
-        if (nElements == 4) {
-            if (acquire_)
-                computePositions(value);
-        }
-        else {
-            status = asynError;
-        }
+        status = processDataIn(value, nElements);
     }
     else if (function < FIRST_QES_COMMAND) {
         status = drvQuadEM::writeFloat64Array(pasynUser, value, nElements);
@@ -119,6 +523,58 @@ asynStatus drvSoftQuadEM::writeFloat64Array(asynUser *pasynUser, epicsFloat64 *v
     return (asynStatus)status;
 }
 
+/** Processes an array of nElements/4 samples of the 4 currents written to QES_DATA_IN as a single block.
+  * If QES_BLOCK_TIME was written since the previous array it is used as the device time of the first sample.
+  * \param[in] value The currents, 4 values per sample.
+  * \param[in] nElements The number of values, which must be a multiple of 4.
+  */
+asynStatus drvSoftQuadEM::processDataIn(const epicsFloat64 *value, size_t nElements)
+{
+    if ((nElements == 0) || (nElements % QE_MAX_INPUTS)) return asynError;
+    if (!acquire_) return asynSuccess;
+    if (blockTimeValid_) {
+        setDeviceTime(blockTime_);
+        blockTimeValid_ = false;
+    }
+    readComplete();
+    computePositionsBlock(value, nElements / QE_MAX_INPUTS);
+    return asynSuccess;
+}
+
+/** Converts an Int32 or Float32 array written to QES_DATA_IN to Float64 and processes it */
+template <typename T>
+asynStatus drvSoftQuadEM::convertDataIn(const T *value, size_t nElements)
+{
+    size_t i;
+
+    if (nElements > convertBufferSize_) {
+        free(convertBuffer_);
+        convertBuffer_ = (epicsFloat64 *)malloc(nElements * sizeof(epicsFloat64));
+        convertBufferSize_ = convertBuffer_ ? nElements : 0;
+        if (!convertBuffer_) return asynError;
+    }
+    for (i=0; i<nElements; i++) {
+        convertBuffer_[i] = (epicsFloat64)value[i];
+    }
+    return processDataIn(convertBuffer_, nElements);
+}
+
+asynStatus drvSoftQuadEM::writeInt32Array(asynUser *pasynUser, epicsInt32 *value, size_t nElements)
+{
+    if (pasynUser->reason == QES_DataIn) {
+        return convertDataIn(value, nElements);
+    }
+    return drvQuadEM::writeInt32Array(pasynUser, value, nElements);
+}
+
+asynStatus drvSoftQuadEM::writeFloat32Array(asynUser *pasynUser, epicsFloat32 *value, size_t nElements)
+{
+    if (pasynUser->reason == QES_DataIn) {
+        return convertDataIn(value, nElements);
+    }
+    return drvQuadEM::writeFloat32Array(pasynUser, value, nElements);
+}
+
 extern "C" {
 
 int drvSoftQuadEMConfigure(const char *portName, int ringBufferSize)
@@ -127,6 +583,18 @@ int drvSoftQuadEMConfigure(const char *portName, int ringBufferSize)
     return(asynSuccess);
 }
 
+int drvSoftQuadEMBenchmark(const char *portName, double rate, double seconds, const char *numAverages)
+{
+    drvSoftQuadEM *pSoftQuadEM = dynamic_cast<drvSoftQuadEM *>(findAsynPortDriver(portName));
+
+    if (!pSoftQuadEM) {
+        printf("%s: cannot find drvSoftQuadEM port %s\n", driverName, portName ? portName : "");
+        return(asynError);
+    }
+    pSoftQuadEM->benchmark(rate, seconds, numAverages);
+    return(asynSuccess);
+}
+
 
 /* EPICS iocsh shell commands */
 
@@ -136,12 +604,24 @@ static const iocshArg * const initArgs[] = {&initArg0, &initArg1};
 static const iocshFuncDef initFuncDef = {"drvSoftQuadEMConfigure", 2, initArgs};
 static void initCallFunc(const iocshArgBuf *args)
 {
-    drvSoftQuadEMConfigure(args[0].sval, args[2].ival);
+    drvSoftQuadEMConfigure(args[0].sval, args[1].ival);
+}
+
+static const iocshArg benchmarkArg0 = { "portName", iocshArgString};
+static const iocshArg benchmarkArg1 = { "sample rate", iocshArgDouble};
+static const iocshArg benchmarkArg2 = { "seconds", iocshArgDouble};
+static const iocshArg benchmarkArg3 = { "NumAverage list", iocshArgString};
+static const iocshArg * const benchmarkArgs[] = {&benchmarkArg0, &benchmarkArg1, &benchmarkArg2, &benchmarkArg3};
+static const iocshFuncDef benchmarkFuncDef = {"drvSoftQuadEMBenchmark", 4, benchmarkArgs};
+static void benchmarkCallFunc(const iocshArgBuf *args)
+{
+    drvSoftQuadEMBenchmark(args[0].sval, args[1].dval, args[2].dval, args[3].sval);
 }
 
 void drvSoftQuadEMRegister(void)
 {
     iocshRegister(&initFuncDef, initCallFunc);
+    iocshRegister(&benchmarkFuncDef, benchmarkCallFunc);
 }
 
 epicsExportRegistrar(drvSoftQuadEMRegister);
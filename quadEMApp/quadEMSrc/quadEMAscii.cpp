@@ -0,0 +1,149 @@
+/*
+ * quadEMAscii.cpp
+ *
+ * Parsing of the ASCII data stream from the meters that send one sample per line.
+ * See quadEMAscii.h for a description.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+// std::from_chars for integers is C++17, for floating point it also needs a recent library (e.g. gcc 11)
+#if defined(__has_include) && (__cplusplus >= 201703L)
+  #if __has_include(<charconv>)
+    #include <charconv>
+    #define QE_FROM_CHARS_INTEGER
+    #if defined(__cpp_lib_to_chars)
+      #define QE_FROM_CHARS_DOUBLE
+    #endif
+  #endif
+#endif
+
+#include <epicsExport.h>
+#include "quadEMAscii.h"
+
+/** Constructor for the quadEMLineSplitter class.
+  * \param[in] bufferSize The size of the buffer, which must be larger than the longest line.
+  */
+quadEMLineSplitter::quadEMLineSplitter(size_t bufferSize)
+  : bufferSize_(bufferSize), numBytes_(0), position_(0)
+{
+    buffer_ = (char *)malloc(bufferSize_);
+}
+
+quadEMLineSplitter::~quadEMLineSplitter()
+{
+    free(buffer_);
+}
+
+/** Discards all of the data in the buffer. */
+void quadEMLineSplitter::reset()
+{
+    numBytes_ = 0;
+    position_ = 0;
+}
+
+/** Returns the next complete line in the buffer.  The end of line characters are replaced with a nil.
+  * The line is valid until the next call to nextLine().
+  * Returns false if there are no more complete lines.  The partial line is then moved to the start of the buffer
+  * so there is the most space for the next read.
+  */
+bool quadEMLineSplitter::nextLine(const char **line, size_t *length)
+{
+    char *start = buffer_ + position_;
+    char *end;
+    size_t len;
+
+    end = (char *)memchr(start, '\n', numBytes_ - position_);
+    if (!end) {
+        len = numBytes_ - position_;
+        // A line that fills the buffer cannot be valid data, so it is discarded
+        if (len == bufferSize_) len = 0;
+        if ((position_ > 0) && (len > 0)) memmove(buffer_, start, len);
+        numBytes_ = len;
+        position_ = 0;
+        return false;
+    }
+    position_ = end - buffer_ + 1;
+    len = end - start;
+    if ((len > 0) && (start[len-1] == '\r')) len--;
+    start[len] = 0;
+    *line = start;
+    *length = len;
+    return true;
+}
+
+static inline const char *skipSeparators(const char *p, const char *end)
+{
+    while ((p < end) && ((*p == ' ') || (*p == '\t') || (*p == ',') || (*p == ':'))) p++;
+    // std::from_chars does not accept a leading +
+    if ((p < end) && (*p == '+')) p++;
+    return p;
+}
+
+int quadEMParseDoubles(const char *line, size_t length, double *values, int maxValues)
+{
+    const char *p = line;
+    const char *end = line + length;
+    int n;
+
+    for (n=0; n<maxValues; n++) {
+        p = skipSeparators(p, end);
+#ifdef QE_FROM_CHARS_DOUBLE
+        std::from_chars_result result = std::from_chars(p, end, values[n]);
+        if (result.ec != std::errc()) break;
+        p = result.ptr;
+#else
+        // The line is terminated with a nil so strtod() stops at the end
+        char *next;
+        if (p == end) break;
+        values[n] = strtod(p, &next);
+        if (next == p) break;
+        p = next;
+#endif
+    }
+    return n;
+}
+
+int quadEMParseLongs(const char *line, size_t length, int base, long *values, int maxValues)
+{
+    const char *p = line;
+    const char *end = line + length;
+    int n;
+
+    for (n=0; n<maxValues; n++) {
+        p = skipSeparators(p, end);
+#ifdef QE_FROM_CHARS_INTEGER
+        std::from_chars_result result = std::from_chars(p, end, values[n], base);
+        if (result.ec != std::errc()) break;
+        p = result.ptr;
+#else
+        char *next;
+        if (p == end) break;
+        values[n] = strtol(p, &next, base);
+        if (next == p) break;
+        p = next;
+#endif
+    }
+    return n;
+}
+
+int quadEMFindKeyword(const char *line, size_t length, const char * const *keywords, int numKeywords)
+{
+    const char *end = line + length;
+    const char *p;
+    size_t keyLength;
+    int i;
+
+    for (i=0; i<numKeywords; i++) {
+        keyLength = strlen(keywords[i]);
+        if ((keyLength == 0) || (keyLength > length)) continue;
+        // Search for the first character, then compare the rest
+        p = line;
+        while ((p = (const char *)memchr(p, keywords[i][0], end - p - keyLength + 1)) != 0) {
+            if (memcmp(p, keywords[i], keyLength) == 0) return i;
+            p++;
+        }
+    }
+    return -1;
+}
@@ -0,0 +1,48 @@
+/*
+ * quadEMAscii.h
+ *
+ * Parsing of the ASCII data stream from the meters that send one sample per line
+ *
+ * The quadEMLineSplitter class holds the data from many reads of the stream, and splits them into lines.
+ * The data are read directly into the buffer at writePointer() and added with commit(), so each read can return
+ * all of the data that are available, rather than one line per read.  A partial line at the end of the buffer
+ * is kept for the next read.  Lines can end with \n or \r\n.
+ * The values in each line are converted with std::from_chars when the compiler supports it, which does not
+ * depend on the locale and is much faster than strtod() and sscanf().  Otherwise strtod() and strtol() are used.
+ */
+
+#ifndef QUADEM_ASCII_H
+#define QUADEM_ASCII_H
+
+#include <stddef.h>
+#include <shareLib.h>
+
+/** Splits the data read from the meter into lines. */
+class epicsShareClass quadEMLineSplitter {
+public:
+    quadEMLineSplitter(size_t bufferSize);
+    ~quadEMLineSplitter();
+    void reset();
+    char *writePointer() { return buffer_ + numBytes_; }
+    size_t writeSpace() const { return bufferSize_ - numBytes_; }
+    void commit(size_t nRead) { numBytes_ += nRead; }
+    bool nextLine(const char **line, size_t *length);
+
+private:
+    char *buffer_;
+    size_t bufferSize_;
+    size_t numBytes_;       /* Number of bytes in the buffer */
+    size_t position_;       /* Start of the next line */
+};
+
+/** Converts up to maxValues numbers in a line to double.
+  * The numbers can be separated by spaces, tabs, commas or colons.
+  * Returns the number of values converted, which is less than maxValues if a field is not a number.
+  */
+epicsShareFunc int quadEMParseDoubles(const char *line, size_t length, double *values, int maxValues);
+/** Converts up to maxValues integers in a line in the given base (10 or 16), in the same way as quadEMParseDoubles(). */
+epicsShareFunc int quadEMParseLongs(const char *line, size_t length, int base, long *values, int maxValues);
+/** Returns the index of the first of numKeywords keywords that is contained in a line, or -1 if none are. */
+epicsShareFunc int quadEMFindKeyword(const char *line, size_t length, const char * const *keywords, int numKeywords);
+
+#endif
@@ -0,0 +1,339 @@
+/*
+ * quadEMKernel.cpp
+ *
+ * Kernels that compute the currents, sums, differences and positions for a block of samples.
+ * See quadEMKernel.h for a description.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+
+#include <epicsTypes.h>
+#include <epicsThread.h>
+#include <epicsTime.h>
+#include <iocsh.h>
+
+#include <epicsExport.h>
+#include "drvQuadEM.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+  #define QE_KERNEL_X86
+  #include <immintrin.h>
+#endif
+
+/** Computes samples [first, last) with plain C++ */
+static void computeScalar(const QEKernelParams_t *p, const double * const in[QE_KERNEL_INPUTS],
+                          double * const out[QE_KERNEL_OUTPUTS], size_t first, size_t last)
+{
+    size_t j;
+    int i, k;
+    double c[QE_KERNEL_INPUTS];
+    double w[QE_KERNEL_WEIGHTS];
+    double denom;
+
+    for (j=first; j<last; j++) {
+        for (i=0; i<QE_KERNEL_INPUTS; i++) {
+            c[i] = in[i][j]*p->currentScale[i] - p->currentOffset[i];
+            out[QECurrent1+i][j] = c[i];
+        }
+        out[QESumAll][j] = c[0] + c[1] + c[2] + c[3];
+        for (k=0; k<QE_KERNEL_WEIGHTS; k++) {
+            w[k] = p->weights[k][0]*c[0] + p->weights[k][1]*c[1] +
+                   p->weights[k][2]*c[2] + p->weights[k][3]*c[3];
+        }
+        out[QESumX][j]  = w[QEWeightSumX];
+        out[QESumY][j]  = w[QEWeightSumY];
+        out[QEDiffX][j] = w[QEWeightDiffX];
+        out[QEDiffY][j] = w[QEWeightDiffY];
+        denom = w[QEWeightSumX];
+        if (denom == 0.) denom = 1.;
+        out[QEPositionX][j] = (p->positionScale[0] * w[QEWeightDiffX] / denom) - p->positionOffset[0];
+        denom = w[QEWeightSumY];
+        if (denom == 0.) denom = 1.;
+        out[QEPositionY][j] = (p->positionScale[1] * w[QEWeightDiffY] / denom) - p->positionOffset[1];
+    }
+}
+
+static void kernelScalar(const QEKernelParams_t *p, const double * const in[QE_KERNEL_INPUTS],
+                         double * const out[QE_KERNEL_OUTPUTS], size_t nSamples)
+{
+    computeScalar(p, in, out, 0, nSamples);
+}
+
+#ifdef QE_KERNEL_X86
+
+__attribute__((target("sse2")))
+static void kernelSSE2(const QEKernelParams_t *p, const double * const in[QE_KERNEL_INPUTS],
+                       double * const out[QE_KERNEL_OUTPUTS], size_t nSamples)
+{
+    size_t j;
+    int i, k;
+    __m128d scale[QE_KERNEL_INPUTS], offset[QE_KERNEL_INPUTS];
+    __m128d weights[QE_KERNEL_WEIGHTS][QE_KERNEL_INPUTS];
+    __m128d posScale[2], posOffset[2];
+    __m128d zero = _mm_setzero_pd();
+    __m128d one = _mm_set1_pd(1.0);
+    size_t nVector = nSamples & ~(size_t)1;
+
+    for (i=0; i<QE_KERNEL_INPUTS; i++) {
+        scale[i]  = _mm_set1_pd(p->currentScale[i]);
+        offset[i] = _mm_set1_pd(p->currentOffset[i]);
+        for (k=0; k<QE_KERNEL_WEIGHTS; k++) {
+            weights[k][i] = _mm_set1_pd(p->weights[k][i]);
+        }
+    }
+    for (i=0; i<2; i++) {
+        posScale[i]  = _mm_set1_pd(p->positionScale[i]);
+        posOffset[i] = _mm_set1_pd(p->positionOffset[i]);
+    }
+
+    for (j=0; j<nVector; j+=2) {
+        __m128d c[QE_KERNEL_INPUTS], w[QE_KERNEL_WEIGHTS], denom;
+        for (i=0; i<QE_KERNEL_INPUTS; i++) {
+            c[i] = _mm_sub_pd(_mm_mul_pd(_mm_loadu_pd(&in[i][j]), scale[i]), offset[i]);
+            _mm_storeu_pd(&out[QECurrent1+i][j], c[i]);
+        }
+        _mm_storeu_pd(&out[QESumAll][j], _mm_add_pd(_mm_add_pd(_mm_add_pd(c[0], c[1]), c[2]), c[3]));
+        for (k=0; k<QE_KERNEL_WEIGHTS; k++) {
+            w[k] = _mm_add_pd(_mm_add_pd(_mm_add_pd(_mm_mul_pd(weights[k][0], c[0]),
+                                                    _mm_mul_pd(weights[k][1], c[1])),
+                                                    _mm_mul_pd(weights[k][2], c[2])),
+                                                    _mm_mul_pd(weights[k][3], c[3]));
+        }
+        _mm_storeu_pd(&out[QESumX][j],  w[QEWeightSumX]);
+        _mm_storeu_pd(&out[QESumY][j],  w[QEWeightSumY]);
+        _mm_storeu_pd(&out[QEDiffX][j], w[QEWeightDiffX]);
+        _mm_storeu_pd(&out[QEDiffY][j], w[QEWeightDiffY]);
+        // Replace a zero denominator with 1
+        denom = w[QEWeightSumX];
+        denom = _mm_or_pd(_mm_andnot_pd(_mm_cmpeq_pd(denom, zero), denom), _mm_and_pd(_mm_cmpeq_pd(denom, zero), one));
+        _mm_storeu_pd(&out[QEPositionX][j],
+                      _mm_sub_pd(_mm_div_pd(_mm_mul_pd(posScale[0], w[QEWeightDiffX]), denom), posOffset[0]));
+        denom = w[QEWeightSumY];
+        denom = _mm_or_pd(_mm_andnot_pd(_mm_cmpeq_pd(denom, zero), denom), _mm_and_pd(_mm_cmpeq_pd(denom, zero), one));
+        _mm_storeu_pd(&out[QEPositionY][j],
+                      _mm_sub_pd(_mm_div_pd(_mm_mul_pd(posScale[1], w[QEWeightDiffY]), denom), posOffset[1]));
+    }
+    computeScalar(p, in, out, nVector, nSamples);
+}
+
+__attribute__((target("avx2")))
+static void kernelAVX2(const QEKernelParams_t *p, const double * const in[QE_KERNEL_INPUTS],
+                       double * const out[QE_KERNEL_OUTPUTS], size_t nSamples)
+{
+    size_t j;
+    int i, k;
+    __m256d scale[QE_KERNEL_INPUTS], offset[QE_KERNEL_INPUTS];
+    __m256d weights[QE_KERNEL_WEIGHTS][QE_KERNEL_INPUTS];
+    __m256d posScale[2], posOffset[2];
+    __m256d zero = _mm256_setzero_pd();
+    __m256d one = _mm256_set1_pd(1.0);
+    size_t nVector = nSamples & ~(size_t)3;
+
+    for (i=0; i<QE_KERNEL_INPUTS; i++) {
+        scale[i]  = _mm256_set1_pd(p->currentScale[i]);
+        offset[i] = _mm256_set1_pd(p->currentOffset[i]);
+        for (k=0; k<QE_KERNEL_WEIGHTS; k++) {
+            weights[k][i] = _mm256_set1_pd(p->weights[k][i]);
+        }
+    }
+    for (i=0; i<2; i++) {
+        posScale[i]  = _mm256_set1_pd(p->positionScale[i]);
+        posOffset[i] = _mm256_set1_pd(p->positionOffset[i]);
+    }
+
+    // Multiplies and adds are done separately rather than with FMA so the results are identical to the scalar kernel
+    for (j=0; j<nVector; j+=4) {
+        __m256d c[QE_KERNEL_INPUTS], w[QE_KERNEL_WEIGHTS], denom;
+        for (i=0; i<QE_KERNEL_INPUTS; i++) {
+            c[i] = _mm256_sub_pd(_mm256_mul_pd(_mm256_loadu_pd(&in[i][j]), scale[i]), offset[i]);
+            _mm256_storeu_pd(&out[QECurrent1+i][j], c[i]);
+        }
+        _mm256_storeu_pd(&out[QESumAll][j], _mm256_add_pd(_mm256_add_pd(_mm256_add_pd(c[0], c[1]), c[2]), c[3]));
+        for (k=0; k<QE_KERNEL_WEIGHTS; k++) {
+            w[k] = _mm256_add_pd(_mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(weights[k][0], c[0]),
+                                                             _mm256_mul_pd(weights[k][1], c[1])),
+                                                             _mm256_mul_pd(weights[k][2], c[2])),
+                                                             _mm256_mul_pd(weights[k][3], c[3]));
+        }
+        _mm256_storeu_pd(&out[QESumX][j],  w[QEWeightSumX]);
+        _mm256_storeu_pd(&out[QESumY][j],  w[QEWeightSumY]);
+        _mm256_storeu_pd(&out[QEDiffX][j], w[QEWeightDiffX]);
+        _mm256_storeu_pd(&out[QEDiffY][j], w[QEWeightDiffY]);
+        // Replace a zero denominator with 1
+        denom = _mm256_blendv_pd(w[QEWeightSumX], one, _mm256_cmp_pd(w[QEWeightSumX], zero, _CMP_EQ_OQ));
+        _mm256_storeu_pd(&out[QEPositionX][j],
+                         _mm256_sub_pd(_mm256_div_pd(_mm256_mul_pd(posScale[0], w[QEWeightDiffX]), denom), posOffset[0]));
+        denom = _mm256_blendv_pd(w[QEWeightSumY], one, _mm256_cmp_pd(w[QEWeightSumY], zero, _CMP_EQ_OQ));
+        _mm256_storeu_pd(&out[QEPositionY][j],
+                         _mm256_sub_pd(_mm256_div_pd(_mm256_mul_pd(posScale[1], w[QEWeightDiffY]), denom), posOffset[1]));
+    }
+    computeScalar(p, in, out, nVector, nSamples);
+}
+
+#endif /* QE_KERNEL_X86 */
+
+// Supported kernels, slowest first
+static QEKernel_t kernels[3];
+static int numKernels;
+static epicsThreadOnceId kernelOnceId = EPICS_THREAD_ONCE_INIT;
+
+static void kernelInit(void *)
+{
+    kernels[numKernels].name = "scalar";
+    kernels[numKernels++].func = kernelScalar;
+#ifdef QE_KERNEL_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) {
+        kernels[numKernels].name = "SSE2";
+        kernels[numKernels++].func = kernelSSE2;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        kernels[numKernels].name = "AVX2";
+        kernels[numKernels++].func = kernelAVX2;
+    }
+#endif
+}
+
+const QEKernel_t *quadEMKernelGet(void)
+{
+    epicsThreadOnce(&kernelOnceId, kernelInit, NULL);
+    return &kernels[numKernels-1];
+}
+
+int quadEMKernelList(const QEKernel_t **pKernels)
+{
+    epicsThreadOnce(&kernelOnceId, kernelInit, NULL);
+    *pKernels = kernels;
+    return numKernels;
+}
+
+void quadEMKernelWeights(int geometry, const double customWeights[QE_KERNEL_WEIGHTS][QE_KERNEL_INPUTS],
+                         double weights[QE_KERNEL_WEIGHTS][QE_KERNEL_INPUTS])
+{
+    static const double square[QE_KERNEL_WEIGHTS][QE_KERNEL_INPUTS] = {
+        { 1,  1,  1,  1},
+        { 1,  1,  1,  1},
+        {-1,  1,  1, -1},
+        { 1,  1, -1, -1}
+    };
+    static const double squareCC[QE_KERNEL_WEIGHTS][QE_KERNEL_INPUTS] = {
+        { 1,  1,  1,  1},
+        { 1,  1,  1,  1},
+        {-1, -1,  1,  1},
+        { 1, -1, -1,  1}
+    };
+    static const double diamond[QE_KERNEL_WEIGHTS][QE_KERNEL_INPUTS] = {
+        { 1,  1,  0,  0},
+        { 0,  0,  1,  1},
+        {-1,  1,  0,  0},
+        { 0,  0, -1,  1}
+    };
+    const double (*source)[QE_KERNEL_INPUTS];
+
+    switch (geometry) {
+        case QEGeometryDiamond:  source = diamond;       break;
+        case QEGeometrySquareCC: source = squareCC;      break;
+        case QEGeometryCustom:   source = customWeights; break;
+        default:                 source = square;        break;
+    }
+    memcpy(weights, source, sizeof(square));
+}
+
+/** iocsh command to measure the speed of each kernel for each geometry.
+  * \param[in] numSamples Number of samples in each block.
+  * \param[in] numLoops Number of times to process the block.
+  */
+static void quadEMKernelBenchmark(int numSamples, int numLoops)
+{
+    static const char *geometryNames[] = {"Diamond", "Square", "SquareCC", "Custom"};
+    static const double customWeights[QE_KERNEL_WEIGHTS][QE_KERNEL_INPUTS] = {
+        { 1.0,  0.9,  1.1,  1.0},
+        { 0.8,  1.0,  1.0,  1.2},
+        {-1.0,  0.9,  1.1, -1.0},
+        { 0.8,  1.0, -1.0, -1.2}
+    };
+    const QEKernel_t *pKernels;
+    QEKernelParams_t params;
+    double *inBuff, *outBuff, *refBuff;
+    double *in[QE_KERNEL_INPUTS], *out[QE_KERNEL_OUTPUTS], *ref[QE_KERNEL_OUTPUTS];
+    epicsTimeStamp start, end;
+    double elapsed, maxDiff;
+    int nKernels;
+    int geometry, i, k, loop;
+    size_t j;
+
+    if (numSamples <= 0) numSamples = 1000;
+    if (numLoops <= 0) numLoops = 1000;
+    nKernels = quadEMKernelList(&pKernels);
+    inBuff  = (double *)malloc(QE_KERNEL_INPUTS * numSamples * sizeof(double));
+    outBuff = (double *)malloc(QE_KERNEL_OUTPUTS * numSamples * sizeof(double));
+    refBuff = (double *)malloc(QE_KERNEL_OUTPUTS * numSamples * sizeof(double));
+    for (i=0; i<QE_KERNEL_INPUTS; i++) {
+        in[i] = inBuff + i*numSamples;
+        for (j=0; j<(size_t)numSamples; j++) {
+            in[i][j] = rand() / (double)RAND_MAX;
+        }
+        // Include some samples with zero sums
+        in[i][0] = 0.;
+        params.currentScale[i] = 1.0 + 0.01*i;
+        params.currentOffset[i] = 0.001*i;
+    }
+    for (i=0; i<QE_KERNEL_OUTPUTS; i++) {
+        out[i] = outBuff + i*numSamples;
+        ref[i] = refBuff + i*numSamples;
+    }
+    for (i=0; i<2; i++) {
+        params.positionScale[i] = 1000.;
+        params.positionOffset[i] = 1.;
+    }
+
+    printf("Processing %d samples %d times, best kernel=%s\n", numSamples, numLoops, quadEMKernelGet()->name);
+    printf("Geometry  Kernel        Samples/s   Max. difference\n");
+    for (geometry=QEGeometryDiamond; geometry<=QEGeometryCustom; geometry++) {
+        quadEMKernelWeights(geometry, customWeights, params.weights);
+        kernelScalar(&params, in, ref, numSamples);
+        for (k=0; k<nKernels; k++) {
+            epicsTimeGetCurrent(&start);
+            for (loop=0; loop<numLoops; loop++) {
+                pKernels[k].func(&params, in, out, numSamples);
+            }
+            epicsTimeGetCurrent(&end);
+            elapsed = epicsTimeDiffInSeconds(&end, &start);
+            maxDiff = 0.;
+            for (i=0; i<QE_KERNEL_OUTPUTS; i++) {
+                for (j=0; j<(size_t)numSamples; j++) {
+                    double diff = fabs(out[i][j] - ref[i][j]);
+                    if (diff > maxDiff) maxDiff = diff;
+                }
+            }
+            printf("%-9s %-8s %14.4g   %g\n", geometryNames[geometry], pKernels[k].name,
+                   (elapsed > 0.) ? (double)numSamples * numLoops / elapsed : 0., maxDiff);
+        }
+    }
+    free(inBuff);
+    free(outBuff);
+    free(refBuff);
+}
+
+extern "C" {
+
+static const iocshArg benchmarkArg0 = { "number of samples", iocshArgInt};
+static const iocshArg benchmarkArg1 = { "number of loops", iocshArgInt};
+static const iocshArg * const benchmarkArgs[] = {&benchmarkArg0, &benchmarkArg1};
+static const iocshFuncDef benchmarkFuncDef = {"quadEMKernelBenchmark", 2, benchmarkArgs};
+static void benchmarkCallFunc(const iocshArgBuf *args)
+{
+    quadEMKernelBenchmark(args[0].ival, args[1].ival);
+}
+
+void quadEMKernelRegister(void)
+{
+    iocshRegister(&benchmarkFuncDef, benchmarkCallFunc);
+}
+
+epicsExportRegistrar(quadEMKernelRegister);
+
+}
@@ -0,0 +1,63 @@
+/*
+ * quadEMKernel.h
+ *
+ * Kernels that compute the currents, sums, differences and positions for a block of samples
+ *
+ * The input is in structure-of-arrays form, i.e. a separate array of raw values for each of the 4 inputs.
+ * The output is also structure-of-arrays, a separate array for each of the 11 values in QEData_t order.
+ * The geometry is handled with a 4x4 weight matrix, so all geometries use the same code path.
+ * There is a scalar implementation and SSE2 and AVX2 implementations on x86 with gcc or clang.
+ * The fastest implementation supported by the CPU is selected at run time.
+ */
+
+#ifndef QUADEM_KERNEL_H
+#define QUADEM_KERNEL_H
+
+#include <stddef.h>
+#include <shareLib.h>
+
+#define QE_KERNEL_INPUTS  4
+#define QE_KERNEL_OUTPUTS 11
+
+/* These enums give the rows of the weight matrix */
+typedef enum {
+    QEWeightSumX,
+    QEWeightSumY,
+    QEWeightDiffX,
+    QEWeightDiffY
+} QEWeight_t;
+
+#define QE_KERNEL_WEIGHTS (QEWeightDiffY+1)
+
+/** Parameters used by the kernels.
+  * current[i]   = raw[i]*currentScale[i] - currentOffset[i]
+  * sumAll       = current[0] + current[1] + current[2] + current[3]
+  * sumX, sumY, diffX, diffY = weights * current
+  * positionX    = positionScale[0]*diffX/sumX - positionOffset[0], with sumX=0 replaced by 1
+  * positionY    = positionScale[1]*diffY/sumY - positionOffset[1], with sumY=0 replaced by 1
+  */
+typedef struct {
+    double currentOffset[QE_KERNEL_INPUTS];
+    double currentScale[QE_KERNEL_INPUTS];
+    double weights[QE_KERNEL_WEIGHTS][QE_KERNEL_INPUTS];
+    double positionOffset[2];
+    double positionScale[2];
+} QEKernelParams_t;
+
+typedef void (*QEKernelFunc_t)(const QEKernelParams_t *params, const double * const in[QE_KERNEL_INPUTS],
+                               double * const out[QE_KERNEL_OUTPUTS], size_t nSamples);
+
+typedef struct {
+    const char *name;
+    QEKernelFunc_t func;
+} QEKernel_t;
+
+/** Returns the fastest kernel supported by this CPU */
+epicsShareFunc const QEKernel_t *quadEMKernelGet(void);
+/** Returns the number of kernels supported by this CPU, and a pointer to the array of them */
+epicsShareFunc int quadEMKernelList(const QEKernel_t **kernels);
+/** Fills in the weight matrix for a geometry.  customWeights is only used for QEGeometryCustom. */
+epicsShareFunc void quadEMKernelWeights(int geometry, const double customWeights[QE_KERNEL_WEIGHTS][QE_KERNEL_INPUTS],
+                                        double weights[QE_KERNEL_WEIGHTS][QE_KERNEL_INPUTS]);
+
+#endif
@@ -0,0 +1,71 @@
+/*
+ * quadEMLatency.h
+ *
+ * Lock-free histogram of latencies with log2 bins, used to measure the time spent in each stage of the data path.
+ *
+ * Each histogram is updated by a single thread with add(), and can be read by any thread without a lock.
+ * Bin 0 counts latencies < 1 microsecond, and bin n counts latencies from 2^(n-1) to 2^n microseconds.
+ * The last bin also counts all longer latencies.
+ * reset() can be called by any thread, but values added at the same time may be partly counted.
+ */
+
+#ifndef QUADEM_LATENCY_H
+#define QUADEM_LATENCY_H
+
+#include <atomic>
+
+#include <epicsTypes.h>
+
+#define QE_LATENCY_BINS 24
+
+class quadEMLatency {
+public:
+    quadEMLatency()
+    {
+        reset();
+    }
+
+    /** Adds a latency in nanoseconds */
+    void add(epicsUInt64 ns)
+    {
+        epicsUInt64 us = ns / 1000;
+        int bin = 0;
+
+        while ((bin < QE_LATENCY_BINS-1) && (us >= ((epicsUInt64)1 << bin))) bin++;
+        bins_[bin].fetch_add(1, std::memory_order_relaxed);
+        count_.fetch_add(1, std::memory_order_relaxed);
+        sum_.fetch_add(ns, std::memory_order_relaxed);
+        if (ns > max_.load(std::memory_order_relaxed)) max_.store(ns, std::memory_order_relaxed);
+    }
+
+    void reset()
+    {
+        int i;
+
+        for (i=0; i<QE_LATENCY_BINS; i++) {
+            bins_[i].store(0, std::memory_order_relaxed);
+        }
+        count_.store(0, std::memory_order_relaxed);
+        sum_.store(0, std::memory_order_relaxed);
+        max_.store(0, std::memory_order_relaxed);
+    }
+
+    epicsUInt64 count() const { return count_.load(std::memory_order_relaxed); }
+    epicsUInt64 bin(int i) const { return bins_[i].load(std::memory_order_relaxed); }
+    /** Returns the mean latency in microseconds */
+    double mean() const
+    {
+        epicsUInt64 n = count();
+        return (n > 0) ? sum_.load(std::memory_order_relaxed) / 1000. / n : 0.;
+    }
+    /** Returns the maximum latency in microseconds */
+    double max() const { return max_.load(std::memory_order_relaxed) / 1000.; }
+
+private:
+    std::atomic<epicsUInt64> bins_[QE_LATENCY_BINS];
+    std::atomic<epicsUInt64> count_;
+    std::atomic<epicsUInt64> sum_;
+    std::atomic<epicsUInt64> max_;
+};
+
+#endif
@@ -0,0 +1,115 @@
+/*
+ * quadEMListener.cpp
+ *
+ * iocsh command to measure the latency from when a quadEM driver receives the raw readings to when
+ * the listeners registered with drvQuadEM::addListener() are called.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include <epicsTypes.h>
+#include <epicsThread.h>
+#include <epicsTime.h>
+#include <iocsh.h>
+
+#include <epicsExport.h>
+#include "drvQuadEM.h"
+
+// Number of histogram bins.  Bin 0 is < 1 microsecond, bin n is 2^(n-1) to 2^n microseconds.
+#define LATENCY_BINS 20
+
+/** Listener that collects the latency of each call */
+class latencyListener : public quadEMListener {
+public:
+    latencyListener()
+      : numCalls(0), numSamples(0), sum(0.), min(0.), max(0.)
+    {
+        memset(histogram, 0, sizeof(histogram));
+    }
+
+    void samplesComputed(const QESample_t *pSamples, size_t nSamples, epicsUInt64 received)
+    {
+        double latency;
+        int bin;
+
+        latency = (epicsMonotonicGet() - received) * 1e-3;
+        if ((numCalls == 0) || (latency < min)) min = latency;
+        if ((numCalls == 0) || (latency > max)) max = latency;
+        sum += latency;
+        numCalls++;
+        numSamples += nSamples;
+        for (bin=0; (bin < LATENCY_BINS-1) && (latency >= (double)(1 << bin)); bin++) {}
+        histogram[bin]++;
+    }
+
+    epicsUInt64 numCalls;
+    epicsUInt64 numSamples;
+    double sum;
+    double min;
+    double max;
+    epicsUInt64 histogram[LATENCY_BINS];
+};
+
+/** iocsh command to measure the listener latency of a running quadEM driver.
+  * \param[in] portName The name of the quadEM asyn port.
+  * \param[in] seconds The time to collect the latencies.
+  */
+static void quadEMListenerBenchmark(const char *portName, double seconds)
+{
+    drvQuadEM *pQuadEM;
+    latencyListener listener;
+    int bin;
+
+    pQuadEM = dynamic_cast<drvQuadEM *>(findAsynPortDriver(portName));
+    if (!pQuadEM) {
+        printf("quadEMListenerBenchmark: cannot find quadEM port %s\n", portName ? portName : "");
+        return;
+    }
+    if (seconds <= 0.) seconds = 10.;
+    if (pQuadEM->addListener(&listener) != asynSuccess) {
+        printf("quadEMListenerBenchmark: cannot add listener to port %s\n", portName);
+        return;
+    }
+    epicsThreadSleep(seconds);
+    pQuadEM->removeListener(&listener);
+
+    printf("Port %s, %.1f seconds, calls=%llu, samples=%llu, samples/s=%.4g\n", portName, seconds,
+           (unsigned long long)listener.numCalls, (unsigned long long)listener.numSamples,
+           listener.numSamples / seconds);
+    if (listener.numCalls == 0) return;
+    printf("Latency (us): min=%.2f, mean=%.2f, max=%.2f\n",
+           listener.min, listener.sum / listener.numCalls, listener.max);
+    printf("Latency (us)      Calls\n");
+    for (bin=0; bin<LATENCY_BINS; bin++) {
+        if (listener.histogram[bin] == 0) continue;
+        if (bin == 0) {
+            printf("       < 1 %10llu\n", (unsigned long long)listener.histogram[bin]);
+        } else if (bin == LATENCY_BINS-1) {
+            printf("  >= %6d %10llu\n", 1 << (bin-1), (unsigned long long)listener.histogram[bin]);
+        } else {
+            printf("%6d-%-6d %8llu\n", 1 << (bin-1), 1 << bin, (unsigned long long)listener.histogram[bin]);
+        }
+    }
+}
+
+extern "C" {
+
+static const iocshArg benchmarkArg0 = { "port name", iocshArgString};
+static const iocshArg benchmarkArg1 = { "seconds", iocshArgDouble};
+static const iocshArg * const benchmarkArgs[] = {&benchmarkArg0, &benchmarkArg1};
+static const iocshFuncDef benchmarkFuncDef = {"quadEMListenerBenchmark", 2, benchmarkArgs};
+static void benchmarkCallFunc(const iocshArgBuf *args)
+{
+    quadEMListenerBenchmark(args[0].sval, args[1].dval);
+}
+
+void quadEMListenerRegister(void)
+{
+    iocshRegister(&benchmarkFuncDef, benchmarkCallFunc);
+}
+
+epicsExportRegistrar(quadEMListenerRegister);
+
+}
@@ -0,0 +1,155 @@
+/*
+ * quadEMRing.h
+ *
+ * Lock-free single-producer/single-consumer ring buffer of typed records.
+ *
+ * The producer adds records with reserve()/commit() or put(), and the consumer reads them with
+ * peek() and then removes them with release().
+ * The head and tail are 64-bit counts of the total number of records written and removed,
+ * so they never wrap around and can be used as absolute sample numbers.
+ *
+ * The producer can also remove the oldest records with dropOldest(), for example to make room
+ * when the ring is full.  This races with the consumer, so release() only succeeds if no records
+ * were dropped since the consumer read the tail.  If it fails the records that the consumer
+ * copied may have been overwritten and must be discarded.
+ */
+
+#ifndef QUADEM_RING_H
+#define QUADEM_RING_H
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <atomic>
+
+#include <epicsTypes.h>
+
+#define QE_CACHE_LINE_SIZE 64
+
+template <typename T>
+class quadEMRing {
+public:
+    quadEMRing(size_t capacity)
+        : capacity_(capacity), head_(0), tail_(0)
+    {
+        buffer_ = (T *)calloc(capacity, sizeof(T));
+    }
+
+    ~quadEMRing()
+    {
+        free(buffer_);
+    }
+
+    size_t capacity() const { return capacity_; }
+    epicsUInt64 head() const { return head_.load(std::memory_order_acquire); }
+    epicsUInt64 tail() const { return tail_.load(std::memory_order_acquire); }
+    size_t used() const { return (size_t)(head() - tail()); }
+    size_t freeSpace() const { return capacity_ - used(); }
+
+    /** Producer: returns pointers to space for n records, which can be in 2 pieces because of wrap-around.
+      * n must be <= freeSpace().  The records are not visible to the consumer until commit() is called. */
+    void reserve(size_t n, T **p1, size_t *n1, T **p2, size_t *n2)
+    {
+        size_t start = (size_t)(head_.load(std::memory_order_relaxed) % capacity_);
+        *p1 = buffer_ + start;
+        *n1 = (n < capacity_ - start) ? n : capacity_ - start;
+        *p2 = buffer_;
+        *n2 = n - *n1;
+    }
+
+    /** Producer: makes n reserved records visible to the consumer */
+    void commit(size_t n)
+    {
+        head_.store(head_.load(std::memory_order_relaxed) + n, std::memory_order_release);
+    }
+
+    /** Producer: copies n records into the ring.  Returns the number copied, which is less than n if there is not enough room. */
+    size_t put(const T *pIn, size_t n)
+    {
+        T *p1, *p2;
+        size_t n1, n2;
+        size_t nFree = freeSpace();
+        if (n > nFree) n = nFree;
+        reserve(n, &p1, &n1, &p2, &n2);
+        for (size_t i=0; i<n1; i++) p1[i] = pIn[i];
+        for (size_t i=0; i<n2; i++) p2[i] = pIn[n1+i];
+        commit(n);
+        return n;
+    }
+
+    /** Producer: removes up to n of the oldest records.  Returns the number removed. */
+    size_t dropOldest(size_t n)
+    {
+        epicsUInt64 tail = tail_.load(std::memory_order_acquire);
+        epicsUInt64 newTail;
+        do {
+            epicsUInt64 head = head_.load(std::memory_order_relaxed);
+            if (n > head - tail) n = (size_t)(head - tail);
+            newTail = tail + n;
+        } while (!tail_.compare_exchange_weak(tail, newTail, std::memory_order_acq_rel));
+        return n;
+    }
+
+    /** Producer: removes all records */
+    void flush()
+    {
+        dropOldest(capacity_);
+    }
+
+    /** Consumer: returns pointers to the n oldest records, which can be in 2 pieces because of wrap-around.
+      * n must be <= used().  tail is returned and must be passed to release(). */
+    void peek(size_t n, const T **p1, size_t *n1, const T **p2, size_t *n2, epicsUInt64 *tail) const
+    {
+        *tail = tail_.load(std::memory_order_acquire);
+        size_t start = (size_t)(*tail % capacity_);
+        *p1 = buffer_ + start;
+        *n1 = (n < capacity_ - start) ? n : capacity_ - start;
+        *p2 = buffer_;
+        *n2 = n - *n1;
+    }
+
+    /** Consumer: removes n records that were read with peek().
+      * Returns false if the producer dropped records after peek() was called, in which case the
+      * records that were read may have been overwritten. */
+    bool release(size_t n, epicsUInt64 tail)
+    {
+        return tail_.compare_exchange_strong(tail, tail + n, std::memory_order_acq_rel);
+    }
+
+    /** Consumer: copies up to n of the oldest records and removes them from the ring.  Returns the number copied. */
+    size_t get(T *pOut, size_t n)
+    {
+        const T *p1, *p2;
+        size_t n1, n2;
+        epicsUInt64 tail;
+        do {
+            size_t nUsed = used();
+            if (n > nUsed) n = nUsed;
+            peek(n, &p1, &n1, &p2, &n2, &tail);
+            for (size_t i=0; i<n1; i++) pOut[i] = p1[i];
+            for (size_t i=0; i<n2; i++) pOut[n1+i] = p2[i];
+        } while (!release(n, tail));
+        return n;
+    }
+
+    /** Consumer: removes the oldest records so that the tail is at least newTail */
+    void releaseTo(epicsUInt64 newTail)
+    {
+        epicsUInt64 tail = tail_.load(std::memory_order_acquire);
+        while ((tail < newTail) && !tail_.compare_exchange_weak(tail, newTail, std::memory_order_acq_rel)) {}
+    }
+
+private:
+    quadEMRing(const quadEMRing&);
+    quadEMRing& operator=(const quadEMRing&);
+
+    T *buffer_;
+    size_t capacity_;
+    // The head and tail are padded into separate cache lines so the producer and consumer do not contend
+    char pad0_[QE_CACHE_LINE_SIZE];
+    std::atomic<epicsUInt64> head_;
+    char pad1_[QE_CACHE_LINE_SIZE];
+    std::atomic<epicsUInt64> tail_;
+    char pad2_[QE_CACHE_LINE_SIZE];
+};
+
+#endif
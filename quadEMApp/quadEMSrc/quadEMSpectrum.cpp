@@ -0,0 +1,233 @@
+/*
+ * quadEMSpectrum.cpp
+ *
+ * Computes the amplitude spectra of all of the quadEM data values with Welch's method.
+ * See quadEMSpectrum.h for a description.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <epicsTypes.h>
+
+#include <epicsExport.h>
+#include "quadEMSpectrum.h"
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+/** Constructor for the quadEMSpectrum class.
+  * \param[in] numValues The number of values in each sample.
+  */
+quadEMSpectrum::quadEMSpectrum(int numValues)
+  : numValues_(numValues), fftSize_(0), hop_(1), numAverage_(1), numAveraged_(0),
+    history_(0), historyPos_(0), samplesToNextSegment_(0), window_(0),
+    cosTable_(0), sinTable_(0), bitReverse_(0), workRe_(0), workIm_(0), powerSum_(0), spectrum_(0)
+{
+    scale_[0] = scale_[1] = 1.;
+}
+
+quadEMSpectrum::~quadEMSpectrum()
+{
+    free(history_);
+    free(window_);
+    free(cosTable_);
+    free(sinTable_);
+    free(bitReverse_);
+    free(workRe_);
+    free(workIm_);
+    free(powerSum_);
+    free(spectrum_);
+}
+
+/** Sets the parameters and restarts the averaging.
+  * \param[in] fftSize Number of samples in each segment.  This is rounded down to a power of 2 between
+  *            QE_MIN_SPECTRUM_SIZE and QE_MAX_SPECTRUM_SIZE.
+  * \param[in] window The window function, QESpectrumWindow_t.
+  * \param[in] overlap The fraction by which segments overlap, 0 to 0.95.
+  * \param[in] numAverage The number of segments to average.
+  */
+void quadEMSpectrum::configure(int fftSize, int window, double overlap, int numAverage)
+{
+    int i, j, bits;
+    double x, sum;
+    int size = QE_MIN_SPECTRUM_SIZE;
+
+    while ((size < QE_MAX_SPECTRUM_SIZE) && (size*2 <= fftSize)) size *= 2;
+    if (size != fftSize_) {
+        fftSize_ = size;
+        history_    = (epicsFloat64 *)realloc(history_,    numValues_ * size * sizeof(epicsFloat64));
+        window_     = (epicsFloat64 *)realloc(window_,     size * sizeof(epicsFloat64));
+        cosTable_   = (epicsFloat64 *)realloc(cosTable_,   size/2 * sizeof(epicsFloat64));
+        sinTable_   = (epicsFloat64 *)realloc(sinTable_,   size/2 * sizeof(epicsFloat64));
+        bitReverse_ = (int *)         realloc(bitReverse_, size * sizeof(int));
+        workRe_     = (epicsFloat64 *)realloc(workRe_,     size * sizeof(epicsFloat64));
+        workIm_     = (epicsFloat64 *)realloc(workIm_,     size * sizeof(epicsFloat64));
+        powerSum_   = (epicsFloat64 *)realloc(powerSum_,   numValues_ * size/2 * sizeof(epicsFloat64));
+        free(spectrum_);
+        spectrum_   = (epicsFloat64 *)calloc(numValues_ * size/2, sizeof(epicsFloat64));
+        for (i=0; i<size/2; i++) {
+            cosTable_[i] = cos(2.*M_PI*i/size);
+            sinTable_[i] = -sin(2.*M_PI*i/size);
+        }
+        for (bits=0; (1<<bits) < size; bits++) {}
+        for (i=0; i<size; i++) {
+            bitReverse_[i] = 0;
+            for (j=0; j<bits; j++) {
+                if (i & (1<<j)) bitReverse_[i] |= 1 << (bits-1-j);
+            }
+        }
+    }
+    sum = 0.;
+    for (i=0; i<size; i++) {
+        x = 2.*M_PI*i/size;
+        switch (window) {
+            case QESpectrumWindowHann:
+                window_[i] = 0.5 - 0.5*cos(x);
+                break;
+            case QESpectrumWindowHamming:
+                window_[i] = 0.54 - 0.46*cos(x);
+                break;
+            case QESpectrumWindowBlackman:
+                window_[i] = 0.42 - 0.5*cos(x) + 0.08*cos(2.*x);
+                break;
+            default:
+                window_[i] = 1.;
+                break;
+        }
+        sum += window_[i];
+    }
+    // The amplitude spectrum is scaled so that a sine wave of amplitude A has a peak of A.
+    // scale_[0] is for the DC bin, and scale_[1] for the others, which include the negative frequencies.
+    scale_[0] = 1./sum;
+    scale_[1] = 2./sum;
+    if (overlap < 0.) overlap = 0.;
+    if (overlap > 0.95) overlap = 0.95;
+    hop_ = size - (int)(overlap*size + 0.5);
+    if (hop_ < 1) hop_ = 1;
+    numAverage_ = (numAverage > 0) ? numAverage : 1;
+    restart();
+}
+
+/** Discards the collected samples and the partial average, for example after a gap in the data */
+void quadEMSpectrum::restart()
+{
+    historyPos_ = 0;
+    samplesToNextSegment_ = fftSize_;
+    numAveraged_ = 0;
+    if (powerSum_) memset(powerSum_, 0, numValues_ * fftSize_/2 * sizeof(epicsFloat64));
+}
+
+/** Adds samples, and processes each segment that is complete.
+  * \param[in] pData The samples, nSamples*stride values.  The first numValues values of each sample are used.
+  * \param[in] nSamples The number of samples.
+  * \param[in] stride The number of values between the start of successive samples.
+  * \returns true if a new averaged spectrum is available.
+  */
+bool quadEMSpectrum::addSamples(const epicsFloat64 *pData, size_t nSamples, size_t stride)
+{
+    size_t j;
+    int i;
+    bool ready = false;
+
+    if (fftSize_ == 0) return false;
+    for (j=0; j<nSamples; j++) {
+        for (i=0; i<numValues_; i++) {
+            history_[i*fftSize_ + historyPos_] = pData[i];
+        }
+        pData += stride;
+        historyPos_ = (historyPos_ + 1) & (fftSize_ - 1);
+        if (--samplesToNextSegment_ > 0) continue;
+        samplesToNextSegment_ = hop_;
+        computeSegment();
+        if (++numAveraged_ >= numAverage_) {
+            ready = true;
+            for (i=0; i<numValues_*fftSize_/2; i++) {
+                spectrum_[i] = sqrt(powerSum_[i] / numAveraged_) * ((i % (fftSize_/2)) ? scale_[1] : scale_[0]);
+            }
+            memset(powerSum_, 0, numValues_ * fftSize_/2 * sizeof(epicsFloat64));
+            numAveraged_ = 0;
+        }
+    }
+    return ready;
+}
+
+/** Computes the FFT of the most recent fftSize_ samples of each value, and adds the squared magnitudes
+  * to powerSum_.  Values are transformed in pairs, one as the real part and the other as the imaginary part.
+  */
+void quadEMSpectrum::computeSegment()
+{
+    int i, k, n, pos;
+    int half = fftSize_/2;
+    const epicsFloat64 *pA, *pB;
+    epicsFloat64 meanA, meanB;
+    epicsFloat64 zRe, zIm, zcRe, zcIm;
+    epicsFloat64 *pPowerA, *pPowerB;
+
+    for (i=0; i<numValues_; i+=2) {
+        pA = history_ + i*fftSize_;
+        pB = (i+1 < numValues_) ? history_ + (i+1)*fftSize_ : 0;
+        meanA = 0.;
+        meanB = 0.;
+        for (n=0; n<fftSize_; n++) {
+            meanA += pA[n];
+            if (pB) meanB += pB[n];
+        }
+        meanA /= fftSize_;
+        meanB /= fftSize_;
+        // The oldest sample is at historyPos_.  Subtract the mean and apply the window.
+        for (n=0; n<fftSize_; n++) {
+            pos = (historyPos_ + n) & (fftSize_ - 1);
+            workRe_[n] = (pA[pos] - meanA) * window_[n];
+            workIm_[n] = pB ? (pB[pos] - meanB) * window_[n] : 0.;
+        }
+        fft(workRe_, workIm_);
+        // Separate the spectra of the 2 real inputs: A[k] = (Z[k] + conj(Z[N-k]))/2, B[k] = (Z[k] - conj(Z[N-k]))/2i
+        pPowerA = powerSum_ + i*half;
+        pPowerB = pB ? powerSum_ + (i+1)*half : 0;
+        for (k=0; k<half; k++) {
+            zRe  = workRe_[k];
+            zIm  = workIm_[k];
+            zcRe = workRe_[(fftSize_ - k) & (fftSize_ - 1)];
+            zcIm = -workIm_[(fftSize_ - k) & (fftSize_ - 1)];
+            pPowerA[k] += 0.25 * ((zRe + zcRe)*(zRe + zcRe) + (zIm + zcIm)*(zIm + zcIm));
+            if (pPowerB) {
+                pPowerB[k] += 0.25 * ((zIm - zcIm)*(zIm - zcIm) + (zRe - zcRe)*(zRe - zcRe));
+            }
+        }
+    }
+}
+
+/** In-place iterative radix-2 complex FFT of size fftSize_ */
+void quadEMSpectrum::fft(epicsFloat64 *re, epicsFloat64 *im)
+{
+    int i, j, k, size, halfSize, step;
+    epicsFloat64 tRe, tIm, wRe, wIm;
+
+    for (i=0; i<fftSize_; i++) {
+        j = bitReverse_[i];
+        if (j > i) {
+            tRe = re[i]; re[i] = re[j]; re[j] = tRe;
+            tIm = im[i]; im[i] = im[j]; im[j] = tIm;
+        }
+    }
+    for (size=2; size<=fftSize_; size*=2) {
+        halfSize = size/2;
+        step = fftSize_/size;
+        for (i=0; i<fftSize_; i+=size) {
+            for (k=0; k<halfSize; k++) {
+                wRe = cosTable_[k*step];
+                wIm = sinTable_[k*step];
+                j = i + k + halfSize;
+                tRe = wRe*re[j] - wIm*im[j];
+                tIm = wRe*im[j] + wIm*re[j];
+                re[j] = re[i+k] - tRe;
+                im[j] = im[i+k] - tIm;
+                re[i+k] += tRe;
+                im[i+k] += tIm;
+            }
+        }
+    }
+}
@@ -0,0 +1,72 @@
+/*
+ * quadEMSpectrum.h
+ *
+ * Computes the amplitude spectra of all of the quadEM data values with Welch's method.
+ *
+ * Samples are added with addSamples().  Each time fftSize samples have been collected a segment is
+ * processed: the mean is subtracted, the window is applied, and the FFT is computed.  The segments
+ * overlap by the requested fraction.  The squared magnitudes are averaged over numAverage segments,
+ * and then the spectrum is available with getSpectrum() and a new average is started.
+ *
+ * The values are real, so 2 values are transformed with each complex FFT, and the spectra of all
+ * of the values are computed together each time a segment is complete.
+ */
+
+#ifndef QUADEM_SPECTRUM_H
+#define QUADEM_SPECTRUM_H
+
+#include <stddef.h>
+#include <shareLib.h>
+#include <epicsTypes.h>
+
+#define QE_MIN_SPECTRUM_SIZE 16
+#define QE_MAX_SPECTRUM_SIZE 16384
+
+typedef enum {
+    QESpectrumWindowRectangular,
+    QESpectrumWindowHann,
+    QESpectrumWindowHamming,
+    QESpectrumWindowBlackman
+} QESpectrumWindow_t;
+
+class epicsShareClass quadEMSpectrum {
+public:
+    quadEMSpectrum(int numValues);
+    ~quadEMSpectrum();
+    void configure(int fftSize, int window, double overlap, int numAverage);
+    void restart();
+    bool addSamples(const epicsFloat64 *pData, size_t nSamples, size_t stride);
+    int fftSize() const { return fftSize_; }
+    int spectrumSize() const { return fftSize_/2; }
+    int numAveraged() const { return numAveraged_; }
+    const epicsFloat64 *getSpectrum(int value) const { return spectrum_ + value*(fftSize_/2); }
+
+private:
+    quadEMSpectrum(const quadEMSpectrum&);
+    quadEMSpectrum& operator=(const quadEMSpectrum&);
+    void computeSegment();
+    void fft(epicsFloat64 *re, epicsFloat64 *im);
+
+    int numValues_;
+    int fftSize_;
+    int hop_;
+    int numAverage_;
+    int numAveraged_;
+    // Circular buffer of the most recent fftSize_ samples of each value, and the position of the next sample
+    epicsFloat64 *history_;
+    int historyPos_;
+    int samplesToNextSegment_;
+    epicsFloat64 *window_;
+    epicsFloat64 scale_[2];
+    // FFT tables and work arrays
+    epicsFloat64 *cosTable_;
+    epicsFloat64 *sinTable_;
+    int *bitReverse_;
+    epicsFloat64 *workRe_;
+    epicsFloat64 *workIm_;
+    // Sum of the squared magnitudes over the segments, and the averaged amplitude spectrum
+    epicsFloat64 *powerSum_;
+    epicsFloat64 *spectrum_;
+};
+
+#endif
@@ -29,6 +29,7 @@
 
 #include <epicsExport.h>
 #include "drvPCR4.h"
+#include "quadEMAscii.h"
 
 #define PCR4_TIMEOUT 1
 #define MIN_VALUES_PER_READ_ASCII 10
@@ -36,12 +37,17 @@
 // Size of read buffer for binary data.  The max required for data is 40 bytes (4 doubles + NaN)
 // We make it twice this size for doing synchonization so it is guaranteed to contain intact NaN
 
-// Size of read buffer for ASCII data in units of char
-#define ASCII_BUFFER_SIZE 150
+// Size of read buffer for ASCII data in units of char.  Each read returns many lines.
+#define ASCII_BUFFER_SIZE 65536
+// Maximum number of samples passed to computePositionsBlock() at once
+#define ASCII_MAX_SAMPLES 4096
 
 static const char *driverName="drvPCR4";
 static void readThread(void *drvPvt);
 
+// The lines in the data stream that mark the start and end of a trigger
+static const char *ASCIIKeywords[] = {"TRGEVENTON", "TRGEVENTOFF"};
+
 static const char *ranges_v1[] = {
     "+- 50 uA"
 };
@@ -75,6 +81,7 @@ drvPCR4::drvPCR4(const char *portName, const char *QEPortName, int ringBufferSiz
     QEPortName_ = epicsStrDup(QEPortName);
     
     acquireStartEvent_ = epicsEventCreate(epicsEventEmpty);
+    readingActiveEvent_ = epicsEventCreate(epicsEventEmpty);
     numResync_ = 0;
 
     // Connect to the server
@@ -168,6 +175,8 @@ asynStatus drvPCR4::writeReadMeter()
 
 /** Read thread to read the data from the electrometer when it is in continuous acquire mode.
   * Reads the data, computes the sums and positions, and does callbacks.
+  * Each read returns all of the data available, which is split into lines with a quadEMLineSplitter.
+  * The samples are passed to computePositionsBlock() as blocks.
   */
 
 void drvPCR4::readThread(void)
@@ -191,9 +200,12 @@ void drvPCR4::readThread(void)
     // unsigned long long *i64Data = (unsigned long long *)charData;
     // unsigned char *pc;
     // unsigned long long lastValue;
-    char ASCIIData[ASCII_BUFFER_SIZE];
-    epicsFloat64 *f64Data = (epicsFloat64 *)ASCIIData;
-    char *inPtr;
+    quadEMLineSplitter lineSplitter(ASCII_BUFFER_SIZE);
+    const char *line;
+    size_t lineLength;
+    epicsFloat64 *blockData;
+    epicsFloat64 *pData;
+    size_t numBlock;
     size_t nRequested;
     static const char *functionName = "readThread";
 
@@ -214,12 +226,16 @@ void drvPCR4::readThread(void)
     }
     pasynOctet = (asynOctet *)pasynInterface->pinterface;
     octetPvt = pasynInterface->drvPvt;
+
+    // The buffer is too large for the stack of the thread
+    blockData = (epicsFloat64 *)malloc(ASCII_MAX_SAMPLES * QE_MAX_INPUTS * sizeof(epicsFloat64));
     
     /* Loop forever */
     lock();
     while (1) {
         if (acquiring_ == 0) {
             readingActive_ = 0;
+            epicsEventSignal(readingActiveEvent_);
             unlock();
             (void)epicsEventWait(acquireStartEvent_);
             lock();
@@ -227,20 +243,23 @@ void drvPCR4::readThread(void)
             numTrigEnds = 0;
             numTrigStarts = 0;
             nextExpectedEdge = 0;
+            // Discard any partial line from the previous acquisition
+            lineSplitter.reset();
             getIntegerParam(P_TriggerMode, &triggerMode);
             readingActive_ = 1;
+            epicsEventSignal(readingActiveEvent_);
         }
         // ASCII format
-        nRequested = sizeof(ASCIIData);
+        // Read all of the data that is available after the partial line from the previous read
+        nRequested = lineSplitter.writeSpace();
         unlock();
         pasynManager->lockPort(pasynUser);
-        status = pasynOctet->read(octetPvt, pasynUser, ASCIIData, nRequested, 
+        status = pasynOctet->read(octetPvt, pasynUser, lineSplitter.writePointer(), nRequested, 
                                   &nRead, &eomReason);
         pasynManager->unlockPort(pasynUser);
         lock();
 
-        if ((status != asynSuccess) || 
-            (eomReason != ASYN_EOM_EOS)) {
+        if (nRead == 0) {
             if (status != asynTimeout) {
                asynPrint(pasynUserSelf, ASYN_TRACE_ERROR, 
                     "%s::%s: unexpected error reading meter status=%d, nRead=%lu, eomReason=%d\n", 
@@ -253,35 +272,48 @@ void drvPCR4::readThread(void)
             }
             continue;
         }
-	
-        if (strstr(ASCIIData, "TRGEVENTON") != 0) {
-            // This is the rising edge of a trigger
-            numTrigStarts++;
-            if (nextExpectedEdge != 0) {
-                asynPrint(pasynUserSelf, ASYN_TRACE_ERROR, 
-                    "%s::%s Extra trigger start, numTrigStarts=%d, numTrigsEnds=%d\n", 
-                     driverName, functionName, numTrigStarts, numTrigEnds);
+        lineSplitter.commit(nRead);
+        readComplete();
+        numBlock = 0;
+        while (lineSplitter.nextLine(&line, &lineLength)) {
+            switch (quadEMFindKeyword(line, lineLength, ASCIIKeywords, 2)) {
+                case 0:
+                    // This is the rising edge of a trigger.  Process the samples before it first.
+                    computePositionsBlock(blockData, numBlock);
+                    numBlock = 0;
+                    numTrigStarts++;
+                    if (nextExpectedEdge != 0) {
+                        asynPrint(pasynUserSelf, ASYN_TRACE_ERROR, 
+                            "%s::%s Extra trigger start, numTrigStarts=%d, numTrigsEnds=%d\n", 
+                             driverName, functionName, numTrigStarts, numTrigEnds);
+                    }
+                    nextExpectedEdge = 1;
+                    break;
+                case 1:
+                    // This is the falling edge of a trigger.  Process the samples before it first.
+                    computePositionsBlock(blockData, numBlock);
+                    numBlock = 0;
+                    numTrigEnds++;
+                    if (nextExpectedEdge != 1) {
+                        asynPrint(pasynUserSelf, ASYN_TRACE_ERROR, 
+                            "%s::%s Extra trigger end, numTrigStarts=%d, numTrigsEnds=%d\n", 
+                             driverName, functionName, numTrigStarts, numTrigEnds);
+                    }
+                    nextExpectedEdge = 0;
+                    break;
+                default:
+                    pData = blockData + numBlock*QE_MAX_INPUTS;
+                    // Lines that are not complete samples are ignored
+                    if (quadEMParseDoubles(line, lineLength, pData, numChannels_) != numChannels_) break;
+                    for (i=numChannels_; i<QE_MAX_INPUTS; i++) pData[i] = 0.0;
+                    if (++numBlock == ASCII_MAX_SAMPLES) {
+                        computePositionsBlock(blockData, numBlock);
+                        numBlock = 0;
+                    }
+                    break;
             }
-            nextExpectedEdge = 1;
-        } 
-        else if (strstr(ASCIIData, "TRGEVENTOFF") != 0) {
-            // This is the falling edge of a trigger
-            numTrigEnds++;
-            if (nextExpectedEdge != 1) {
-                asynPrint(pasynUserSelf, ASYN_TRACE_ERROR, 
-                    "%s::%s Extra trigger end, numTrigStarts=%d, numTrigsEnds=%d\n", 
-                     driverName, functionName, numTrigStarts, numTrigEnds);
-            }
-            nextExpectedEdge = 0;
-         }
-         else {
-             inPtr = ASCIIData;
-             for (i=0; i<numChannels_; i++) {
-                 f64Data[i] = strtod(inPtr, &inPtr);
-             }
-             for (i=numChannels_; i<4; i++) f64Data[i] = 0.0;
-             computePositions(f64Data);
-         }
+        }
+        computePositionsBlock(blockData, numBlock);
         callParamCallbacks();
     }
 }
@@ -374,7 +406,7 @@ asynStatus drvPCR4::setAcquire(epicsInt32 value)
         // Wait for the read thread to stop
         while (readingActive_) {
             unlock();
-            epicsThreadSleep(0.01);
+            (void)epicsEventWaitWithTimeout(readingActiveEvent_, QE_READING_ACTIVE_WAIT);
             lock();
         }
 
@@ -433,6 +465,8 @@ asynStatus drvPCR4::setAcquire(epicsInt32 value)
                             PCR4_TIMEOUT, &nwrite);
 	}
         
+        // The read thread splits the data into lines itself, so it can read many lines at once
+        pasynOctetSyncIO->setInputEos(pasynUserMeter_, "", 0);
         // Notify the read thread if acquisition status has started
         epicsEventSignal(acquireStartEvent_);
 	acquiring_ = 1;
@@ -440,7 +474,7 @@ asynStatus drvPCR4::setAcquire(epicsInt32 value)
         // Wait for the read thread to start
         while (!readingActive_) {
             unlock();
-            epicsThreadSleep(0.01);
+            (void)epicsEventWaitWithTimeout(readingActiveEvent_, QE_READING_ACTIVE_WAIT);
             lock();
         }
     }
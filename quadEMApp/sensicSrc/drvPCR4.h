@@ -48,6 +48,7 @@ private:
     /* Our data */
     asynUser *pasynUserMeter_;
     epicsEventId acquireStartEvent_;
+    epicsEventId readingActiveEvent_;  // Signalled by the read thread when readingActive_ changes
     int readingActive_;
     int numResync_;
     char *QEPortName_;
@@ -260,6 +260,7 @@ drvT4UDirect_EM::drvT4UDirect_EM(const char *portName, const char *T4U_Address,
     setStringParam(P_Firmware, "1.48");
     setDoubleParam(P_Temperature, 1234.5);
     setIntegerParam(P_Geometry, 1);
+    updateProcessConfig();
     //-=-= TODO FIXME Figure out how SampleTime works with averaging
     setDoubleParam(P_SampleTime, 0.0001);
     acquiring_ = 1;
@@ -1082,12 +1083,14 @@ void drvT4UDirect_EM::dataReadThread(void)
     char udp_header[2];
     uint16_t packet_len;
     char *data_sink;
+    double *read_block;         // Currents for all reads in a packet
 
     //incoming_log = fopen("packet_log.txt", "w");
     status = asynSuccess;       // -=-= FIXME Used for a different call
 
     data_sink = new char[MAX_PACKET_SIZE];
     payload = new T4UFrame;	// Maximum size
+    read_block = new double[kT4U_MAX_DATA_SIZE * 4];
     // Loop forever
     lock();
     //-=-= FIXME IM 20241119 Remove the below line after restoring the locks
@@ -1236,13 +1239,10 @@ void drvT4UDirect_EM::dataReadThread(void)
 	    // For now, just send dummy values and clear the buffer
 	    int32_t num_reads = bc_hdr_.num_reads;
 	    uint32_t *curr_raw = (uint32_t *)bc_data_payload_;
-	    double read_vals[4];
-	    read_vals[1] = 100;
-	    read_vals[2] = 100;
-	    read_vals[3] = 100;
-	    read_vals[0] = 100;
+	    double *read_vals = read_block;
+	    int32_t read_idx;
 	    
-	    for (int32_t read_idx = 0; (read_idx < num_reads) && (read_idx < kT4U_MAX_DATA_SIZE); read_idx++)
+	    for (read_idx = 0; (read_idx < num_reads) && (read_idx < kT4U_MAX_DATA_SIZE); read_idx++)
 	    {
 		if (bc_hdr_.units) // Reading current
 		{
@@ -1259,9 +1259,13 @@ void drvT4UDirect_EM::dataReadThread(void)
 		    read_vals[3] = (rawToCurrent(curr_raw[3])-calOffset_[3]) / calSlope_[3];
 		}
 		curr_raw += 4;
-                
-		computePositions(read_vals);
+		read_vals += 4;
 	    }
+	    readComplete();
+	    // The packet time stamp is in units of 100 ns, it is used for the sample timestamps
+	    setDeviceTime(payload->metadata.timestamp * 1e-7);
+	    // Process the whole packet as a single block
+	    computePositionsBlock(read_block, read_idx);
 	}
          
         callParamCallbacks();
@@ -15,6 +15,7 @@
 #include <errno.h>
 #include <math.h>
 #include <cstdint>
+#include <vector>
 
 #include <epicsTypes.h>
 #include <epicsTime.h>
@@ -220,6 +221,7 @@ drvT4U_EM::drvT4U_EM(const char *portName, const char *qtHostAddress, int ringBu
     setStringParam(P_Firmware, "1.48");
     setDoubleParam(P_Temperature, 1234.5);
     setIntegerParam(P_Geometry, 1);
+    updateProcessConfig();
     //-=-= TODO FIXME Figure out how SampleTime works with averaging
     //setDoubleParam(P_SampleTime, 0.00025);
     acquiring_ = 1;
@@ -782,6 +784,7 @@ void drvT4U_EM::dataReadThread(void)
     const int32_t kREAD_TEXT = 0;
     const int32_t kREAD_BINARY = 1;
     int32_t read_path;          // Whether we read via text or via binary
+    std::vector<double> read_block; // Currents for all reads in a binary packet
     
     //static const char *functionName = "dataReadThread";
 
@@ -829,14 +832,11 @@ void drvT4U_EM::dataReadThread(void)
         //printf("Received %i counts\n", data_read);
         if (data_read > 0)
         {
+            readComplete();
             if (read_path == kREAD_TEXT) // We read from a text command
             {
                 // Just use the given values
-                for (int data_idx = 0; data_idx < (data_read*4); )
-                {
-                    data_idx += 4;
-                    computePositions(&readCurr_[data_idx-4]);
-                }
+                computePositionsBlock(readCurr_, data_read);
             }
             else if (read_path == kREAD_BINARY) // We read from binary
             {
@@ -844,12 +844,10 @@ void drvT4U_EM::dataReadThread(void)
                 // For now, just send dummy values and clear the buffer
                 int32_t num_reads = bc_hdr_.num_reads;
                 uint32_t *curr_raw = (uint32_t *)bc_data_payload_;
-                double read_vals[4];
-                read_vals[1] = 100;
-                read_vals[2] = 100;
-                read_vals[3] = 100;
-                read_vals[0] = 100;
+                double *read_vals;
 
+                read_block.resize(num_reads * 4);
+                read_vals = read_block.data();
                 for (int32_t read_idx = 0; read_idx < num_reads; read_idx++)
                 {
                     if (bc_hdr_.units) // Reading current
@@ -867,9 +865,10 @@ void drvT4U_EM::dataReadThread(void)
                         read_vals[3] = (rawToCurrent(curr_raw[3])-calOffset_[3]) / calSlope_[3];
                     }
                     curr_raw += 4;
-                    
-                    computePositions(read_vals);
+                    read_vals += 4;
                 }
+                // Process the whole packet as a single block
+                computePositionsBlock(read_block.data(), num_reads);
 
                 
                 delete bc_data_payload_;
@@ -0,0 +1,225 @@
+/*
+ * tetrAMMFramerTest.cpp
+ *
+ * Host tests of the tetrAMMFramer class with streams that are split into reads at every offset,
+ * have bytes removed or corrupted, and have the data marker that is found when resynchronizing split across reads.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#include <epicsUnitTest.h>
+#include <testMain.h>
+
+#include "tetrAMMDecode.h"
+
+#define BUFFER_SIZE 4096
+#define MAX_SAMPLES (BUFFER_SIZE/16)
+#define MAX_EVENTS 64
+// Every TRIGGER_PERIOD'th record is a trigger start rather than data
+#define TRIGGER_PERIOD 100
+#define NUM_RECORDS 2000
+
+typedef std::vector<unsigned char> stream_t;
+
+static void putBigEndian(unsigned char *p, epicsUInt64 value)
+{
+    int i;
+
+    for (i=7; i>=0; i--) {
+        p[i] = (unsigned char)(value & 0xff);
+        value >>= 8;
+    }
+}
+
+/* Record i has the values i, i+0.25, i+0.5, i+0.75 in the channels */
+static void makeStream(int numChannels, stream_t &stream)
+{
+    unsigned char record[(TETRAMM_MAX_CHANNELS+1) * TETRAMM_BYTES_PER_VALUE];
+    size_t recordSize = (numChannels + 1) * TETRAMM_BYTES_PER_VALUE;
+    epicsUInt64 u;
+    double d;
+    int i, k;
+
+    stream.clear();
+    for (i=0; i<NUM_RECORDS; i++) {
+        for (k=0; k<numChannels; k++) {
+            d = i + k*0.25;
+            memcpy(&u, &d, sizeof(u));
+            putBigEndian(record + k*TETRAMM_BYTES_PER_VALUE, u);
+        }
+        putBigEndian(record + numChannels*TETRAMM_BYTES_PER_VALUE,
+                     (i % TRIGGER_PERIOD == 0) ? TETRAMM_MARKER_TRIG_START : TETRAMM_MARKER_DATA);
+        stream.insert(stream.end(), record, record + recordSize);
+    }
+}
+
+typedef struct {
+    size_t numSamples;
+    size_t numTriggers;
+    size_t numLostSync;
+    int numBad;           /* Samples that are out of order or have the wrong values */
+    int numBadTriggers;   /* Trigger events that are not before the sample of the next record */
+} result_t;
+
+/* Feeds the stream to the framer in reads of chunkSize bytes, or random sizes up to 1500 if chunkSize is 0 */
+static void runFramer(tetrAMMFramer &framer, int numChannels, const stream_t &stream, size_t chunkSize,
+                      result_t *pResult)
+{
+    static double samples[MAX_SAMPLES * TETRAMM_MAX_CHANNELS];
+    TetrAMMEvent_t events[MAX_EVENTS];
+    size_t numSamples, numEvents;
+    size_t pos = 0, n, j, e;
+    double value, last = -1.;
+    bool triggerPending = false;
+    int k;
+
+    memset(pResult, 0, sizeof(*pResult));
+    framer.reset(numChannels);
+    framer.resetStatistics();
+    while (pos < stream.size()) {
+        n = chunkSize ? chunkSize : 1 + rand() % 1500;
+        if (n > framer.writeSpace()) n = framer.writeSpace();
+        if (n > stream.size() - pos) n = stream.size() - pos;
+        memcpy(framer.writePointer(), &stream[pos], n);
+        framer.commit(n);
+        pos += n;
+        while (framer.decode(samples, MAX_SAMPLES, &numSamples, events, MAX_EVENTS, &numEvents)) {
+            e = 0;
+            for (j=0; j<numSamples; j++) {
+                for (; (e < numEvents) && (events[e].sample == j); e++) {
+                    if (events[e].type == TetrAMMEventTrigStart) {
+                        pResult->numTriggers++;
+                        triggerPending = true;
+                    }
+                    if (events[e].type == TetrAMMEventLostSync) pResult->numLostSync++;
+                }
+                value = samples[j*TETRAMM_MAX_CHANNELS];
+                if ((value <= last) || (value != (int)value)) pResult->numBad++;
+                for (k=1; k<numChannels; k++) {
+                    if (samples[j*TETRAMM_MAX_CHANNELS + k] != value + k*0.25) pResult->numBad++;
+                }
+                // A trigger start record is followed by the data record after it, unless bytes were lost
+                if (triggerPending && ((int)value % TRIGGER_PERIOD != 1) && (pResult->numLostSync == 0)) {
+                    pResult->numBadTriggers++;
+                }
+                triggerPending = false;
+                last = value;
+                pResult->numSamples++;
+            }
+            for (; e < numEvents; e++) {
+                if (events[e].type == TetrAMMEventTrigStart) {
+                    pResult->numTriggers++;
+                    triggerPending = true;
+                }
+                if (events[e].type == TetrAMMEventLostSync) pResult->numLostSync++;
+            }
+        }
+    }
+}
+
+/* A stream that is split into reads of every size up to 2 records has every sample and trigger */
+static void testSplit(tetrAMMFramer &framer, int numChannels)
+{
+    stream_t stream;
+    result_t result;
+    size_t recordSize = (numChannels + 1) * TETRAMM_BYTES_PER_VALUE;
+    size_t chunkSize;
+    bool ok = true;
+
+    makeStream(numChannels, stream);
+    for (chunkSize=1; chunkSize<=2*recordSize+1; chunkSize++) {
+        runFramer(framer, numChannels, stream, chunkSize, &result);
+        if ((result.numSamples != NUM_RECORDS - NUM_RECORDS/TRIGGER_PERIOD) ||
+            (result.numTriggers != NUM_RECORDS/TRIGGER_PERIOD) ||
+            result.numLostSync || result.numBad || result.numBadTriggers || framer.numResync() ||
+            framer.droppedBytes() || framer.droppedSamples()) {
+            testDiag("chunkSize=%d samples=%d triggers=%d lostSync=%d bad=%d badTriggers=%d resync=%d",
+                     (int)chunkSize, (int)result.numSamples, (int)result.numTriggers, (int)result.numLostSync,
+                     result.numBad, result.numBadTriggers, framer.numResync());
+            ok = false;
+        }
+    }
+    testOk(ok, "numChannels=%d split into reads of 1 to %d bytes", numChannels, (int)(2*recordSize+1));
+}
+
+/* A corrupted marker loses sync once, and the framer resynchronizes on the data marker of the next record,
+ * including when that marker is split across reads */
+static void testCorruptMarker(tetrAMMFramer &framer, int numChannels)
+{
+    stream_t stream;
+    result_t result;
+    size_t recordSize = (numChannels + 1) * TETRAMM_BYTES_PER_VALUE;
+    size_t chunkSize;
+    size_t expected;
+    bool ok = true;
+    // Record 555 is data, and so is the record after it
+    size_t bad = 555;
+
+    makeStream(numChannels, stream);
+    stream[bad*recordSize + numChannels*TETRAMM_BYTES_PER_VALUE + 3] ^= 0x55;
+    // The corrupted record and the record whose marker is found are dropped
+    expected = NUM_RECORDS - NUM_RECORDS/TRIGGER_PERIOD - 2;
+    for (chunkSize=1; chunkSize<=recordSize+1; chunkSize++) {
+        runFramer(framer, numChannels, stream, chunkSize, &result);
+        if ((result.numSamples != expected) || (result.numLostSync != 1) || (framer.numResync() != 1) ||
+            (framer.droppedBytes() != 2*recordSize) || (framer.droppedSamples() != 2) || result.numBad) {
+            testDiag("chunkSize=%d samples=%d lostSync=%d resync=%d droppedBytes=%d droppedSamples=%d bad=%d",
+                     (int)chunkSize, (int)result.numSamples, (int)result.numLostSync, framer.numResync(),
+                     (int)framer.droppedBytes(), (int)framer.droppedSamples(), result.numBad);
+            ok = false;
+        }
+    }
+    testOk(ok, "numChannels=%d corrupted marker resynchronizes once with reads of 1 to %d bytes",
+           numChannels, (int)(recordSize+1));
+}
+
+/* Bytes removed from the stream lose sync, every loss of sync is followed by a resynchronization,
+ * and the samples that are decoded are all valid */
+static void testDroppedBytes(tetrAMMFramer &framer, int numChannels)
+{
+    stream_t stream, damaged;
+    result_t result;
+    size_t recordSize = (numChannels + 1) * TETRAMM_BYTES_PER_VALUE;
+    size_t i, n, maxLost = 0;
+    int numDrops = 0;
+
+    makeStream(numChannels, stream);
+    srand(numChannels);
+    for (i=0; i<stream.size(); ) {
+        // Remove 1 to recordSize-1 bytes, so the alignment is always lost
+        if ((i > 0) && (rand() % 5000 == 0)) {
+            n = 1 + rand() % (recordSize - 1);
+            i += n;
+            maxLost += (n + recordSize - 1)/recordSize + 1;
+            numDrops++;
+            continue;
+        }
+        damaged.push_back(stream[i++]);
+    }
+    runFramer(framer, numChannels, damaged, 0, &result);
+    testDiag("numChannels=%d drops=%d samples=%d lostSync=%d resync=%d droppedBytes=%d droppedSamples=%d",
+             numChannels, numDrops, (int)result.numSamples, (int)result.numLostSync, framer.numResync(),
+             (int)framer.droppedBytes(), (int)framer.droppedSamples());
+    testOk((numDrops > 0) && (result.numLostSync == (size_t)numDrops) && (framer.numResync() == numDrops),
+           "numChannels=%d each of the removed byte ranges loses sync and resynchronizes", numChannels);
+    testOk((result.numBad == 0) &&
+           (result.numSamples + maxLost >= (size_t)(NUM_RECORDS - NUM_RECORDS/TRIGGER_PERIOD)),
+           "numChannels=%d the decoded samples are valid and only the damaged records are lost", numChannels);
+}
+
+MAIN(tetrAMMFramerTest)
+{
+    tetrAMMFramer framer(BUFFER_SIZE);
+    int numChannels;
+
+    testPlan(4*4);
+    testDiag("Decoder %s", framer.decoderName());
+    for (numChannels=1; numChannels<=TETRAMM_MAX_CHANNELS; numChannels++) {
+        testSplit(framer, numChannels);
+        testCorruptMarker(framer, numChannels);
+        testDroppedBytes(framer, numChannels);
+    }
+    return testDone();
+}